@@ -0,0 +1,387 @@
+#include "blocked.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "parallel.h"
+#include "pool.h"
+#include "simd.h"
+
+namespace litecnn {
+
+namespace {
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LITECNN_X86 1
+#endif
+
+// Output pixels of a row that are computed together, one accumulator each.
+const int64_t kTile = 8;
+
+template <typename T>
+struct ConvArgs {
+  const T* u;     // (kb,ib,fh,fw,ci,cb)
+  const T* bias;  // (kb*cb)
+  const T* x;     // (n,ib,hp,wp,ci), padded so that no read needs a check
+  T* out;         // (n,kb,h2,w2,cb)
+  int64_t ib, hp, wp, ci, kb, fh, fw, s, h2, w2;
+};
+
+struct PoolArgs {
+  int64_t h, w, s;
+};
+
+// Row oh of output channel block k of image n, written to o (w2,cb). Every
+// filter tap is one vector of cb output channels, multiplied by kTile input
+// pixels of one channel; always inlined like the loops of simd.cc.
+template <int kBytes, typename T>
+inline __attribute__((always_inline)) void ConvRow(const ConvArgs<T>& a,
+                                                   int64_t n, int64_t k,
+                                                   int64_t oh, T* o) {
+  typedef T Vec __attribute__((vector_size(kBytes)));
+  const int64_t cb = kBytes / sizeof(T);
+  const int64_t xstep = a.s * a.ci;
+  Vec b;
+  std::memcpy(&b, a.bias + k * cb, sizeof(Vec));
+  const T* uk = a.u + k * a.ib * a.fh * a.fw * a.ci * cb;
+  for (int64_t ow0 = 0; ow0 < a.w2; ow0 += kTile) {
+    Vec acc[kTile];
+    for (int64_t t = 0; t < kTile; t++) {
+      acc[t] = b;
+    }
+    for (int64_t c = 0; c < a.ib; c++) {
+      for (int64_t i = 0; i < a.fh; i++) {
+        int64_t row = (n * a.ib + c) * a.hp + oh * a.s + i;
+        const T* xr = a.x + (row * a.wp + ow0 * a.s) * a.ci;
+        const T* ur = uk + (c * a.fh + i) * a.fw * a.ci * cb;
+        for (int64_t j = 0; j < a.fw * a.ci; j++) {
+          Vec uv;
+          std::memcpy(&uv, ur + j * cb, sizeof(Vec));
+          const T* xp = xr + j;
+          for (int64_t t = 0; t < kTile; t++) {
+            acc[t] += xp[t * xstep] * uv;
+          }
+        }
+      }
+    }
+    int64_t tile = std::min(kTile, a.w2 - ow0);
+    for (int64_t t = 0; t < tile; t++) {
+      std::memcpy(o + (ow0 + t) * cb, &acc[t], sizeof(Vec));
+    }
+  }
+}
+
+template <int kBytes, typename T>
+inline __attribute__((always_inline)) void ConvPlane(const ConvArgs<T>& a,
+                                                     int64_t n, int64_t k) {
+  const int64_t cb = kBytes / sizeof(T);
+  T* o = a.out + (n * a.kb + k) * a.h2 * a.w2 * cb;
+  for (int64_t oh = 0; oh < a.h2; oh++) {
+    ConvRow<kBytes>(a, n, k, oh, o + oh * a.w2 * cb);
+  }
+}
+
+// ConvPlane followed by a relu and max pooling, one row of pooled outputs at
+// a time: the conv rows under it go to rows (ph,w2,cb), which stays in
+// cache, and are reduced from there. Rows shared by overlapping windows are
+// computed again. The relu is applied as the zero every maximum starts from,
+// max(0, max(window)) being the pooled relu.
+template <int kBytes, typename T>
+inline __attribute__((always_inline)) void ConvReluPoolPlane(
+    const ConvArgs<T>& a, const PoolArgs& pool, int64_t n, int64_t k,
+    T* rows) {
+  typedef T Vec __attribute__((vector_size(kBytes)));
+  const int64_t cb = kBytes / sizeof(T);
+  int64_t h3 = (a.h2 + pool.s - 1) / pool.s;
+  int64_t w3 = (a.w2 + pool.s - 1) / pool.s;
+  T* o = a.out + (n * a.kb + k) * h3 * w3 * cb;
+  for (int64_t oh = 0; oh < h3; oh++) {
+    int64_t r0 = oh * pool.s;
+    int64_t nr = std::min(pool.h, a.h2 - r0);
+    for (int64_t r = 0; r < nr; r++) {
+      ConvRow<kBytes>(a, n, k, r0 + r, rows + r * a.w2 * cb);
+    }
+    for (int64_t ow = 0; ow < w3; ow++) {
+      Vec m = Vec{};
+      int64_t c0 = ow * pool.s;
+      int64_t c1 = std::min(c0 + pool.w, a.w2);
+      for (int64_t r = 0; r < nr; r++) {
+        for (int64_t j = c0; j < c1; j++) {
+          Vec v;
+          std::memcpy(&v, rows + (r * a.w2 + j) * cb, sizeof(Vec));
+          m = v > m ? v : m;
+        }
+      }
+      std::memcpy(o + (oh * w3 + ow) * cb, &m, sizeof(Vec));
+    }
+  }
+}
+
+// Plane b of image n; windows always hold at least their first pixel.
+template <int kBytes, typename T>
+inline __attribute__((always_inline)) void PoolPlane(const T* x, int64_t h,
+                                                     int64_t w, int64_t ph,
+                                                     int64_t pw, int64_t s,
+                                                     T* out) {
+  typedef T Vec __attribute__((vector_size(kBytes)));
+  const int64_t cb = kBytes / sizeof(T);
+  int64_t h2 = (h + s - 1) / s;
+  int64_t w2 = (w + s - 1) / s;
+  for (int64_t oh = 0; oh < h2; oh++) {
+    for (int64_t ow = 0; ow < w2; ow++) {
+      Vec m;
+      std::memcpy(&m, x + (oh * s * w + ow * s) * cb, sizeof(Vec));
+      for (int64_t i = oh * s; i < std::min(oh * s + ph, h); i++) {
+        for (int64_t j = ow * s; j < std::min(ow * s + pw, w); j++) {
+          Vec v;
+          std::memcpy(&v, x + (i * w + j) * cb, sizeof(Vec));
+          m = v > m ? v : m;
+        }
+      }
+      std::memcpy(out + (oh * w2 + ow) * cb, &m, sizeof(Vec));
+    }
+  }
+}
+
+template <typename T>
+void ConvGeneric(const ConvArgs<T>& a, int64_t n, int64_t k) {
+  ConvPlane<16>(a, n, k);
+}
+
+template <typename T>
+void ConvReluPoolGeneric(const ConvArgs<T>& a, const PoolArgs& pool,
+                         int64_t n, int64_t k, T* rows) {
+  ConvReluPoolPlane<16>(a, pool, n, k, rows);
+}
+
+template <typename T>
+void PoolGeneric(const T* x, int64_t h, int64_t w, int64_t ph, int64_t pw,
+                 int64_t s, T* out) {
+  PoolPlane<16>(x, h, w, ph, pw, s, out);
+}
+
+#ifdef LITECNN_X86
+template <typename T>
+__attribute__((target("avx2"))) void ConvAvx2(const ConvArgs<T>& a,
+                                              int64_t n, int64_t k) {
+  ConvPlane<32>(a, n, k);
+}
+
+template <typename T>
+__attribute__((target("avx2"))) void ConvReluPoolAvx2(const ConvArgs<T>& a,
+                                                      const PoolArgs& pool,
+                                                      int64_t n, int64_t k,
+                                                      T* rows) {
+  ConvReluPoolPlane<32>(a, pool, n, k, rows);
+}
+
+template <typename T>
+__attribute__((target("avx2"))) void PoolAvx2(const T* x, int64_t h,
+                                              int64_t w, int64_t ph,
+                                              int64_t pw, int64_t s, T* out) {
+  PoolPlane<32>(x, h, w, ph, pw, s, out);
+}
+
+template <typename T>
+__attribute__((target("avx512f"))) void ConvAvx512(const ConvArgs<T>& a,
+                                                   int64_t n, int64_t k) {
+  ConvPlane<64>(a, n, k);
+}
+
+template <typename T>
+__attribute__((target("avx512f"))) void ConvReluPoolAvx512(
+    const ConvArgs<T>& a, const PoolArgs& pool, int64_t n, int64_t k,
+    T* rows) {
+  ConvReluPoolPlane<64>(a, pool, n, k, rows);
+}
+
+template <typename T>
+__attribute__((target("avx512f"))) void PoolAvx512(const T* x, int64_t h,
+                                                   int64_t w, int64_t ph,
+                                                   int64_t pw, int64_t s,
+                                                   T* out) {
+  PoolPlane<64>(x, h, w, ph, pw, s, out);
+}
+#endif
+
+// Everything of ConvArgs but out: x is copied into *padded with the border
+// (and room for the last tile of a row) zeroed, the bias into *bias_blocks
+// rounded up to whole blocks.
+template <typename T>
+ConvArgs<T> SetUpConv(const T* u, const T* bias, const T* x, int64_t n,
+                      int64_t ib, int64_t h, int64_t w, int64_t ci, int64_t k,
+                      int64_t fh, int64_t fw, int64_t s, int64_t p,
+                      PooledVector<T>* padded, PooledVector<T>* bias_blocks) {
+  int64_t cb = ChannelBlock<T>();
+  assert(ci == 1 || ci == cb);
+  ConvArgs<T> a;
+  a.u = u;
+  a.ib = ib;
+  a.ci = ci;
+  a.kb = (k + cb - 1) / cb;
+  a.fh = fh;
+  a.fw = fw;
+  a.s = s;
+  a.h2 = 1 + (h + 2 * p - fh) / s;
+  a.w2 = 1 + (w + 2 * p - fw) / s;
+  a.out = nullptr;
+  // The last tile of a row may run past w2; the padding covers its reads.
+  a.hp = h + 2 * p;
+  int64_t tiled = (a.w2 + kTile - 1) / kTile * kTile;
+  a.wp = std::max(w + 2 * p, (tiled - 1) * s + fw);
+  padded->assign(n * ib * a.hp * a.wp * ci, T(0));
+  T* pd = padded->data();
+  ParallelFor(0, n * ib, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      for (int64_t r = 0; r < h; r++) {
+        const T* src = x + (q * h + r) * w * ci;
+        std::copy(src, src + w * ci, pd + ((q * a.hp + r + p) * a.wp + p) * ci);
+      }
+    }
+  });
+  a.x = pd;
+  bias_blocks->assign(a.kb * cb, T(0));
+  std::copy(bias, bias + k, bias_blocks->begin());
+  a.bias = bias_blocks->data();
+  return a;
+}
+
+}  // namespace
+
+template <typename T>
+int64_t ChannelBlock() {
+  return SimdBytes() / sizeof(T);
+}
+
+template <typename T>
+void PackBlockedFilters(const T* w, int64_t k, int64_t c, int64_t fh,
+                        int64_t fw, int64_t ci, T* u) {
+  int64_t cb = ChannelBlock<T>();
+  int64_t kb = (k + cb - 1) / cb;
+  int64_t ib = (c + ci - 1) / ci;
+  std::fill(u, u + kb * ib * fh * fw * ci * cb, T(0));
+  for (int64_t f = 0; f < k; f++) {
+    for (int64_t ch = 0; ch < c; ch++) {
+      for (int64_t i = 0; i < fh; i++) {
+        for (int64_t j = 0; j < fw; j++) {
+          int64_t block = ((f / cb * ib + ch / ci) * fh + i) * fw + j;
+          u[(block * ci + ch % ci) * cb + f % cb] =
+              w[((f * c + ch) * fh + i) * fw + j];
+        }
+      }
+    }
+  }
+}
+
+template <typename T>
+void BlockedConv(const T* u, const T* bias, const T* x, int64_t n, int64_t ib,
+                 int64_t h, int64_t w, int64_t ci, int64_t k, int64_t fh,
+                 int64_t fw, int64_t s, int64_t p, T* out) {
+  PooledVector<T> padded;
+  PooledVector<T> bias_blocks;
+  ConvArgs<T> a = SetUpConv(u, bias, x, n, ib, h, w, ci, k, fh, fw, s, p,
+                            &padded, &bias_blocks);
+  a.out = out;
+  int simd = SimdBytes();
+  ParallelFor(0, n * a.kb, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      switch (simd) {
+#ifdef LITECNN_X86
+        case 64:
+          ConvAvx512(a, q / a.kb, q % a.kb);
+          break;
+        case 32:
+          ConvAvx2(a, q / a.kb, q % a.kb);
+          break;
+#endif
+        default:
+          ConvGeneric(a, q / a.kb, q % a.kb);
+      }
+    }
+  });
+}
+
+template <typename T>
+void BlockedConvReluPool(const T* u, const T* bias, const T* x, int64_t n,
+                         int64_t ib, int64_t h, int64_t w, int64_t ci,
+                         int64_t k, int64_t fh, int64_t fw, int64_t s,
+                         int64_t p, int64_t ph, int64_t pw, int64_t ps,
+                         T* out) {
+  PooledVector<T> padded;
+  PooledVector<T> bias_blocks;
+  ConvArgs<T> a = SetUpConv(u, bias, x, n, ib, h, w, ci, k, fh, fw, s, p,
+                            &padded, &bias_blocks);
+  a.out = out;
+  PoolArgs pool = {ph, pw, ps};
+  int64_t cb = ChannelBlock<T>();
+  int simd = SimdBytes();
+  ParallelFor(0, n * a.kb, [&](int64_t begin, int64_t end) {
+    PooledVector<T> rows(ph * a.w2 * cb);
+    for (int64_t q = begin; q < end; q++) {
+      switch (simd) {
+#ifdef LITECNN_X86
+        case 64:
+          ConvReluPoolAvx512(a, pool, q / a.kb, q % a.kb, rows.data());
+          break;
+        case 32:
+          ConvReluPoolAvx2(a, pool, q / a.kb, q % a.kb, rows.data());
+          break;
+#endif
+        default:
+          ConvReluPoolGeneric(a, pool, q / a.kb, q % a.kb, rows.data());
+      }
+    }
+  });
+}
+
+template <typename T>
+void BlockedMaxPool(const T* x, int64_t n, int64_t b, int64_t h, int64_t w,
+                    int64_t ph, int64_t pw, int64_t s, T* out) {
+  int64_t cb = ChannelBlock<T>();
+  int64_t plane = h * w * cb;
+  int64_t plane2 = (h + s - 1) / s * ((w + s - 1) / s) * cb;
+  int simd = SimdBytes();
+  ParallelFor(0, n * b, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      switch (simd) {
+#ifdef LITECNN_X86
+        case 64:
+          PoolAvx512(x + q * plane, h, w, ph, pw, s, out + q * plane2);
+          break;
+        case 32:
+          PoolAvx2(x + q * plane, h, w, ph, pw, s, out + q * plane2);
+          break;
+#endif
+        default:
+          PoolGeneric(x + q * plane, h, w, ph, pw, s, out + q * plane2);
+      }
+    }
+  });
+}
+
+#define LITECNN_INSTANTIATE_BLOCKED(T)                                        \
+  template int64_t ChannelBlock<T>();                                         \
+  template void PackBlockedFilters<T>(const T* w, int64_t k, int64_t c,       \
+                                      int64_t fh, int64_t fw, int64_t ci,     \
+                                      T* u);                                  \
+  template void BlockedConv<T>(const T* u, const T* bias, const T* x,         \
+                               int64_t n, int64_t ib, int64_t h, int64_t w,   \
+                               int64_t ci, int64_t k, int64_t fh, int64_t fw, \
+                               int64_t s, int64_t p, T* out);                 \
+  template void BlockedConvReluPool<T>(                                        \
+      const T* u, const T* bias, const T* x, int64_t n, int64_t ib, int64_t h, \
+      int64_t w, int64_t ci, int64_t k, int64_t fh, int64_t fw, int64_t s,     \
+      int64_t p, int64_t ph, int64_t pw, int64_t ps, T* out);                  \
+  template void BlockedMaxPool<T>(const T* x, int64_t n, int64_t b,           \
+                                  int64_t h, int64_t w, int64_t ph,           \
+                                  int64_t pw, int64_t s, T* out);
+
+LITECNN_INSTANTIATE_BLOCKED(float)
+LITECNN_INSTANTIATE_BLOCKED(double)
+
+#undef LITECNN_INSTANTIATE_BLOCKED
+
+}  // namespace litecnn
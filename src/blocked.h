@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+namespace litecnn {
+
+// Direct convolution and max pooling over the channel-blocked layout
+// (n, c/cb, h, w, cb): channels are split into blocks of cb, stored as the
+// innermost dimension, so one SIMD vector holds the same pixel of cb
+// channels. Both kernels vectorize across the block of output channels and
+// never stride over whole images in their inner loops. See
+// Ndarray::to_blocked for the conversions. Instantiated for float and
+// double.
+
+// Channels per block for T: one vector of the kernel set in use (simd.h).
+template <typename T>
+int64_t ChannelBlock();
+
+// Repacks filters w (k,c,fh,fw) into u (ceil(k/cb),ceil(c/ci),fh,fw,ci,cb)
+// for inputs blocked by ci, cb = ChannelBlock<T>(). Missing channels are 0.
+template <typename T>
+void PackBlockedFilters(const T* w, int64_t k, int64_t c, int64_t fh,
+                        int64_t fw, int64_t ci, T* u);
+
+// out (n,kb,h2,w2,cb) = x (n,ib,h,w,ci), zero padded by p and read with
+// stride s, correlated with the filters packed into u, plus bias (k). ci is
+// ChannelBlock<T>() or 1, the latter being plain NCHW. out is overwritten.
+template <typename T>
+void BlockedConv(const T* u, const T* bias, const T* x, int64_t n, int64_t ib,
+                 int64_t h, int64_t w, int64_t ci, int64_t k, int64_t fh,
+                 int64_t fw, int64_t s, int64_t p, T* out);
+
+// BlockedConv, a relu and BlockedMaxPool with (ph,pw) windows every ps
+// pixels in one pass: out (n,kb,h3,w3,cb), h3 = ceil(h2/ps), is computed a
+// row of pooled outputs at a time from a few conv rows kept in cache, and
+// neither the conv output nor its relu is ever written out.
+template <typename T>
+void BlockedConvReluPool(const T* u, const T* bias, const T* x, int64_t n,
+                         int64_t ib, int64_t h, int64_t w, int64_t ci,
+                         int64_t k, int64_t fh, int64_t fw, int64_t s,
+                         int64_t p, int64_t ph, int64_t pw, int64_t ps,
+                         T* out);
+
+// out (n,b,h2,w2,cb) = max over (ph,pw) windows of x (n,b,h,w,cb) taken
+// every s pixels, h2 = ceil(h/s); windows are cut off at the border.
+template <typename T>
+void BlockedMaxPool(const T* x, int64_t n, int64_t b, int64_t h, int64_t w,
+                    int64_t ph, int64_t pw, int64_t s, T* out);
+
+}  // namespace litecnn
@@ -1,18 +1,25 @@
 #include "cnn.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <vector>
 
+#include "blocked.h"
+#include "expr.h"
 #include "layers.h"
 #include "loss.h"
 #include "ndarray.h"
+#include "optimizer.h"
+#include "parallel.h"
+#include "simd.h"
 
 namespace litecnn {
 
-SimpleConvNet::Config& SimpleConvNet::Config::validated() {
+template <typename T>
+typename SimpleConvNet<T>::Config& SimpleConvNet<T>::Config::validated() {
   assert(input_height > 0);
   assert(input_width > 0);
   assert(input_depth > 0);
@@ -22,128 +29,438 @@ SimpleConvNet::Config& SimpleConvNet::Config::validated() {
   assert(weight_scale > 0);
   assert(n_classes > 0);
   assert(reg >= 0);
+  assert(checkpoint_batch >= 0);
+  // batch statistics would only cover a chunk
+  assert(checkpoint_batch == 0 || !batch_norm);
   return *this;
 }
 
-SimpleConvNet::SimpleConvNet(SimpleConvNet::Config config)
+template <typename T>
+SimpleConvNet<T>::SimpleConvNet(SimpleConvNet::Config config)
     : config_(config.validated()),
       conv_(config.filter_size, config.filter_size, config.input_depth,
             config.n_filters, 1, (config.filter_size - 1) / 2,
             config.weight_scale),
+      bn_(config.n_filters),
       pool_(2, 2, 2),
       affine_(config.n_filters * ((config.input_height + 1) / 2) *
                   ((config.input_width + 1) / 2),
               config.hidden_dim, config.weight_scale),
       affine2_(config.hidden_dim, config.n_classes, config.weight_scale),
-      iter_(new std::atomic_int(0)) {}
+      folded_(conv_),
+      iter_(new std::atomic_int(0)) {
+  typename Optimizer<T>::Config optimizer = config.optimizer;
+  optimizer.weight_decay = config.reg;
+  optimizer_ = std::make_shared<Optimizer<T>>(optimizer);
+  optimizer_->init(params());
+}
 
-Ndarray SimpleConvNet::forward(const Ndarray& x) {
+// The conv block runs as one fused conv-relu-pool kernel in the
+// channel-blocked layout, converted to and from only here. Inputs whose depth
+// is not a whole number of blocks are read as plain NCHW, which the blocked
+// conv takes as blocks of one channel.
+template <typename T>
+Ndarray<T> SimpleConvNet<T>::forward(const Ndarray<T>& x) {
   assert(x.ndim() == 4);
   assert(x.shape(1) == config_.input_depth);
   assert(x.shape(2) == config_.input_height);
   assert(x.shape(3) == config_.input_width);
 
-  auto out1 = conv_.forward(x);
-  auto out2 = relu_.forward(out1);
-  auto out3 = pool_.forward(out2);
-  shape_before_affine_ = out3.shape();
-  auto out4 = out3.reshape(out3.shape(0), -1);
-  auto out5 = affine_.forward(out4);
+  int64_t c = ChannelBlock<T>();
+  Ndarray<T> xb = x.to_blocked(x.shape(1) % c == 0 ? c : 1);
+  Ndarray<T> out3;
+  if (config_.batch_norm) {
+    folded_conv().forward_relu_pool_blocked(xb, pool_, &out3);
+  } else {
+    conv_.forward_relu_pool_blocked(xb, pool_, &out3);
+  }
+  auto out4 = out3.from_blocked(config_.n_filters);
+  auto out5 = affine_.forward(out4.reshape(out4.shape(0), -1));
   auto out6 = relu2_.forward(out5);
   auto out7 = affine2_.forward(out6);
   return out7;
 }
 
-Ndarray SimpleConvNet::backward(const Ndarray& dscores) {
-  auto dout6 = affine2_.backward(dscores);
-  auto dout5 = relu2_.backward(dout6);
-  auto dout4 = affine_.backward(dout5);
-  auto dout3 = dout4.reshape(shape_before_affine_);
-  auto dout2 = pool_.backward(dout3);
-  auto dout1 = relu_.backward(dout2);
-  auto dx = conv_.backward(dout1);
-  return dx;
+// Refolds only when the conv or batch norm parameters or statistics changed
+// since the last call, so that the folded conv keeps its packed filters.
+// Fresh arrays each time, since copies of the net share the old ones.
+template <typename T>
+Conv<T>& SimpleConvNet<T>::folded_conv() {
+  const Ndarray<T>* from[] = {&conv_.w_, &conv_.b_, &bn_.gamma_, &bn_.beta_,
+                              &bn_.running_mean_, &bn_.running_var_};
+  bool stale = folded_from_.empty();
+  for (int i = 0; i < folded_from_.size() && !stale; i++) {
+    stale = !std::equal(from[i]->ptr(), from[i]->ptr() + from[i]->size(),
+                        folded_from_[i].ptr());
+  }
+  if (stale) {
+    folded_from_.clear();
+    for (const Ndarray<T>* a : from) {
+      folded_from_.push_back(a->fork());
+    }
+    folded_.w_ = conv_.w_.fork();
+    folded_.b_ = conv_.b_.fork();
+    FoldBatchNorm(bn_, &folded_);
+  }
+  return folded_;
 }
 
-double SimpleConvNet::loss(const Ndarray& x, const int64_t* y) {
-  auto scores = forward(x);
-  auto dscores = scores.as_zeros();
-  auto loss = SoftmaxLoss(scores, y, &dscores);
-  auto dx = backward(dscores);
-  // reg loss
+template <typename T>
+const Ndarray<T>& SimpleConvNet<T>::forward_buffered(const Ndarray<T>& x) {
+  assert(x.ndim() == 4);
+  assert(x.shape(1) == config_.input_depth);
+  assert(x.shape(2) == config_.input_height);
+  assert(x.shape(3) == config_.input_width);
+
+  int64_t B = config_.checkpoint_batch;
+  if (B == 0) {
+    forward_conv_block(x, &acts_[2]);
+  } else {
+    // the conv block writes its chunks of acts_[2] in place
+    int64_t N = x.shape(0);
+    acts_[2].ensure_shape({N, config_.n_filters, (config_.input_height + 1) / 2,
+                           (config_.input_width + 1) / 2});
+    for (int64_t i = 0; i < N; i += B) {
+      Ndarray<T> pooled = acts_[2].slice(i, std::min(B, N - i));
+      use_chunk_buffers(std::min(B, N - i));
+      forward_conv_block(x.slice(i, std::min(B, N - i)), &pooled);
+    }
+    input_ = x;
+  }
+  shape_before_affine_ = acts_[2].shape();
+  affine_.forward_into(acts_[2].reshape(acts_[2].shape(0), -1), &acts_[3]);
+  acts_[4] = acts_[3];
+  relu2_.forward_into(acts_[4], &acts_[4]);
+  affine2_.forward_into(acts_[4], &acts_[5]);
+  return acts_[5];
+}
+
+// With checkpointing, the chunks are taken last to first: the last one still
+// has its state from forward_buffered, the others run forward again.
+template <typename T>
+void SimpleConvNet<T>::backward_buffered(const Ndarray<T>& dscores) {
+  affine2_.backward_into(dscores, &grads_[4]);
+  grads_[3] = grads_[4];
+  relu2_.backward_into(grads_[3], &grads_[3]);
+  affine_.backward_into(grads_[3], &grads_[2]);
+  Ndarray<T> dpooled = grads_[2].reshape(shape_before_affine_);
+  int64_t B = config_.checkpoint_batch;
+  if (B == 0) {
+    backward_conv_block(dpooled, 0);
+    return;
+  }
+  int64_t N = input_.shape(0);
+  for (int64_t i = (N - 1) / B * B; i >= 0; i -= B) {
+    int64_t n = std::min(B, N - i);
+    use_chunk_buffers(n);
+    if (i + n < N) {
+      Ndarray<T> pooled = acts_[2].slice(i, n);
+      forward_conv_block(input_.slice(i, n), &pooled);
+    }
+    backward_conv_block(dpooled.slice(i, n), i + n < N ? 1 : 0);
+  }
+}
+
+template <typename T>
+void SimpleConvNet<T>::forward_conv_block(const Ndarray<T>& x,
+                                          Ndarray<T>* pooled) {
+  conv_.forward_into(x, &acts_[0]);
+  // the relus run in place, on buffers shared with the arrays before them
+  acts_[1] = acts_[0];
+  if (config_.batch_norm) {
+    bn_.forward_into(acts_[0], &normed_);
+    acts_[1] = normed_;
+  }
+  relu_.forward_into(acts_[1], &acts_[1]);
+  pool_.forward_into(acts_[1], pooled);
+}
+
+// The input gradient is never used, so the conv layer skips it.
+template <typename T>
+void SimpleConvNet<T>::backward_conv_block(const Ndarray<T>& dpooled,
+                                           T beta) {
+  pool_.backward_into(dpooled, &grads_[1]);
+  relu_.backward_into(grads_[1], &grads_[1]);
+  if (config_.batch_norm) {
+    bn_.backward_into(grads_[1], &grads_[0]);
+  } else {
+    grads_[0] = grads_[1];
+  }
+  conv_.backward_into(grads_[0], nullptr, beta);
+}
+
+// Views of the first n images stay contiguous with the shapes the layers
+// ask for, so a short last chunk runs on them without reallocating.
+template <typename T>
+void SimpleConvNet<T>::use_chunk_buffers(int64_t n) {
+  std::vector<int64_t> shape = conv_.output_shape(
+      {config_.checkpoint_batch, config_.input_depth, config_.input_height,
+       config_.input_width});
+  chunk_acts_.ensure_shape(shape);
+  chunk_grads_.ensure_shape(shape);
+  acts_[0] = chunk_acts_.slice(0, n);
+  grads_[1] = chunk_grads_.slice(0, n);
+}
+
+template <typename T>
+void SimpleConvNet<T>::clear_buffers() {
+  for (auto& a : acts_) {
+    a = Ndarray<T>();
+  }
+  for (auto& g : grads_) {
+    g = Ndarray<T>();
+  }
+  dscores_ = normed_ = input_ = chunk_acts_ = chunk_grads_ = Ndarray<T>();
+  conv_.dw_ = conv_.db_ = Ndarray<T>();
+  bn_.dgamma_ = bn_.dbeta_ = Ndarray<T>();
+  affine_.dw_ = affine_.db_ = Ndarray<T>();
+  affine2_.dw_ = affine2_.db_ = Ndarray<T>();
+}
+
+template <typename T>
+double SimpleConvNet<T>::loss(const Ndarray<T>& x, const int64_t* y) {
+  const Ndarray<T>& scores = forward_buffered(x);
+  dscores_.ensure_shape(scores.shape());
+  auto loss = SoftmaxLoss(scores, y, &dscores_);
+  backward_buffered(dscores_);
+  // reg loss; its gradient is the optimizer's weight decay
   if (config_.reg > 0) {
     loss += config_.reg * 0.5 *
-            ((conv_.w_ * conv_.w_).sum() + (affine_.w_ * affine_.w_).sum() +
-             (affine2_.w_ * affine2_.w_).sum());
-    conv_.dw_ += conv_.w_ * config_.reg;
-    affine_.dw_ += affine_.w_ * config_.reg;
-    affine2_.dw_ += affine2_.w_ * config_.reg;
+            (Sum(Square(Lazy(conv_.w_))) + Sum(Square(Lazy(affine_.w_))) +
+             Sum(Square(Lazy(affine2_.w_))));
   }
   return loss;
 }
 
-void SimpleConvNet::train(const Ndarray& x, const int64_t* y,
-                          const Ndarray& x_val, const int64_t* y_val,
-                          int epochs, int64_t batch, double lr,
-                          int64_t log_every, int64_t eval_every) {
+template <typename T>
+std::vector<Param<T>> SimpleConvNet<T>::params() {
+  std::vector<Param<T>> params = {
+      {&conv_.w_, &conv_.dw_, true},
+      {&conv_.b_, &conv_.db_, false},
+      {&affine_.w_, &affine_.dw_, true},
+      {&affine_.b_, &affine_.db_, false},
+      {&affine2_.w_, &affine2_.dw_, true},
+      {&affine2_.b_, &affine2_.db_, false},
+  };
+  if (config_.batch_norm) {
+    params.push_back({&bn_.gamma_, &bn_.dgamma_, false});
+    params.push_back({&bn_.beta_, &bn_.dbeta_, false});
+  }
+  return params;
+}
+
+template <typename T>
+void SimpleConvNet<T>::step(SimpleConvNet& grads, double lr) {
+  std::vector<Param<T>> params = this->params();
+  std::vector<Param<T>> from = grads.params();
+  for (size_t i = 0; i < params.size(); i++) {
+    params[i].grad = from[i].grad;
+  }
+  optimizer_->step(params, lr);
+}
+
+template <typename T>
+void SimpleConvNet<T>::report(SimpleConvNet& net, int iter, int epoch,
+                              double loss, const Ndarray<T>& x_val,
+                              const int64_t* y_val, int64_t log_every,
+                              int64_t eval_every) {
+  if (log_every > 0 && iter % log_every == 0) {
+    std::cout << std::this_thread::get_id() << " iter:" << iter
+              << " epoch:" << epoch << " loss:" << loss << std::endl;
+  }
+  if (eval_every > 0 && iter % eval_every == 0) {
+    double val_accuracy = net.eval(x_val, y_val);
+    std::cout << std::this_thread::get_id() << " val_accuracy:" << val_accuracy
+              << std::endl;
+  }
+}
+
+template <typename T>
+void SimpleConvNet<T>::train(const Ndarray<T>& x, const int64_t* y,
+                             const Ndarray<T>& x_val, const int64_t* y_val,
+                             int epochs, int64_t batch, double lr,
+                             int64_t log_every, int64_t eval_every) {
   assert(x.ndim() == 4);
   assert(x_val.ndim() == 4);
   int64_t N = x.shape(0);
   double batchloss = .0;
+  // Shares the parameters with *this but owns its gradients and buffers, so
+  // concurrent calls do not step on each other and batches reuse them.
+  // Evaluation goes through it as well, since the packed filters that
+  // forward caches in the conv layer are per copy too.
+  SimpleConvNet snapshot = *this;
+  snapshot.clear_buffers();
   for (int ep = 0; ep < epochs; ep++) {
     for (int64_t i = 0; i < N; i += batch) {
       auto N_batch = std::min(batch, N - i);
-      auto x_batch = x.slice(i, N_batch);
-      const int64_t* y_batch = y + i;
-      auto snapshot = *this;
-      batchloss = snapshot.loss(x_batch, y_batch);
-#define ADAGRAD(layer, param)          \
-  do {                                 \
-    auto& n = layer.n##param;          \
-    auto& d = snapshot.layer.d##param; \
-    auto& p = layer.param;             \
-    if (n.ndim() == 0) {               \
-      n = d.as_zeros() + .0001;        \
-    }                                  \
-    n += d.pow(2);                     \
-    d *= lr;                           \
-    d /= n.pow(.5);                    \
-    p -= d;                            \
-  } while (0)
-      ADAGRAD(conv_, w_);
-      ADAGRAD(conv_, b_);
-      ADAGRAD(affine_, w_);
-      ADAGRAD(affine_, b_);
-      ADAGRAD(affine2_, w_);
-      ADAGRAD(affine2_, b_);
-#undef ADAGRAD
-      int curr = iter_->fetch_add(1) + 1;
-      if (log_every > 0 && curr % log_every == 0) {
-        std::cout << std::this_thread::get_id() << " iter:" << curr
-                  << " epoch:" << ep + 1 << " loss:" << batchloss << std::endl;
+      batchloss = snapshot.loss(x.slice(i, N_batch), y + i);
+      step(snapshot, lr);
+      report(snapshot, iter_->fetch_add(1) + 1, ep + 1, batchloss, x_val,
+             y_val, log_every, eval_every);
+    }
+  }
+  if (eval_every > 0) {
+    double val_accuracy = snapshot.eval(x_val, y_val);
+    std::cout << "final val accuracy:" << val_accuracy << " loss:" << batchloss
+              << std::endl;
+  }
+}
+
+// The shards are contiguous and as even as possible. Each replica runs its
+// loss() in a chunk of its own, whose kernels spread over the workers left
+// idle, then the gradients are reduced block by block in parallel, each
+// block summed over a binary tree of the replicas.
+template <typename T>
+void SimpleConvNet<T>::train_parallel(const Ndarray<T>& x, const int64_t* y,
+                                      const Ndarray<T>& x_val,
+                                      const int64_t* y_val, int epochs,
+                                      int64_t batch, double lr,
+                                      int64_t log_every, int64_t eval_every,
+                                      int replicas) {
+  assert(x.ndim() == 4);
+  assert(x_val.ndim() == 4);
+  int64_t N = x.shape(0);
+  int64_t R = replicas > 0 ? replicas : NumThreads();
+  std::vector<SimpleConvNet> nets(R, *this);
+  std::vector<std::vector<Ndarray<T>*>> grads(R);
+  for (int64_t r = 0; r < R; r++) {
+    nets[r].clear_buffers();
+    for (const Param<T>& p : nets[r].params()) {
+      grads[r].push_back(p.grad);
+    }
+    // batch norm moves these in forward, so each replica gets its own
+    nets[r].bn_.running_mean_ = bn_.running_mean_.fork();
+    nets[r].bn_.running_var_ = bn_.running_var_.fork();
+  }
+  std::vector<double> losses(R);
+  std::vector<T> weights(R);
+  double batchloss = .0;
+  const int64_t kBlock = 1 << 14;
+  for (int ep = 0; ep < epochs; ep++) {
+    for (int64_t i = 0; i < N; i += batch) {
+      int64_t N_batch = std::min(batch, N - i);
+      int64_t shards = std::min(R, N_batch);
+      ParallelFor(0, shards, [&](int64_t begin, int64_t end) {
+        for (int64_t r = begin; r < end; r++) {
+          int64_t lo = i + N_batch * r / shards;
+          int64_t n = i + N_batch * (r + 1) / shards - lo;
+          losses[r] = nets[r].loss(x.slice(lo, n), y + lo);
+          weights[r] = T(n) / N_batch;
+        }
+      });
+      batchloss = 0;
+      for (int64_t r = 0; r < shards; r++) {
+        batchloss += weights[r] * losses[r];
+      }
+      // nets[0] ends up with sum_r weights[r] * (gradient of shard r)
+      for (size_t k = 0; k < grads[0].size(); k++) {
+        int64_t n = grads[0][k]->size();
+        ParallelFor(0, (n + kBlock - 1) / kBlock, [&](int64_t b, int64_t e) {
+          for (int64_t lo = b * kBlock; lo < std::min(n, e * kBlock);
+               lo += kBlock) {
+            int64_t m = std::min(kBlock, n - lo);
+            for (int64_t r = 0; r < shards; r++) {
+              T* g = grads[r][k]->ptr() + lo;
+              BinaryScalar(BinaryOp::kMul, m, g, weights[r], g);
+            }
+            for (int64_t s = 1; s < shards; s *= 2) {
+              for (int64_t r = 0; r + s < shards; r += 2 * s) {
+                T* g = grads[r][k]->ptr() + lo;
+                Binary(BinaryOp::kAdd, m, g, grads[r + s][k]->ptr() + lo, g);
+              }
+            }
+          }
+        });
       }
-      if (eval_every > 0 && curr % eval_every == 0) {
-        double val_accuracy = eval(x_val, y_val);
-        std::cout << std::this_thread::get_id()
-                  << " val_accuracy:" << val_accuracy << std::endl;
+      step(nets[0], lr);
+      if (config_.batch_norm) {
+        merge_running_stats(nets, weights, shards);
       }
+      report(nets[0], iter_->fetch_add(1) + 1, ep + 1, batchloss, x_val,
+             y_val, log_every, eval_every);
     }
   }
   if (eval_every > 0) {
-    double val_accuracy = eval(x_val, y_val);
+    double val_accuracy = nets[0].eval(x_val, y_val);
     std::cout << "final val accuracy:" << val_accuracy << " loss:" << batchloss
               << std::endl;
   }
 }
 
-void SimpleConvNet::predict(const Ndarray& x, int64_t* y) {
+// The running statistics move linearly in the batch ones, so the weighted
+// average of the replicas' is the serial update for the mean. For the
+// variance it leaves out the spread between the shard means.
+template <typename T>
+void SimpleConvNet<T>::merge_running_stats(std::vector<SimpleConvNet>& nets,
+                                           const std::vector<T>& weights,
+                                           int64_t shards) {
+  for (Ndarray<T> BatchNorm<T>::*stat :
+       {&BatchNorm<T>::running_mean_, &BatchNorm<T>::running_var_}) {
+    Ndarray<T>& merged = bn_.*stat;
+    for (int64_t ch = 0; ch < merged.size(); ch++) {
+      T sum = 0;
+      for (int64_t r = 0; r < shards; r++) {
+        sum += weights[r] * (nets[r].bn_.*stat).at(ch);
+      }
+      merged.at(ch) = sum;
+    }
+    for (SimpleConvNet& net : nets) {
+      std::copy(merged.ptr(), merged.ptr() + merged.size(),
+                (net.bn_.*stat).ptr());
+    }
+  }
+}
+
+template <typename T>
+void SimpleConvNet<T>::train_async(ParamServer<T>* server, const Ndarray<T>& x,
+                                   const int64_t* y, const Ndarray<T>& x_val,
+                                   const int64_t* y_val, int epochs,
+                                   int64_t batch, double lr, int64_t log_every,
+                                   int64_t eval_every) {
+  // the running statistics are no parameters the server could serve
+  assert(!config_.batch_norm);
+  assert(x.ndim() == 4);
+  assert(x_val.ndim() == 4);
+  int64_t N = x.shape(0);
+  double batchloss = .0;
+  SimpleConvNet worker = *this;
+  worker.clear_buffers();
+  std::vector<Ndarray<T>*> values;
+  std::vector<Ndarray<T>*> grads;
+  // fresh arrays, the shared ones may be in the middle of a push
+  for (const Param<T>& p : worker.params()) {
+    *p.value = Ndarray<T>(p.value->shape(), nullptr);
+    values.push_back(p.value);
+    grads.push_back(p.grad);
+  }
+  int id = server->add_worker();
+  for (int ep = 0; ep < epochs; ep++) {
+    for (int64_t i = 0; i < N; i += batch) {
+      auto N_batch = std::min(batch, N - i);
+      server->pull(id, values);
+      batchloss = worker.loss(x.slice(i, N_batch), y + i);
+      server->push(id, grads, lr);
+      report(worker, iter_->fetch_add(1) + 1, ep + 1, batchloss, x_val, y_val,
+             log_every, eval_every);
+    }
+  }
+  if (eval_every > 0) {
+    server->pull(id, values);
+    double val_accuracy = worker.eval(x_val, y_val);
+    std::cout << "final val accuracy:" << val_accuracy << " loss:" << batchloss
+              << std::endl;
+  }
+}
+
+template <typename T>
+void SimpleConvNet<T>::predict(const Ndarray<T>& x, int64_t* y) {
   auto scores = forward(x);
   assert(scores.ndim() == 2);
   int64_t size = scores.shape(0);
   int64_t classes = scores.shape(1);
   for (int64_t i = 0; i < size; i++) {
     int64_t argmax = 0;
-    double max = scores.at(i, 0);
+    T max = scores.at(i, 0);
     for (int64_t j = 1; j < classes; j++) {
       if (max < scores.at(i, j)) {
         max = scores.at(i, j);
@@ -154,7 +471,8 @@ void SimpleConvNet::predict(const Ndarray& x, int64_t* y) {
   }
 }
 
-double SimpleConvNet::eval(const Ndarray& x, const int64_t* y) {
+template <typename T>
+double SimpleConvNet<T>::eval(const Ndarray<T>& x, const int64_t* y) {
   int64_t size = x.shape(0);
   std::unique_ptr<int64_t[]> ypred(new int64_t[size]);
   predict(x, ypred.get());
@@ -167,4 +485,7 @@ double SimpleConvNet::eval(const Ndarray& x, const int64_t* y) {
   return match / size;
 }
 
+template class SimpleConvNet<float>;
+template class SimpleConvNet<double>;
+
 }  // namespace litecnn
@@ -1,15 +1,19 @@
 #pragma once
 
 #include <atomic>
+#include <memory>
 #include <vector>
 
 #include "layers.h"
 #include "loss.h"
 #include "ndarray.h"
+#include "optimizer.h"
+#include "param_server.h"
 
 namespace litecnn {
 
-// conv - relu - 2x2 pool - affine - relu - affine - softmax
+// conv - [batch norm] - relu - 2x2 pool - affine - relu - affine - softmax
+template <typename T = float>
 class SimpleConvNet {
  public:
   struct Config {
@@ -21,40 +25,135 @@ class SimpleConvNet {
     int64_t hidden_dim = 0;
     double weight_scale = 0;
     int64_t n_classes = 0;
+    // L2 penalty on the weights: counted in loss() and applied by the
+    // optimizer as its weight_decay
     double reg = 0;
+    // Adagrad by default
+    typename Optimizer<T>::Config optimizer;
+    // normalizes the conv output while training; folded into the conv
+    // weights for inference. Not for train_async.
+    bool batch_norm = false;
+    // With n > 0, loss() checkpoints the input and the pooled output and
+    // runs the conv block n images at a time, forward and again in backward,
+    // so its activations and gradients only ever take n images of memory.
+    // Not combined with batch_norm.
+    int64_t checkpoint_batch = 0;
 
     Config& validated();
   };
 
   explicit SimpleConvNet(Config config);
 
-  double loss(const Ndarray& x, const int64_t* y);
+  // Runs both passes through buffers the net keeps, so repeated calls with
+  // one batch size allocate nothing. Leaves the gradients in the layers,
+  // without the reg term the optimizer adds.
+  double loss(const Ndarray<T>& x, const int64_t* y);
 
-  Ndarray forward(const Ndarray& x);
-  Ndarray backward(const Ndarray& dscores);
+  // Scores for x, meant for inference: the conv block runs on the blocked
+  // kernels, with the batch norm folded into the conv, and leaves nothing
+  // for a backward pass. The folded conv is kept across calls.
+  Ndarray<T> forward(const Ndarray<T>& x);
 
-  // thread safe
-  void train(const Ndarray& x, const int64_t* y, const Ndarray& x_val,
+  // the trained parameters, batch norm ones only with config.batch_norm
+  std::vector<Param<T>> params();
+
+  // with config.optimizer and config.reg, shared by the copies of the net
+  Optimizer<T>& optimizer() { return *optimizer_; }
+
+  // One optimizer step per batch, in order, one thread at a time;
+  // train_async and train_parallel train from several.
+  void train(const Ndarray<T>& x, const int64_t* y, const Ndarray<T>& x_val,
              const int64_t* y_val, int epochs, int64_t batch, double lr,
              int64_t log_every, int64_t eval_every);
 
-  void predict(const Ndarray& x, int64_t* y);
+  // Synchronous data-parallel training on the shared worker pool. Each
+  // batch is cut into `replicas` shards, NumThreads() by default, whose
+  // gradients copies of the net compute concurrently. Those are then summed,
+  // weighted by shard size, pairwise in a fixed order and applied in one
+  // optimizer step, so a step equals one over the whole batch and the result
+  // does not depend on how the shards were scheduled. With batch_norm each
+  // shard normalizes by its own batch statistics instead, and the replicas
+  // move private running statistics, averaged the same way after each step.
+  void train_parallel(const Ndarray<T>& x, const int64_t* y,
+                      const Ndarray<T>& x_val, const int64_t* y_val,
+                      int epochs, int64_t batch, double lr, int64_t log_every,
+                      int64_t eval_every, int replicas = 0);
+
+  // Asynchronous training of the parameters behind server, made over
+  // params() and optimizer().config() of this net or one sharing them.
+  // Threads may run it at once, each on its own shard of the data: every
+  // call trains a private copy of the net, pulling the parameters before
+  // each batch and pushing its gradients after. Not combined with
+  // batch_norm, whose running statistics every worker would move at once.
+  void train_async(ParamServer<T>* server, const Ndarray<T>& x,
+                   const int64_t* y, const Ndarray<T>& x_val,
+                   const int64_t* y_val, int epochs, int64_t batch, double lr,
+                   int64_t log_every, int64_t eval_every);
 
-  double eval(const Ndarray& x, const int64_t* y);
+  void predict(const Ndarray<T>& x, int64_t* y);
+
+  double eval(const Ndarray<T>& x, const int64_t* y);
 
   // layers
-  Conv conv_;
-  Relu relu_;
-  MaxPool pool_;
-  Affine affine_;
-  Relu relu2_;
-  Affine affine2_;
+  Conv<T> conv_;
+  BatchNorm<T> bn_;  // used with config.batch_norm only
+  Relu<T> relu_;
+  MaxPool<T> pool_;
+  Affine<T> affine_;
+  Relu<T> relu2_;
+  Affine<T> affine2_;
 
  private:
+  // the passes of loss(), through the buffers below
+  const Ndarray<T>& forward_buffered(const Ndarray<T>& x);
+  void backward_buffered(const Ndarray<T>& dscores);
+  // conv through pool, for all of x or a chunk of it
+  void forward_conv_block(const Ndarray<T>& x, Ndarray<T>* pooled);
+  void backward_conv_block(const Ndarray<T>& dpooled, T beta);
+  // points the conv block's buffers at n images of ones for a full chunk
+  void use_chunk_buffers(int64_t n);
+  // conv_ with bn_ folded in, for forward
+  Conv<T>& folded_conv();
+
+  // Drops the buffers and the parameter gradients, so that a copy of the net
+  // stops sharing them with the original.
+  void clear_buffers();
+
+  // one optimizer step on the parameters with the gradients of grads, a
+  // copy of the net
+  void step(SimpleConvNet& grads, double lr);
+
+  // sets the running statistics of batch norm to the weighted average of
+  // those of nets[:shards], replicas of the net, and copies it back to all
+  void merge_running_stats(std::vector<SimpleConvNet>& nets,
+                           const std::vector<T>& weights, int64_t shards);
+
+  // logging and evaluation after step iter of train*, through net
+  void report(SimpleConvNet& net, int iter, int epoch, double loss,
+              const Ndarray<T>& x_val, const int64_t* y_val,
+              int64_t log_every, int64_t eval_every);
+
   Config config_;
   std::vector<int64_t> shape_before_affine_;
 
+  // Outputs of the six layers and their gradients. The relus work in place,
+  // so acts_[1] and acts_[4] share the buffers of their inputs, and so do
+  // grads_[3:5] and, without batch norm, grads_[0:2].
+  Ndarray<T> acts_[6];
+  Ndarray<T> grads_[5];
+  Ndarray<T> dscores_;
+  Ndarray<T> normed_;  // batch norm output, the first relu's buffer
+  Ndarray<T> input_;   // x of the last loss(), when checkpointing
+  // conv output and its gradient for checkpoint_batch images
+  Ndarray<T> chunk_acts_;
+  Ndarray<T> chunk_grads_;
+
+  // folded_conv() and copies of the arrays it was folded from
+  Conv<T> folded_;
+  std::vector<Ndarray<T>> folded_from_;
+
   std::shared_ptr<std::atomic_int> iter_;
+  std::shared_ptr<Optimizer<T>> optimizer_;
 };
 
 }  // namespace litecnn
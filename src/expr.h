@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+#include "ndarray.h"
+#include "parallel.h"
+#include "simd.h"
+
+namespace litecnn {
+
+// Lazy elementwise expressions over contiguous Ndarrays of one shape.
+//
+// Lazy(x) wraps an array; +, -, *, /, Sqrt and Square combine arrays and
+// scalars into a tree of small value types, and nothing is computed until
+// the tree is passed to Assign, Eval or Sum. Those run one loop over the
+// elements with the whole tree inlined into it, so
+//   Assign(Lazy(p) - Lazy(d) * lr / Sqrt(Lazy(n)), &p);
+// streams through p, d and n once and allocates nothing. Leaves refer to
+// their arrays, so an expression has to be evaluated in the statement that
+// builds it.
+template <typename E>
+struct Expr {
+  const E& self() const { return static_cast<const E&>(*this); }
+};
+
+template <typename T>
+class LazyArray : public Expr<LazyArray<T>> {
+ public:
+  typedef T Value;
+
+  explicit LazyArray(const Ndarray<T>& a) : a_(&a), p_(a.ptr()) {
+    assert(a.is_contiguous());
+  }
+
+  T operator[](int64_t i) const { return p_[i]; }
+
+  // the array that gives the expression its shape, null for scalars
+  const Ndarray<T>* array() const { return a_; }
+
+ private:
+  const Ndarray<T>* a_;
+  const T* p_;
+};
+
+template <typename T>
+class LazyScalar : public Expr<LazyScalar<T>> {
+ public:
+  typedef T Value;
+
+  explicit LazyScalar(T v) : v_(v) {}
+
+  T operator[](int64_t) const { return v_; }
+
+  const Ndarray<T>* array() const { return nullptr; }
+
+ private:
+  T v_;
+};
+
+template <BinaryOp kOp, typename L, typename R>
+class LazyBinary : public Expr<LazyBinary<kOp, L, R>> {
+ public:
+  typedef typename L::Value Value;
+  static_assert(std::is_same<Value, typename R::Value>::value,
+                "operands of a lazy expression share one element type");
+
+  LazyBinary(const L& l, const R& r)
+      : l_(l), r_(r), a_(l.array() ? l.array() : r.array()) {
+    assert(!l.array() || !r.array() ||
+           l.array()->shape() == r.array()->shape());
+  }
+
+  Value operator[](int64_t i) const { return ApplyBinary(kOp, l_[i], r_[i]); }
+
+  const Ndarray<Value>* array() const { return a_; }
+
+ private:
+  const L l_;
+  const R r_;
+  const Ndarray<Value>* a_;
+};
+
+enum class UnaryOp { kSqrt, kSquare };
+
+template <UnaryOp kOp, typename A>
+class LazyUnary : public Expr<LazyUnary<kOp, A>> {
+ public:
+  typedef typename A::Value Value;
+
+  explicit LazyUnary(const A& a) : a_(a) {}
+
+  Value operator[](int64_t i) const {
+    Value v = a_[i];
+    return kOp == UnaryOp::kSqrt ? std::sqrt(v) : v * v;
+  }
+
+  const Ndarray<Value>* array() const { return a_.array(); }
+
+ private:
+  const A a_;
+};
+
+template <typename T>
+LazyArray<T> Lazy(const Ndarray<T>& a) {
+  return LazyArray<T>(a);
+}
+
+template <typename A>
+LazyUnary<UnaryOp::kSqrt, A> Sqrt(const Expr<A>& a) {
+  return LazyUnary<UnaryOp::kSqrt, A>(a.self());
+}
+
+template <typename A>
+LazyUnary<UnaryOp::kSquare, A> Square(const Expr<A>& a) {
+  return LazyUnary<UnaryOp::kSquare, A>(a.self());
+}
+
+#define LITECNN_LAZY_OPERATOR(op, kOp)                                      \
+  template <typename L, typename R>                                         \
+  LazyBinary<kOp, L, R> operator op(const Expr<L>& l, const Expr<R>& r) {   \
+    return LazyBinary<kOp, L, R>(l.self(), r.self());                       \
+  }                                                                         \
+  template <typename L>                                                     \
+  LazyBinary<kOp, L, LazyScalar<typename L::Value>> operator op(            \
+      const Expr<L>& l, typename L::Value r) {                              \
+    return LazyBinary<kOp, L, LazyScalar<typename L::Value>>(               \
+        l.self(), LazyScalar<typename L::Value>(r));                        \
+  }                                                                         \
+  template <typename R>                                                     \
+  LazyBinary<kOp, LazyScalar<typename R::Value>, R> operator op(            \
+      typename R::Value l, const Expr<R>& r) {                              \
+    return LazyBinary<kOp, LazyScalar<typename R::Value>, R>(               \
+        LazyScalar<typename R::Value>(l), r.self());                        \
+  }
+LITECNN_LAZY_OPERATOR(+, BinaryOp::kAdd)
+LITECNN_LAZY_OPERATOR(-, BinaryOp::kSub)
+LITECNN_LAZY_OPERATOR(*, BinaryOp::kMul)
+LITECNN_LAZY_OPERATOR(/, BinaryOp::kDiv)
+#undef LITECNN_LAZY_OPERATOR
+
+// *out = e in a single pass. out must be contiguous and of e's shape, and may
+// itself be one of the leaves of e.
+template <typename T, typename E>
+void Assign(const Expr<E>& e, Ndarray<T>* out) {
+  static_assert(std::is_same<T, typename E::Value>::value,
+                "Assign keeps the element type");
+  const E& x = e.self();
+  assert(x.array());
+  assert(out->is_contiguous());
+  assert(out->shape() == x.array()->shape());
+  const int64_t kBlock = 1 << 14;
+  int64_t n = out->size();
+  T* o = out->ptr();
+  ParallelFor(0, (n + kBlock - 1) / kBlock, [&](int64_t begin, int64_t end) {
+    int64_t stop = std::min(n, end * kBlock);
+    for (int64_t i = begin * kBlock; i < stop; i++) {
+      o[i] = x[i];
+    }
+  });
+}
+
+// New array holding e.
+template <typename E>
+Ndarray<typename E::Value> Eval(const Expr<E>& e) {
+  assert(e.self().array());
+  Ndarray<typename E::Value> out(e.self().array()->shape(), nullptr);
+  Assign(e, &out);
+  return out;
+}
+
+// Sum of the elements of e, accumulated in double like Ndarray::sum.
+template <typename E>
+typename E::Value Sum(const Expr<E>& e) {
+  const E& x = e.self();
+  assert(x.array());
+  int64_t n = x.array()->size();
+  double sum = 0;
+  for (int64_t i = 0; i < n; i++) {
+    sum += x[i];
+  }
+  return sum;
+}
+
+}  // namespace litecnn
@@ -0,0 +1,318 @@
+#include "fft.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+#include "parallel.h"
+#include "pool.h"
+
+namespace litecnn {
+
+namespace {
+
+typedef std::complex<double> Complex;
+
+const double kPi = 3.14159265358979323846;
+
+// Complex products are spelled out on the real and imaginary parts: the
+// operators of std::complex guard against NaNs through a library call,
+// which keeps the loops below from vectorizing.
+inline void Mul(double ar, double ai, double br, double bi, double* cr,
+                double* ci) {
+  *cr = ar * br - ai * bi;
+  *ci = ar * bi + ai * br;
+}
+
+// acc[i] += a[i] * b[i], or a[i] * conj(b[i]) with conj_b
+void MulAcc(const Complex* a, const Complex* b, bool conj_b, int64_t bins,
+            Complex* acc) {
+  const double* pa = reinterpret_cast<const double*>(a);
+  const double* pb = reinterpret_cast<const double*>(b);
+  double* pc = reinterpret_cast<double*>(acc);
+  double sign = conj_b ? -1.0 : 1.0;
+  for (int64_t i = 0; i < 2 * bins; i += 2) {
+    double br = pb[i];
+    double bi = sign * pb[i + 1];
+    pc[i] += pa[i] * br - pa[i + 1] * bi;
+    pc[i + 1] += pa[i] * bi + pa[i + 1] * br;
+  }
+}
+
+// out[i,j] = sum_l a[i,l] * b[j,l] (conj(b[j,l]) with conj_b), bin by bin,
+// for spectra addressed as a + i*ais + l*als and so on. Every output bin
+// reads all nl inputs of its row and column, so the bins are walked in
+// chunks small enough for all operands of a chunk to stay in cache.
+void Contract(const Complex* a, int64_t ni, int64_t ais, int64_t als,
+              const Complex* b, int64_t nj, int64_t bjs, int64_t bls,
+              int64_t nl, bool conj_b, int64_t bins, int64_t ois,
+              int64_t ojs, Complex* out) {
+  int64_t per_bin = ni * nl + nj * nl + ni * nj;
+  int64_t chunk = std::max<int64_t>(8, (1 << 14) / per_bin);
+  ParallelFor(0, (bins + chunk - 1) / chunk, [&](int64_t begin,
+                                                 int64_t end) {
+    for (int64_t cb = begin; cb < end; cb++) {
+      int64_t b0 = cb * chunk;
+      int64_t len = std::min(chunk, bins - b0);
+      for (int64_t i = 0; i < ni; i++) {
+        for (int64_t j = 0; j < nj; j++) {
+          Complex* o = out + i * ois + j * ojs + b0;
+          std::fill(o, o + len, Complex(0, 0));
+          for (int64_t l = 0; l < nl; l++) {
+            MulAcc(a + i * ais + l * als + b0, b + j * bjs + l * bls + b0,
+                   conj_b, len, o);
+          }
+        }
+      }
+    }
+  });
+}
+
+inline int64_t Wrap(int64_t i, int64_t n) { return i < 0 ? i + n : i; }
+
+}  // namespace
+
+int64_t NextPow2(int64_t n) {
+  int64_t ret = 1;
+  while (ret < n) {
+    ret *= 2;
+  }
+  return ret;
+}
+
+Fft2d::Fft2d(int64_t h, int64_t w) : h_(h), w_(w) {
+  assert(h >= 1 && (h & (h - 1)) == 0);
+  assert(w >= 2 && (w & (w - 1)) == 0);
+  int64_t n = std::max(h, w / 2);
+  for (int64_t j = 0; j < n / 2; j++) {
+    twiddle_.push_back(std::polar(1.0, -2 * kPi * j / n));
+  }
+  for (int64_t k = 0; k <= w / 2; k++) {
+    row_twiddle_.push_back(std::polar(1.0, -2 * kPi * k / w));
+  }
+}
+
+void Fft2d::Transform(Complex* data, int64_t n, int64_t batch,
+                      bool inverse) const {
+  for (int64_t i = 1, j = 0; i < n; i++) {
+    int64_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      std::swap_ranges(data + i * batch, data + (i + 1) * batch,
+                       data + j * batch);
+    }
+  }
+  double sign = inverse ? -1.0 : 1.0;
+  int64_t tn = 2 * twiddle_.size();
+  for (int64_t len = 2; len <= n; len *= 2) {
+    int64_t half = len / 2;
+    int64_t step = tn / len;
+    for (int64_t i = 0; i < n; i += len) {
+      for (int64_t j = 0; j < half; j++) {
+        double tr = twiddle_[j * step].real();
+        double ti = sign * twiddle_[j * step].imag();
+        double* u = reinterpret_cast<double*>(data + (i + j) * batch);
+        double* v = reinterpret_cast<double*>(data + (i + j + half) * batch);
+        for (int64_t b = 0; b < 2 * batch; b += 2) {
+          double vr, vi;
+          Mul(v[b], v[b + 1], tr, ti, &vr, &vi);
+          v[b] = u[b] - vr;
+          v[b + 1] = u[b + 1] - vi;
+          u[b] += vr;
+          u[b + 1] += vi;
+        }
+      }
+    }
+  }
+}
+
+// With z[k] = x[2k] + i x[2k+1] and Z its half-length FFT, the spectrum of
+// the real row is X[k] = E[k] + exp(-2 pi i k/w) O[k], where
+// E[k] = (Z[k] + conj(Z[w/2-k])) / 2 and O[k] = (Z[k] - conj(Z[w/2-k])) / 2i
+// are the spectra of the even and odd samples.
+template <typename T>
+void Fft2d::Forward(const T* x, int64_t xh, int64_t xw, Complex* spec) const {
+  assert(xh <= h_ && xw <= w_);
+  int64_t half = w_ / 2;
+  int64_t wc = half + 1;
+  for (int64_t r = 0; r < xh; r++) {
+    Complex* row = spec + r * wc;
+    const T* xr = x + r * xw;
+    for (int64_t k = 0; k < half; k++) {
+      double re = 2 * k < xw ? xr[2 * k] : 0.0;
+      double im = 2 * k + 1 < xw ? xr[2 * k + 1] : 0.0;
+      row[k] = Complex(re, im);
+    }
+    Transform(row, half, 1, false);
+    Complex z0 = row[0];
+    row[0] = Complex(z0.real() + z0.imag(), 0);
+    row[half] = Complex(z0.real() - z0.imag(), 0);
+    for (int64_t k = 1; 2 * k <= half; k++) {
+      Complex a = row[k];
+      Complex b = row[half - k];
+      for (int64_t side = 0; side < 2; side++) {
+        int64_t kk = side == 0 ? k : half - k;
+        Complex zk = side == 0 ? a : b;
+        Complex zc = std::conj(side == 0 ? b : a);
+        double er = 0.5 * (zk.real() + zc.real());
+        double ei = 0.5 * (zk.imag() + zc.imag());
+        // (zk - zc) / 2i
+        double orr = 0.5 * (zk.imag() - zc.imag());
+        double oi = -0.5 * (zk.real() - zc.real());
+        double tr, ti;
+        Mul(row_twiddle_[kk].real(), row_twiddle_[kk].imag(), orr, oi, &tr,
+            &ti);
+        row[kk] = Complex(er + tr, ei + ti);
+      }
+    }
+  }
+  std::fill(spec + xh * wc, spec + h_ * wc, Complex(0, 0));
+  Transform(spec, h_, wc, false);
+}
+
+// Reverses Forward: the columns are inverted in one batch, then every row is
+// folded back into z[k] = E[k] + i O[k] and inverted at half length.
+template <typename T>
+void Fft2d::Inverse(Complex* spec, T* out) const {
+  int64_t half = w_ / 2;
+  int64_t wc = half + 1;
+  double scale = 1.0 / (h_ * half);
+  Transform(spec, h_, wc, true);
+  for (int64_t r = 0; r < h_; r++) {
+    Complex* row = spec + r * wc;
+    for (int64_t k = 0; 2 * k <= half; k++) {
+      Complex a = row[k];
+      Complex b = row[half - k];
+      for (int64_t side = 0; side < 2; side++) {
+        int64_t kk = side == 0 ? k : half - k;
+        if (kk == half) {
+          continue;
+        }
+        Complex xk = side == 0 ? a : b;
+        Complex xc = std::conj(side == 0 ? b : a);
+        double er = 0.5 * (xk.real() + xc.real());
+        double ei = 0.5 * (xk.imag() + xc.imag());
+        double orr, oi;
+        Mul(0.5 * (xk.real() - xc.real()), 0.5 * (xk.imag() - xc.imag()),
+            row_twiddle_[kk].real(), -row_twiddle_[kk].imag(), &orr, &oi);
+        // E + i O
+        row[kk] = Complex(er - oi, ei + orr);
+      }
+    }
+    Transform(row, half, 1, true);
+    T* o = out + r * w_;
+    for (int64_t k = 0; k < half; k++) {
+      o[2 * k] = row[k].real() * scale;
+      o[2 * k + 1] = row[k].imag() * scale;
+    }
+  }
+}
+
+FftConv::FftConv(int64_t h, int64_t w, int64_t fh, int64_t fw, int64_t p)
+    : h_(h),
+      w_(w),
+      fh_(fh),
+      fw_(fw),
+      p_(p),
+      fft_(NextPow2(std::max(h + p, fh)),
+           NextPow2(std::max<int64_t>({w + p, fw, 2}))) {
+  assert(p < fh && p < fw);
+}
+
+template <typename T>
+void FftConv::Transform(const T* x, int64_t count, int64_t xh, int64_t xw,
+                        Complex* spec) const {
+  int64_t bins = fft_.bins();
+  ParallelFor(0, count, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; i++) {
+      fft_.Forward(x + i * xh * xw, xh, xw, spec + i * bins);
+    }
+  });
+}
+
+template <typename T>
+void FftConv::Inverse(Complex* spec, int64_t count, int64_t oh, int64_t ow,
+                      int64_t dy, int64_t dx, T* out) const {
+  int64_t bins = fft_.bins();
+  int64_t gh = fft_.h();
+  int64_t gw = fft_.w();
+  ParallelFor(0, count, [&](int64_t begin, int64_t end) {
+    thread_local std::vector<double> img;
+    img.resize(gh * gw);
+    for (int64_t i = begin; i < end; i++) {
+      fft_.Inverse(spec + i * bins, img.data());
+      T* o = out + i * oh * ow;
+      for (int64_t y = 0; y < oh; y++) {
+        const double* src = img.data() + Wrap(y + dy, gh) * gw;
+        for (int64_t x = 0; x < ow; x++) {
+          o[y * ow + x] = src[Wrap(x + dx, gw)];
+        }
+      }
+    }
+  });
+}
+
+// The image sits at the grid origin, so padded row i + a reads x row
+// i + a - p; the circular correlation at i - p (mod the grid) is out[i].
+template <typename T>
+void FftConv::Forward(const Complex* ws, const Complex* xs, int64_t n,
+                      int64_t c, int64_t k, T* out) const {
+  int64_t bins = fft_.bins();
+  PooledVector<Complex> os(n * k * bins);
+  Contract(xs, n, c * bins, bins, ws, k, c * bins, bins, c, true, bins,
+           k * bins, bins, os.data());
+  Inverse(os.data(), n * k, h_ + 2 * p_ - fh_ + 1, w_ + 2 * p_ - fw_ + 1,
+          -p_, -p_, out);
+}
+
+// dx[y] = sum_a dout[y + p - a] w[a], the linear convolution read at y + p.
+template <typename T>
+void FftConv::BackwardData(const Complex* ws, const Complex* ds, int64_t n,
+                           int64_t c, int64_t k, T* dx) const {
+  int64_t bins = fft_.bins();
+  PooledVector<Complex> xs(n * c * bins);
+  Contract(ds, n, k * bins, bins, ws, c, bins, c * bins, k, false, bins,
+           c * bins, bins, xs.data());
+  Inverse(xs.data(), n * c, h_, w_, p_, p_, dx);
+}
+
+// dw[a] = sum_i dout[i] x[i + a - p], the circular correlation at a - p.
+template <typename T>
+void FftConv::BackwardFilter(const Complex* xs, const Complex* ds, int64_t n,
+                             int64_t c, int64_t k, T* dw) const {
+  int64_t bins = fft_.bins();
+  PooledVector<Complex> ws(k * c * bins);
+  Contract(xs, c, bins, c * bins, ds, k, bins, k * bins, n, true, bins, bins,
+           c * bins, ws.data());
+  Inverse(ws.data(), k * c, fh_, fw_, -p_, -p_, dw);
+}
+
+#define LITECNN_INSTANTIATE_FFT(T)                                          \
+  template void Fft2d::Forward<T>(const T* x, int64_t xh, int64_t xw,       \
+                                  Complex* spec) const;                     \
+  template void Fft2d::Inverse<T>(Complex* spec, T* out) const;             \
+  template void FftConv::Transform<T>(const T* x, int64_t count, int64_t xh, \
+                                      int64_t xw, Complex* spec) const;     \
+  template void FftConv::Forward<T>(const Complex* ws, const Complex* xs,   \
+                                    int64_t n, int64_t c, int64_t k,        \
+                                    T* out) const;                          \
+  template void FftConv::BackwardData<T>(const Complex* ws,                 \
+                                         const Complex* ds, int64_t n,      \
+                                         int64_t c, int64_t k, T* dx) const; \
+  template void FftConv::BackwardFilter<T>(const Complex* xs,               \
+                                           const Complex* ds, int64_t n,    \
+                                           int64_t c, int64_t k, T* dw)     \
+      const;
+
+LITECNN_INSTANTIATE_FFT(float)
+LITECNN_INSTANTIATE_FFT(double)
+
+#undef LITECNN_INSTANTIATE_FFT
+
+}  // namespace litecnn
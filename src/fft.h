@@ -0,0 +1,105 @@
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+namespace litecnn {
+
+// Real-to-complex 2-D FFT over an (h,w) grid, both powers of two, w >= 2.
+//
+// Rows go through a half-length complex FFT with the usual even/odd split,
+// columns are transformed all at once so that every butterfly runs over a
+// whole row of bins. A spectrum holds h * (w/2+1) bins, the other half
+// follows from conjugate symmetry. Transforms are computed in double for
+// either element type of the real side.
+class Fft2d {
+ public:
+  Fft2d(int64_t h, int64_t w);
+
+  int64_t h() const { return h_; }
+  int64_t w() const { return w_; }
+  int64_t bins() const { return h_ * (w_ / 2 + 1); }
+
+  // spec = FFT of the (xh,xw) image x, zero extended to (h,w)
+  template <typename T>
+  void Forward(const T* x, int64_t xh, int64_t xw,
+               std::complex<double>* spec) const;
+
+  // out (h,w) = inverse FFT of spec, normalized. spec is used as scratch.
+  template <typename T>
+  void Inverse(std::complex<double>* spec, T* out) const;
+
+ private:
+  // radix-2 transform along the first axis of an (n,batch) array
+  void Transform(std::complex<double>* data, int64_t n, int64_t batch,
+                 bool inverse) const;
+
+  const int64_t h_;
+  const int64_t w_;
+  // exp(-2 pi i j / max(h, w/2)) for the complex transforms
+  std::vector<std::complex<double>> twiddle_;
+  // exp(-2 pi i k / w) for k <= w/2, splits the packed real rows
+  std::vector<std::complex<double>> row_twiddle_;
+};
+
+// Stride-1 convolution of (h,w) images with (fh,fw) filters and zero padding
+// p < min(fh,fw), evaluated as pointwise products of spectra.
+//
+// The grid is the smallest power of two >= (h+p, w+p): the images sit at the
+// origin unpadded and the padding is folded into where the circular results
+// are read from, which is wrap-free for all three passes at that size. Cost
+// per channel pair is O(bins) instead of O(h*w*fh*fw), so it wins for large
+// filters; spectra of filters and images are computed once per call and
+// shared by every pair that uses them.
+class FftConv {
+ public:
+  FftConv(int64_t h, int64_t w, int64_t fh, int64_t fw, int64_t p);
+
+  int64_t h() const { return h_; }
+  int64_t w() const { return w_; }
+  int64_t bins() const { return fft_.bins(); }
+
+  // spec (count,bins) = spectra of the count (xh,xw) images in x
+  template <typename T>
+  void Transform(const T* x, int64_t count, int64_t xh, int64_t xw,
+                 std::complex<double>* spec) const;
+
+  // out (n,k,h2,w2) = x (n,c,h,w) correlated with the filters w (k,c,fh,fw),
+  // given as spectra xs (n,c,bins) and ws (k,c,bins). out is overwritten.
+  template <typename T>
+  void Forward(const std::complex<double>* ws, const std::complex<double>* xs,
+               int64_t n, int64_t c, int64_t k, T* out) const;
+
+  // dx (n,c,h,w) from ws (k,c,bins) and the dout spectra ds (n,k,bins).
+  template <typename T>
+  void BackwardData(const std::complex<double>* ws,
+                    const std::complex<double>* ds, int64_t n, int64_t c,
+                    int64_t k, T* dx) const;
+
+  // dw (k,c,fh,fw) = sum over the batch of the correlation of xs (n,c,bins)
+  // with ds (n,k,bins).
+  template <typename T>
+  void BackwardFilter(const std::complex<double>* xs,
+                      const std::complex<double>* ds, int64_t n, int64_t c,
+                      int64_t k, T* dw) const;
+
+ private:
+  // out (count,oh,ow) = the inverse transforms of spec (count,bins), read at
+  // grid position (y+dy, x+dx) modulo the grid. spec is used as scratch.
+  template <typename T>
+  void Inverse(std::complex<double>* spec, int64_t count, int64_t oh,
+               int64_t ow, int64_t dy, int64_t dx, T* out) const;
+
+  const int64_t h_;
+  const int64_t w_;
+  const int64_t fh_;
+  const int64_t fw_;
+  const int64_t p_;
+  const Fft2d fft_;
+};
+
+// Smallest power of two >= n.
+int64_t NextPow2(int64_t n);
+
+}  // namespace litecnn
@@ -0,0 +1,214 @@
+#include "gemm.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "parallel.h"
+
+namespace litecnn {
+
+namespace {
+
+// Register tile computed by the micro-kernel, kMr rows by kNrVecs vectors,
+// sized so that the accumulators fill most of the vector register file:
+// 24 zmm with AVX-512, 12 ymm with AVX2, 8 xmm otherwise.
+#if defined(__AVX512F__)
+const int64_t kVecBytes = 64;
+const int64_t kMr = 8;
+const int64_t kNrVecs = 3;
+#elif defined(__AVX__)
+const int64_t kVecBytes = 32;
+const int64_t kMr = 6;
+const int64_t kNrVecs = 2;
+#else
+const int64_t kVecBytes = 16;
+const int64_t kMr = 4;
+const int64_t kNrVecs = 2;
+#endif
+
+template <typename T>
+struct Tile {
+  typedef T Vec __attribute__((vector_size(kVecBytes)));
+  static const int64_t kVec = kVecBytes / sizeof(T);
+  static const int64_t kNr = kNrVecs * kVec;
+};
+
+// Cache blocking: a kMr x kKc sliver of A and a kKc x kNr sliver of B stay in
+// L1, a kMc x kKc block of A in L2 and a kKc x kNc panel of B in L3. The
+// sizes are in elements and tuned for double, float just leaves more room.
+const int64_t kMc = 72;
+const int64_t kKc = 256;
+const int64_t kNc = 4080;
+
+// Packs the (mc,kc) block of A into micro panels of kMr rows, each stored
+// column after column, zero padding the last panel.
+template <typename T>
+void PackA(int64_t mc, int64_t kc, const T* a, int64_t rsa, int64_t csa,
+           T* pa) {
+  for (int64_t i = 0; i < mc; i += kMr) {
+    int64_t mr = std::min(kMr, mc - i);
+    const T* ai = a + i * rsa;
+    for (int64_t p = 0; p < kc; p++) {
+      int64_t ii = 0;
+      for (; ii < mr; ii++) {
+        *pa++ = ai[ii * rsa + p * csa];
+      }
+      for (; ii < kMr; ii++) {
+        *pa++ = 0;
+      }
+    }
+  }
+}
+
+// Packs the (kc,nc) panel of B into micro panels of kNr columns, each stored
+// row after row, zero padding the last panel.
+template <typename T>
+void PackB(int64_t kc, int64_t nc, const T* b, int64_t rsb, int64_t csb,
+           T* pb) {
+  const int64_t kNr = Tile<T>::kNr;
+  for (int64_t j = 0; j < nc; j += kNr) {
+    int64_t nr = std::min(kNr, nc - j);
+    const T* bj = b + j * csb;
+    for (int64_t p = 0; p < kc; p++) {
+      int64_t jj = 0;
+      for (; jj < nr; jj++) {
+        *pb++ = bj[p * rsb + jj * csb];
+      }
+      for (; jj < kNr; jj++) {
+        *pb++ = 0;
+      }
+    }
+  }
+}
+
+// C[0:mr,0:nr] += alpha * pa * pb over a depth of kc.
+template <typename T>
+inline void MicroKernel(int64_t kc, T alpha, const T* pa, const T* pb, T* c,
+                        int64_t rsc, int64_t csc, int64_t mr, int64_t nr) {
+  typedef typename Tile<T>::Vec Vec;
+  const int64_t kVec = Tile<T>::kVec;
+  const int64_t kNr = Tile<T>::kNr;
+  Vec ab[kMr][kNr / kVec] = {};
+  for (int64_t p = 0; p < kc; p++) {
+    Vec b[kNr / kVec];
+    for (int64_t j = 0; j < kNr / kVec; j++) {
+      std::memcpy(&b[j], pb + j * kVec, sizeof(Vec));
+    }
+    for (int64_t i = 0; i < kMr; i++) {
+      Vec a = pa[i] - Vec{};
+      for (int64_t j = 0; j < kNr / kVec; j++) {
+        ab[i][j] += a * b[j];
+      }
+    }
+    pa += kMr;
+    pb += kNr;
+  }
+  if (mr == kMr && nr == kNr && csc == 1) {
+    for (int64_t i = 0; i < kMr; i++) {
+      for (int64_t j = 0; j < kNr / kVec; j++) {
+        Vec v;
+        std::memcpy(&v, c + i * rsc + j * kVec, sizeof(Vec));
+        v += alpha * ab[i][j];
+        std::memcpy(c + i * rsc + j * kVec, &v, sizeof(Vec));
+      }
+    }
+    return;
+  }
+  for (int64_t i = 0; i < mr; i++) {
+    for (int64_t j = 0; j < nr; j++) {
+      c[i * rsc + j * csc] += alpha * ab[i][j / kVec][j % kVec];
+    }
+  }
+}
+
+template <typename T>
+void ScaleC(int64_t m, int64_t n, T beta, T* c, int64_t rsc, int64_t csc) {
+  if (beta == 1) {
+    return;
+  }
+  for (int64_t i = 0; i < m; i++) {
+    for (int64_t j = 0; j < n; j++) {
+      T& v = c[i * rsc + j * csc];
+      v = beta == 0 ? 0 : v * beta;
+    }
+  }
+}
+
+}  // namespace
+
+template <typename T>
+void Gemm(int64_t m, int64_t n, int64_t k, T alpha, const T* a, int64_t rsa,
+          int64_t csa, const T* b, int64_t rsb, int64_t csb, T beta, T* c,
+          int64_t rsc, int64_t csc) {
+  const int64_t kNr = Tile<T>::kNr;
+  if (m <= 0 || n <= 0) {
+    return;
+  }
+  ScaleC(m, n, beta, c, rsc, csc);
+  if (k <= 0 || alpha == 0) {
+    return;
+  }
+  // Packing buffers are reused across calls, the worker pool only reads them
+  // while this call is blocked in ParallelFor.
+  thread_local std::vector<T> packed_a;
+  thread_local std::vector<T> packed_b;
+  int64_t mpanels = (m + kMr - 1) / kMr;
+  int64_t mblocks = (m + kMc - 1) / kMc;
+  packed_a.resize(mpanels * kMr * std::min(k, kKc));
+  packed_b.resize((std::min(n, kNc) + kNr - 1) / kNr * kNr *
+                  std::min(k, kKc));
+  T* pa = packed_a.data();
+  T* pb = packed_b.data();
+
+  for (int64_t jc = 0; jc < n; jc += kNc) {
+    int64_t nc = std::min(kNc, n - jc);
+    int64_t npanels = (nc + kNr - 1) / kNr;
+    // split the columns until there are enough tiles for every thread
+    int64_t nsplit = std::min(
+        npanels, std::max<int64_t>(1, (NumThreads() + mblocks - 1) / mblocks));
+    for (int64_t pc = 0; pc < k; pc += kKc) {
+      int64_t kc = std::min(kKc, k - pc);
+      ParallelFor(0, npanels, [=](int64_t begin, int64_t end) {
+        for (int64_t j = begin; j < end; j++) {
+          PackB(kc, std::min(kNr, nc - j * kNr),
+                b + pc * rsb + (jc + j * kNr) * csb, rsb, csb,
+                pb + j * kNr * kc);
+        }
+      });
+      ParallelFor(0, mpanels, [=](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+          PackA(std::min(kMr, m - i * kMr), kc, a + i * kMr * rsa + pc * csa,
+                rsa, csa, pa + i * kMr * kc);
+        }
+      });
+      ParallelFor(0, mblocks * nsplit, [=](int64_t begin, int64_t end) {
+        for (int64_t t = begin; t < end; t++) {
+          int64_t ic = t / nsplit * kMc;
+          int64_t mc = std::min(kMc, m - ic);
+          int64_t js = t % nsplit;
+          for (int64_t jr = npanels * js / nsplit * kNr;
+               jr < npanels * (js + 1) / nsplit * kNr; jr += kNr) {
+            for (int64_t ir = 0; ir < mc; ir += kMr) {
+              MicroKernel(kc, alpha, pa + (ic + ir) * kc, pb + jr * kc,
+                          c + (ic + ir) * rsc + (jc + jr) * csc, rsc, csc,
+                          std::min(kMr, mc - ir), std::min(kNr, nc - jr));
+            }
+          }
+        }
+      });
+    }
+  }
+}
+
+template void Gemm<float>(int64_t m, int64_t n, int64_t k, float alpha,
+                          const float* a, int64_t rsa, int64_t csa,
+                          const float* b, int64_t rsb, int64_t csb, float beta,
+                          float* c, int64_t rsc, int64_t csc);
+template void Gemm<double>(int64_t m, int64_t n, int64_t k, double alpha,
+                           const double* a, int64_t rsa, int64_t csa,
+                           const double* b, int64_t rsb, int64_t csb,
+                           double beta, double* c, int64_t rsc, int64_t csc);
+
+}  // namespace litecnn
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+namespace litecnn {
+
+// C = alpha * A * B + beta * C, with A (m,k), B (k,n) and C (m,n).
+//
+// Every matrix is addressed through a row stride and a column stride, so
+// transposed or sliced Ndarray views can be passed in without copying. The
+// operands are packed into cache-sized panels and multiplied by a
+// register-blocked micro-kernel, macro tiles are spread over the worker pool.
+// When beta is 0, C is not read. Instantiated for float and double.
+template <typename T>
+void Gemm(int64_t m, int64_t n, int64_t k, T alpha, const T* a, int64_t rsa,
+          int64_t csa, const T* b, int64_t rsb, int64_t csb, T beta, T* c,
+          int64_t rsc, int64_t csc);
+
+}  // namespace litecnn
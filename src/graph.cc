@@ -0,0 +1,433 @@
+#include "graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "expr.h"
+#include "layers.h"
+#include "loss.h"
+#include "ndarray.h"
+#include "optimizer.h"
+#include "simd.h"
+
+namespace litecnn {
+
+namespace {
+
+int64_t Elements(const std::vector<int64_t>& shape) {
+  return std::accumulate(shape.begin(), shape.end(), int64_t(1),
+                         [](int64_t a, int64_t b) { return a * b; });
+}
+
+}  // namespace
+
+template <typename T>
+const int Graph<T>::kInput;
+
+template <typename T>
+int Graph<T>::append(Kind kind, std::vector<int> inputs, int64_t layer) {
+  for (int x : inputs) {
+    assert(x >= 0);
+    assert(x < nodes_.size());
+  }
+  Node node;
+  node.kind = kind;
+  node.inputs = std::move(inputs);
+  node.layer = layer;
+  nodes_.push_back(node);
+  planned_.clear();
+  return nodes_.size() - 1;
+}
+
+template <typename T>
+int64_t Graph<T>::layer(int id, Kind kind) const {
+  assert(id > kInput);
+  assert(id < nodes_.size());
+  assert(nodes_[id].kind == kind);
+  return nodes_[id].layer;
+}
+
+template <typename T>
+int Graph<T>::add(const Conv<T>& conv, int x) {
+  convs_.push_back(conv);
+  return append(Kind::kConv, {x}, convs_.size() - 1);
+}
+
+template <typename T>
+int Graph<T>::add(const BatchNorm<T>& bn, int x) {
+  bns_.push_back(bn);
+  return append(Kind::kBatchNorm, {x}, bns_.size() - 1);
+}
+
+template <typename T>
+int Graph<T>::add(const Relu<T>& relu, int x) {
+  relus_.push_back(relu);
+  return append(Kind::kRelu, {x}, relus_.size() - 1);
+}
+
+template <typename T>
+int Graph<T>::add(const MaxPool<T>& pool, int x) {
+  pools_.push_back(pool);
+  return append(Kind::kMaxPool, {x}, pools_.size() - 1);
+}
+
+template <typename T>
+int Graph<T>::add(const Affine<T>& affine, int x) {
+  affines_.push_back(affine);
+  return append(Kind::kAffine, {x}, affines_.size() - 1);
+}
+
+template <typename T>
+int Graph<T>::flatten(int x) {
+  return append(Kind::kFlatten, {x}, 0);
+}
+
+template <typename T>
+int Graph<T>::sum(int a, int b) {
+  return append(Kind::kSum, {a, b}, 0);
+}
+
+template <typename T>
+std::vector<Param<T>> Graph<T>::params() {
+  std::vector<Param<T>> params;
+  for (const Node& node : nodes_) {
+    if (node.kind == Kind::kConv) {
+      Conv<T>& c = convs_[node.layer];
+      params.push_back({&c.w_, &c.dw_, true});
+      params.push_back({&c.b_, &c.db_, false});
+    } else if (node.kind == Kind::kBatchNorm) {
+      BatchNorm<T>& bn = bns_[node.layer];
+      params.push_back({&bn.gamma_, &bn.dgamma_, false});
+      params.push_back({&bn.beta_, &bn.dbeta_, false});
+    } else if (node.kind == Kind::kAffine) {
+      Affine<T>& a = affines_[node.layer];
+      params.push_back({&a.w_, &a.dw_, true});
+      params.push_back({&a.b_, &a.db_, false});
+    }
+  }
+  return params;
+}
+
+template <typename T>
+bool Graph<T>::keeps_input(int id) const {
+  return nodes_[id].kind == Kind::kConv || nodes_[id].kind == Kind::kAffine;
+}
+
+template <typename T>
+std::vector<int64_t> Graph<T>::output_shape(int id) const {
+  const Node& node = nodes_[id];
+  const std::vector<int64_t>& x = shapes_[node.inputs[0]];
+  switch (node.kind) {
+    case Kind::kConv:
+      return convs_[node.layer].output_shape(x);
+    case Kind::kMaxPool:
+      return pools_[node.layer].output_shape(x);
+    case Kind::kAffine:
+      return affines_[node.layer].output_shape(x);
+    case Kind::kFlatten:
+      return {x[0], Elements(x) / x[0]};
+    case Kind::kSum:
+      assert(shapes_[node.inputs[1]] == x);
+      return x;
+    default:
+      return x;
+  }
+}
+
+// Steps: forward of node i at i, the loss at n, backward of node i at
+// 2n - i. Tensor i is the output of node i, n + i its gradient, and the
+// scratch gradients follow. Tensors joined into one set share memory, so
+// the set lives from the first write of any of them to the last read.
+template <typename T>
+void Graph<T>::plan(const std::vector<int64_t>& x) {
+  int n = nodes_.size();
+  assert(n > 1);
+  planned_ = x;
+  shapes_.assign(n, {});
+  shapes_[kInput] = x;
+  for (int i = 1; i < n; i++) {
+    shapes_[i] = output_shape(i);
+  }
+  assert(shapes_[n - 1].size() == 2);  // scores for the loss
+
+  std::vector<int64_t> size, start, end;
+  auto tensor = [&](int64_t elements) {
+    size.push_back(elements);
+    start.push_back(std::numeric_limits<int64_t>::max());
+    end.push_back(-1);
+    return int64_t(size.size() - 1);
+  };
+  auto use = [&](int64_t t, int64_t step) {
+    start[t] = std::min(start[t], step);
+    end[t] = std::max(end[t], step);
+  };
+  auto back = [n](int i) { return int64_t(2 * n - i); };
+  for (int k = 0; k < 2; k++) {
+    for (int i = 0; i < n; i++) {
+      tensor(Elements(shapes_[i]));
+    }
+  }
+
+  for (int i = 1; i < n; i++) {
+    use(i, i);
+    for (int j : nodes_[i].inputs) {
+      use(j, i);
+      if (keeps_input(i)) {
+        use(j, back(i));
+      }
+    }
+  }
+  use(n - 1, n);
+  use(2 * n - 1, n);
+  // the first consumer to reach an input in backward writes its gradient
+  std::vector<std::vector<int64_t>> targets(n);
+  std::vector<bool> written(n, false);
+  written[n - 1] = true;
+  for (int i = n - 1; i >= 1; i--) {
+    assert(written[i]);  // every node but the last feeds another
+    use(n + i, back(i));
+    for (int j : nodes_[i].inputs) {
+      int64_t t = -1;
+      if (j != kInput) {
+        t = written[j] ? tensor(size[n + j]) : n + j;
+        written[j] = true;
+        use(t, back(i));
+        use(n + j, back(i));
+      }
+      targets[i].push_back(t);
+    }
+  }
+
+  std::vector<int64_t> root(size.size());
+  std::iota(root.begin(), root.end(), 0);
+  auto find = [&](int64_t t) {
+    while (root[t] != t) {
+      t = root[t] = root[root[t]];
+    }
+    return t;
+  };
+  auto join = [&](int64_t a, int64_t b) {
+    a = find(a);
+    b = find(b);
+    if (a != b) {
+      root[b] = a;
+      size[a] = std::max(size[a], size[b]);
+      start[a] = std::min(start[a], start[b]);
+      end[a] = std::max(end[a], end[b]);
+    }
+  };
+  for (int i = 1; i < n; i++) {
+    int j = nodes_[i].inputs[0];
+    if (nodes_[i].kind == Kind::kFlatten) {
+      join(j, i);
+      if (j != kInput) {
+        join(targets[i][0], n + i);
+      }
+    } else if (nodes_[i].kind == Kind::kRelu && j != kInput) {
+      // in place when nothing reads the input after the relu; its
+      // gradient is read by the relu alone, so backward always is
+      int64_t r = find(j);
+      if (r != find(kInput) && end[r] <= i) {
+        join(j, i);
+      }
+      join(targets[i][0], n + i);
+    }
+  }
+
+  // greedy by start step: a free buffer that fits with the least room to
+  // spare, otherwise the largest free one grown to fit
+  std::vector<int64_t> sets;
+  tensor_bytes_ = 0;
+  for (int64_t t = 0; t < size.size(); t++) {
+    if (find(t) == t && end[t] >= 0 && t != find(kInput)) {
+      sets.push_back(t);
+      tensor_bytes_ += size[t] * sizeof(T);
+    }
+  }
+  std::sort(sets.begin(), sets.end(),
+            [&](int64_t a, int64_t b) { return start[a] < start[b]; });
+  std::vector<int64_t> buffer(size.size(), -1), capacity, busy_until;
+  for (int64_t t : sets) {
+    int64_t best = -1;
+    for (int64_t b = 0; b < capacity.size(); b++) {
+      if (busy_until[b] >= start[t]) {
+        continue;
+      }
+      if (best < 0) {
+        best = b;
+        continue;
+      }
+      bool fits = capacity[b] >= size[t];
+      bool best_fits = capacity[best] >= size[t];
+      if (fits != best_fits ? fits
+          : fits            ? capacity[b] < capacity[best]
+                            : capacity[b] > capacity[best]) {
+        best = b;
+      }
+    }
+    if (best < 0) {
+      best = capacity.size();
+      capacity.push_back(0);
+      busy_until.push_back(-1);
+    }
+    capacity[best] = std::max(capacity[best], size[t]);
+    busy_until[best] = end[t];
+    buffer[t] = best;
+  }
+
+  buffers_.clear();
+  for (int64_t c : capacity) {
+    buffers_.push_back(Ndarray<T>(c));
+  }
+  auto view = [&](int64_t t, const std::vector<int64_t>& shape) {
+    return buffers_[buffer[find(t)]].slice(0, size[t]).reshape(shape);
+  };
+  acts_.assign(n, Ndarray<T>());
+  grads_.assign(n, Ndarray<T>());
+  input_grads_.assign(n, {});
+  for (int i = 1; i < n; i++) {
+    if (find(i) != find(kInput)) {
+      acts_[i] = view(i, shapes_[i]);
+    }
+    grads_[i] = view(n + i, shapes_[i]);
+    for (int k = 0; k < nodes_[i].inputs.size(); k++) {
+      int j = nodes_[i].inputs[k];
+      InputGrad g;
+      if (j != kInput) {
+        g.dx = view(targets[i][k], shapes_[j]);
+        g.add = targets[i][k] != n + j;
+      }
+      input_grads_[i].push_back(g);
+    }
+  }
+}
+
+template <typename T>
+int64_t Graph<T>::buffer_bytes() const {
+  int64_t bytes = 0;
+  for (const auto& b : buffers_) {
+    bytes += b.size() * sizeof(T);
+  }
+  return bytes;
+}
+
+template <typename T>
+void Graph<T>::run_forward(const Ndarray<T>& x) {
+  if (x.shape() != planned_) {
+    plan(x.shape());
+  }
+  acts_[kInput] = x.contiguous();
+  for (int i = 1; i < nodes_.size(); i++) {
+    const Node& node = nodes_[i];
+    const Ndarray<T>& a = acts_[node.inputs[0]];
+    Ndarray<T>* out = &acts_[i];
+    switch (node.kind) {
+      case Kind::kConv:
+        convs_[node.layer].forward_into(a, out);
+        break;
+      case Kind::kBatchNorm:
+        bns_[node.layer].forward_into(a, out);
+        break;
+      case Kind::kRelu:
+        relus_[node.layer].forward_into(a, out);
+        break;
+      case Kind::kMaxPool:
+        pools_[node.layer].forward_into(a, out);
+        break;
+      case Kind::kAffine:
+        affines_[node.layer].forward_into(a, out);
+        break;
+      case Kind::kFlatten:
+        *out = acts_[node.inputs[0]].reshape(shapes_[i]);
+        break;
+      case Kind::kSum: {
+        const Ndarray<T>& b = acts_[node.inputs[1]];
+        Binary(BinaryOp::kAdd, a.size(), a.ptr(), b.ptr(), out->ptr());
+        break;
+      }
+      case Kind::kInput:
+        assert(false);
+    }
+  }
+}
+
+// Inputs that are the graph input get no gradient, so layers with
+// parameters skip dx and the others do nothing for them.
+template <typename T>
+void Graph<T>::run_backward() {
+  for (int i = nodes_.size() - 1; i >= 1; i--) {
+    const Node& node = nodes_[i];
+    const Ndarray<T>& d = grads_[i];
+    std::vector<InputGrad>& targets = input_grads_[i];
+    Ndarray<T>* dx = node.inputs[0] == kInput ? nullptr : &targets[0].dx;
+    switch (node.kind) {
+      case Kind::kConv:
+        convs_[node.layer].backward_into(d, dx);
+        break;
+      case Kind::kBatchNorm:
+        bns_[node.layer].backward_into(d, dx);
+        break;
+      case Kind::kRelu:
+        if (dx) {
+          relus_[node.layer].backward_into(d, dx);
+        }
+        break;
+      case Kind::kMaxPool:
+        if (dx) {
+          pools_[node.layer].backward_into(d, dx);
+        }
+        break;
+      case Kind::kAffine:
+        affines_[node.layer].backward_into(d, dx);
+        break;
+      case Kind::kFlatten:
+        break;  // dx is a view of d
+      case Kind::kSum:
+        for (int k = 0; k < 2; k++) {
+          if (node.inputs[k] != kInput) {
+            Assign(Lazy(d), &targets[k].dx);
+          }
+        }
+        break;
+      case Kind::kInput:
+        assert(false);
+    }
+    for (int k = 0; k < node.inputs.size(); k++) {
+      if (targets[k].add) {
+        Ndarray<T>& g = grads_[node.inputs[k]];
+        Binary(BinaryOp::kAdd, g.size(), g.ptr(), targets[k].dx.ptr(),
+               g.ptr());
+      }
+    }
+  }
+}
+
+template <typename T>
+const Ndarray<T>& Graph<T>::forward(const Ndarray<T>& x) {
+  run_forward(x);
+  return acts_.back();
+}
+
+template <typename T>
+double Graph<T>::loss(const Ndarray<T>& x, const int64_t* y, double reg) {
+  run_forward(x);
+  double loss = SoftmaxLoss(acts_.back(), y, &grads_.back());
+  run_backward();
+  if (reg > 0) {
+    for (const Param<T>& p : params()) {
+      if (p.decay) {
+        loss += reg * 0.5 * Sum(Square(Lazy(*p.value)));
+      }
+    }
+  }
+  return loss;
+}
+
+template class Graph<float>;
+template class Graph<double>;
+
+}  // namespace litecnn
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "layers.h"
+#include "ndarray.h"
+#include "optimizer.h"
+
+namespace litecnn {
+
+// A network as a DAG over the layer classes of layers.h, trained with a
+// softmax loss on the output of its last node. Instantiated for float and
+// double.
+//
+// Nodes are added in topological order and named by the ids add returns;
+// kInput is the graph input. The graph keeps copies of the layers, which
+// share their parameter arrays with the originals.
+//
+// The first pass for an input shape plans the memory of every activation
+// and gradient: each gets a step interval on the timeline forward, loss,
+// backward in reverse, from the step writing it to the last one reading it.
+// Conv and Affine read their input again in backward, relus run in place on
+// an input nothing else needs, flattens are views, and a node whose output
+// feeds several others sums their gradients. Tensors with disjoint
+// intervals are then packed greedily into a few buffers, and later passes
+// with that shape run on views of them without allocating.
+template <typename T = float>
+class Graph {
+ public:
+  static const int kInput = 0;
+
+  Graph() : nodes_(1) {}
+
+  // Each appends a node reading the output of x, an earlier node.
+  int add(const Conv<T>& conv, int x);
+  int add(const BatchNorm<T>& bn, int x);
+  int add(const Relu<T>& relu, int x);
+  int add(const MaxPool<T>& pool, int x);
+  int add(const Affine<T>& affine, int x);
+  // (N,...) to (N,-1)
+  int flatten(int x);
+  // elementwise a + b, for residual connections
+  int sum(int a, int b);
+
+  // the copies the graph runs, by node id
+  Conv<T>& conv(int id) { return convs_[layer(id, Kind::kConv)]; }
+  BatchNorm<T>& batch_norm(int id) {
+    return bns_[layer(id, Kind::kBatchNorm)];
+  }
+  Affine<T>& affine(int id) { return affines_[layer(id, Kind::kAffine)]; }
+
+  // for an Optimizer, in node order
+  std::vector<Param<T>> params();
+
+  // Output of the last node, a view of a planned buffer valid until the
+  // next pass. Batch norms run in whatever mode they are in.
+  const Ndarray<T>& forward(const Ndarray<T>& x);
+
+  // Both passes, leaving the parameter gradients in the layers. reg adds
+  // reg / 2 ||w||^2 over the weights to the loss, whose gradient is left to
+  // an Optimizer with weight_decay reg.
+  double loss(const Ndarray<T>& x, const int64_t* y, double reg = 0);
+
+  // Bytes of the planned buffers, and those the same tensors would take
+  // with a buffer each (views and in-place results counted once).
+  int64_t buffer_bytes() const;
+  int64_t tensor_bytes() const { return tensor_bytes_; }
+
+ private:
+  enum class Kind {
+    kInput,
+    kConv,
+    kBatchNorm,
+    kRelu,
+    kMaxPool,
+    kAffine,
+    kFlatten,
+    kSum,
+  };
+
+  struct Node {
+    Kind kind = Kind::kInput;
+    std::vector<int> inputs;
+    int64_t layer = 0;  // index into the deque of its kind
+  };
+
+  // Where backward puts the gradient of one input of a node: the input's
+  // own gradient for the first consumer to get there, a scratch tensor
+  // added into it for the others.
+  struct InputGrad {
+    Ndarray<T> dx;
+    bool add = false;
+  };
+
+  int append(Kind kind, std::vector<int> inputs, int64_t layer);
+  int64_t layer(int id, Kind kind) const;
+  // reads its input again in backward
+  bool keeps_input(int id) const;
+  std::vector<int64_t> output_shape(int id) const;
+  // shapes, intervals and buffers for inputs of shape x
+  void plan(const std::vector<int64_t>& x);
+  void run_forward(const Ndarray<T>& x);
+  void run_backward();
+
+  std::vector<Node> nodes_;
+  std::deque<Conv<T>> convs_;
+  std::deque<BatchNorm<T>> bns_;
+  std::deque<Relu<T>> relus_;
+  std::deque<MaxPool<T>> pools_;
+  std::deque<Affine<T>> affines_;
+
+  // the plan, for inputs of shape planned_
+  std::vector<int64_t> planned_;
+  std::vector<std::vector<int64_t>> shapes_;  // per node
+  std::vector<Ndarray<T>> buffers_;
+  std::vector<Ndarray<T>> acts_;   // per node, acts_[kInput] being x
+  std::vector<Ndarray<T>> grads_;  // per node
+  std::vector<std::vector<InputGrad>> input_grads_;  // per node and input
+  int64_t tensor_bytes_ = 0;
+};
+
+}  // namespace litecnn
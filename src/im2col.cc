@@ -0,0 +1,94 @@
+#include "im2col.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace litecnn {
+
+namespace {
+
+// Range of output columns [lo, hi) whose input column o*s - p + j lies
+// inside [0, w).
+inline void ValidRange(int64_t w, int64_t w2, int64_t s, int64_t p, int64_t j,
+                       int64_t* lo, int64_t* hi) {
+  // lo: smallest o with o*s >= p - j, hi: smallest o with o*s >= w + p - j
+  *lo = std::max<int64_t>(0, (p - j + s - 1) / s);
+  *hi = std::min<int64_t>(w2, (w + p - j + s - 1) / s);
+  *hi = std::max(*hi, *lo);
+}
+
+}  // namespace
+
+template <typename T>
+void Im2Col(const T* x, int64_t c, int64_t h, int64_t w, int64_t fh,
+            int64_t fw, int64_t s, int64_t p, T* col) {
+  int64_t h2 = 1 + (h + 2 * p - fh) / s;
+  int64_t w2 = 1 + (w + 2 * p - fw) / s;
+  for (int64_t k = 0; k < c; k++) {
+    const T* xk = x + k * h * w;
+    for (int64_t i = 0; i < fh; i++) {
+      for (int64_t j = 0; j < fw; j++) {
+        int64_t lo, hi;
+        ValidRange(w, w2, s, p, j, &lo, &hi);
+        for (int64_t oh = 0; oh < h2; oh++, col += w2) {
+          int64_t ih = oh * s - p + i;
+          if (ih < 0 || ih >= h) {
+            std::fill(col, col + w2, T(0));
+            continue;
+          }
+          const T* xrow = xk + ih * w;
+          std::fill(col, col + lo, T(0));
+          if (s == 1) {
+            std::copy(xrow + lo - p + j, xrow + hi - p + j, col + lo);
+          } else {
+            for (int64_t ow = lo; ow < hi; ow++) {
+              col[ow] = xrow[ow * s - p + j];
+            }
+          }
+          std::fill(col + hi, col + w2, T(0));
+        }
+      }
+    }
+  }
+}
+
+template <typename T>
+void Col2Im(const T* col, int64_t c, int64_t h, int64_t w, int64_t fh,
+            int64_t fw, int64_t s, int64_t p, T* x) {
+  int64_t h2 = 1 + (h + 2 * p - fh) / s;
+  int64_t w2 = 1 + (w + 2 * p - fw) / s;
+  for (int64_t k = 0; k < c; k++) {
+    T* xk = x + k * h * w;
+    for (int64_t i = 0; i < fh; i++) {
+      for (int64_t j = 0; j < fw; j++) {
+        int64_t lo, hi;
+        ValidRange(w, w2, s, p, j, &lo, &hi);
+        for (int64_t oh = 0; oh < h2; oh++, col += w2) {
+          int64_t ih = oh * s - p + i;
+          if (ih < 0 || ih >= h) {
+            continue;
+          }
+          T* xrow = xk + ih * w;
+          for (int64_t ow = lo; ow < hi; ow++) {
+            xrow[ow * s - p + j] += col[ow];
+          }
+        }
+      }
+    }
+  }
+}
+
+template void Im2Col<float>(const float* x, int64_t c, int64_t h, int64_t w,
+                            int64_t fh, int64_t fw, int64_t s, int64_t p,
+                            float* col);
+template void Im2Col<double>(const double* x, int64_t c, int64_t h, int64_t w,
+                             int64_t fh, int64_t fw, int64_t s, int64_t p,
+                             double* col);
+template void Col2Im<float>(const float* col, int64_t c, int64_t h, int64_t w,
+                            int64_t fh, int64_t fw, int64_t s, int64_t p,
+                            float* x);
+template void Col2Im<double>(const double* col, int64_t c, int64_t h,
+                             int64_t w, int64_t fh, int64_t fw, int64_t s,
+                             int64_t p, double* x);
+
+}  // namespace litecnn
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+namespace litecnn {
+
+// Unrolls the receptive fields of a (c,h,w) image into a column matrix of
+// shape (c*fh*fw, h2*w2), so that a convolution becomes w (fn,c*fh*fw) times
+// col. Zero padding of p pixels is applied on every border.
+template <typename T>
+void Im2Col(const T* x, int64_t c, int64_t h, int64_t w, int64_t fh,
+            int64_t fw, int64_t s, int64_t p, T* col);
+
+// Adjoint of Im2Col: adds every column entry back onto the image pixel it
+// was read from. x is accumulated into, not overwritten.
+template <typename T>
+void Col2Im(const T* col, int64_t c, int64_t h, int64_t w, int64_t fh,
+            int64_t fw, int64_t s, int64_t p, T* x);
+
+}  // namespace litecnn
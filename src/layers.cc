@@ -1,136 +1,503 @@
 #include "layers.h"
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <numeric>
+#include <vector>
 
+#include "blocked.h"
+#include "expr.h"
+#include "gemm.h"
+#include "im2col.h"
 #include "ndarray.h"
+#include "parallel.h"
+#include "pool.h"
+#include "simd.h"
 
 namespace litecnn {
 
-Affine::Affine(int64_t m, int64_t n, double scale) : w_(m, n), b_(n) {
-  w_.gaussian(scale);
+namespace {
+
+// Relu elements per task, a whole number of mask words.
+const int64_t kReluBlock = 1 << 14;
+
+// o[i] = max(x[i], 0) for i < n, setting bit i of the mask m where x[i] was
+// kept. The loops over whole words have fixed trip counts and vectorize;
+// helpers of their own, as they do not inside ParallelFor's lambda.
+template <typename T>
+void ReluMask(int64_t n, const T* x, T* o, uint64_t* m) {
+  for (int64_t w = 0; w < (n + 63) / 64; w++) {
+    int64_t len = std::min<int64_t>(64, n - w * 64);
+    uint64_t bits = 0;
+    if (len == 64) {
+      for (int64_t j = 0; j < 64; j++) {
+        T v = x[w * 64 + j];
+        bool keep = !(v <= 0);
+        bits |= uint64_t(keep) << j;
+        o[w * 64 + j] = keep ? v : 0;
+      }
+    } else {
+      for (int64_t j = 0; j < len; j++) {
+        T v = x[w * 64 + j];
+        bool keep = !(v <= 0);
+        bits |= uint64_t(keep) << j;
+        o[w * 64 + j] = keep ? v : 0;
+      }
+    }
+    m[w] = bits;
+  }
 }
 
-Ndarray Affine::forward(const Ndarray& x) {
-  x_ = x;
-  return x.dot(w_) + b_;
+// o[i] = d[i] where bit i of the mask m is set, 0 elsewhere, for i < n.
+template <typename T>
+void ApplyMask(int64_t n, const uint64_t* m, const T* d, T* o) {
+  for (int64_t w = 0; w < n / 64; w++) {
+    uint64_t bits = m[w];
+    for (int64_t j = 0; j < 64; j++) {
+      o[w * 64 + j] = bits >> j & 1 ? d[w * 64 + j] : 0;
+    }
+  }
+  for (int64_t i = n / 64 * 64; i < n; i++) {
+    o[i] = m[i / 64] >> (i % 64) & 1 ? d[i] : 0;
+  }
 }
 
-Ndarray Affine::backward(const Ndarray& dout) {
-  db_ = dout;
-  while (db_.ndim() > 1) {
-    db_ = db_.sum(-2);
+// Readies the gradient of param for a pass that adds onto it: *grad becomes
+// beta * *grad, or zeros for beta = 0.
+template <typename T>
+void StartGradient(const Ndarray<T>& param, T beta, Ndarray<T>* grad) {
+  grad->ensure_shape(param.shape());
+  if (beta == 0) {
+    grad->fill(0);
+  } else if (beta != 1) {
+    *grad *= beta;
   }
-  dw_ = x_.T().dot(dout);
-  return dout.dot(w_.T());
 }
 
-Ndarray Relu::forward(const Ndarray& x) {
-  x_ = x;
-  Ndarray out = x.fork();
-  for (double& v : *out.data()) {
-    if (v < 0) {
-      v = 0;
+// Where a pass that overwrites its output puts the gradient of param: *grad
+// itself for beta = 0, otherwise scratch that AddGradient folds in after.
+template <typename T>
+Ndarray<T> GradientTarget(const Ndarray<T>& param, T beta, Ndarray<T>* grad) {
+  grad->ensure_shape(param.shape());
+  return beta == 0 ? *grad : param.as_zeros();
+}
+
+template <typename T>
+void AddGradient(const Ndarray<T>& g, T beta, Ndarray<T>* grad) {
+  if (beta != 0) {
+    Assign(Lazy(*grad) * beta + Lazy(g), grad);
+  }
+}
+
+// [*begin, *end) are the output columns ow of a w2 wide row whose filter tap
+// j reads inside a w wide input row, at ow * s - p + j.
+void TapRange(int64_t j, int64_t w, int64_t w2, int64_t s, int64_t p,
+              int64_t* begin, int64_t* end) {
+  *begin = j < p ? (p - j + s - 1) / s : 0;
+  *end = w - 1 + p - j < 0 ? 0 : std::min(w2, (w - 1 + p - j) / s + 1);
+}
+
+// y[i] += a * x[i * s] for i < n, with a unit stride loop of its own so that
+// it vectorizes.
+template <typename T>
+void AxpyStrided(int64_t n, T a, const T* x, int64_t s, T* y) {
+  if (s == 1) {
+    for (int64_t i = 0; i < n; i++) {
+      y[i] += a * x[i];
     }
+    return;
+  }
+  for (int64_t i = 0; i < n; i++) {
+    y[i] += a * x[i * s];
   }
-  return out;
 }
 
-Ndarray Relu::backward(const Ndarray& dout) {
-  Ndarray dx = dout.fork();
-  for (int64_t i0 = 0; i0 < dx.shape(0); i0++) {
-    for (int64_t i1 = 0; i1 < dx.shape(1); i1++) {
-      for (int64_t i2 = 0; i2 < dx.shape(2); i2++) {
-        for (int64_t i3 = 0; i3 < dx.shape(3); i3++) {
-          if (x_.at(i0, i1, i2, i3) <= 0) {
-            dx.at(i0, i1, i2, i3) = 0;
-          }
-        }
-      }
+// sum of x[i * s] * y[i] for i < n
+template <typename T>
+T DotStrided(int64_t n, const T* x, int64_t s, const T* y) {
+  T acc = 0;
+  if (s == 1) {
+    for (int64_t i = 0; i < n; i++) {
+      acc += x[i] * y[i];
     }
+    return acc;
+  }
+  for (int64_t i = 0; i < n; i++) {
+    acc += x[i * s] * y[i];
+  }
+  return acc;
+}
+
+}  // namespace
+
+template <typename T>
+Affine<T>::Affine(int64_t m, int64_t n, double scale) : w_(m, n), b_(n) {
+  w_.gaussian(scale);
+}
+
+template <typename T>
+std::vector<int64_t> Affine<T>::output_shape(
+    const std::vector<int64_t>& x) const {
+  assert(x.size() == 2);
+  assert(x[1] == w_.shape(0));
+  return {x[0], w_.shape(1)};
+}
+
+template <typename T>
+Ndarray<T> Affine<T>::forward(const Ndarray<T>& x) {
+  Ndarray<T> out;
+  forward_into(x, &out);
+  return out;
+}
+
+template <typename T>
+Ndarray<T> Affine<T>::backward(const Ndarray<T>& dout) {
+  // fresh gradients, so copies of the layer keep the ones they have
+  dw_ = Ndarray<T>();
+  db_ = Ndarray<T>();
+  Ndarray<T> dx;
+  backward_into(dout, &dx);
+  return dx;
+}
+
+template <typename T>
+void Affine<T>::forward_into(const Ndarray<T>& x, Ndarray<T>* out) {
+  x_ = x;
+  x.dot_into(w_, out);
+  *out += b_;
+}
+
+template <typename T>
+void Affine<T>::backward_into(const Ndarray<T>& dout, Ndarray<T>* dx,
+                              T beta) {
+  std::vector<int64_t> batch_dims(dout.ndim() - 1);
+  std::iota(batch_dims.begin(), batch_dims.end(), 0);
+  dout.sum_into(batch_dims, &db_, beta);
+  x_.T().dot_into(dout, &dw_, beta);
+  if (dx) {
+    dout.dot_into(w_.T(), dx);
   }
+}
+
+template <typename T>
+Ndarray<T> Relu<T>::forward(const Ndarray<T>& x) {
+  Ndarray<T> out;
+  forward_into(x, &out);
+  return out;
+}
+
+template <typename T>
+Ndarray<T> Relu<T>::backward(const Ndarray<T>& dout) {
+  Ndarray<T> dx;
+  backward_into(dout, &dx);
   return dx;
 }
 
-MaxPool::MaxPool(int64_t h, int64_t w, int64_t s) : h_(h), w_(w), s_(s) {}
+// NaNs pass forward and let the gradient through, as x <= 0 is the test for
+// zeroing.
+template <typename T>
+void Relu<T>::forward_into(const Ndarray<T>& x, Ndarray<T>* out) {
+  Ndarray<T> xc = x.contiguous();
+  x_shape_ = x.shape();
+  out->ensure_shape(x_shape_);
+  int64_t n = xc.size();
+  mask_.resize((n + 63) / 64);
+  const T* xp = xc.ptr();
+  T* o = out->ptr();
+  uint64_t* m = mask_.data();
+  ParallelFor(0, (n + kReluBlock - 1) / kReluBlock, [&](int64_t b, int64_t e) {
+    int64_t begin = b * kReluBlock;
+    ReluMask(std::min(e * kReluBlock, n) - begin, xp + begin, o + begin,
+             m + begin / 64);
+  });
+}
+
+template <typename T>
+void Relu<T>::backward_into(const Ndarray<T>& dout, Ndarray<T>* dx) {
+  assert(dout.shape() == x_shape_);
+  Ndarray<T> doutc = dout.contiguous();
+  dx->ensure_shape(x_shape_);
+  int64_t n = doutc.size();
+  const T* d = doutc.ptr();
+  const uint64_t* m = mask_.data();
+  T* o = dx->ptr();
+  ParallelFor(0, (n + kReluBlock - 1) / kReluBlock, [&](int64_t b, int64_t e) {
+    int64_t begin = b * kReluBlock;
+    ApplyMask(std::min(e * kReluBlock, n) - begin, m + begin / 64,
+              d + begin, o + begin);
+  });
+}
+
+template <typename T>
+MaxPool<T>::MaxPool(int64_t h, int64_t w, int64_t s) : h_(h), w_(w), s_(s) {}
+
+template <typename T>
+std::vector<int64_t> MaxPool<T>::output_shape(
+    const std::vector<int64_t>& x) const {
+  assert(x.size() >= 2);
+  std::vector<int64_t> out = x;
+  out[x.size() - 1] = (out[x.size() - 1] + s_ - 1) / s_;
+  out[x.size() - 2] = (out[x.size() - 2] + s_ - 1) / s_;
+  return out;
+}
+
+template <typename T>
+Ndarray<T> MaxPool<T>::forward(const Ndarray<T>& x) {
+  Ndarray<T> out;
+  forward_into(x, &out);
+  return out;
+}
 
-Ndarray MaxPool::forward(const Ndarray& x) {
+template <typename T>
+Ndarray<T> MaxPool<T>::backward(const Ndarray<T>& dout) {
+  Ndarray<T> dx;
+  backward_into(dout, &dx);
+  return dx;
+}
+
+template <typename T>
+void MaxPool<T>::forward_into(const Ndarray<T>& x, Ndarray<T>* out) {
   assert(x.ndim() >= 2);
-  auto outshape = x.shape();
-  outshape[x.ndim() - 1] = (outshape[x.ndim() - 1] + s_ - 1) / s_;
-  outshape[x.ndim() - 2] = (outshape[x.ndim() - 2] + s_ - 1) / s_;
-  Ndarray out(outshape, nullptr);
-  Ndarray outt = out.T();
-  Ndarray xt = x.T();
-  for (int64_t i0 = 0; i0 < outt.shape(0); i0++) {
-    for (int64_t i1 = 0; i1 < outt.shape(1); i1++) {
-      for (int64_t i2 = 0; i2 < outt.shape(2); i2++) {
-        for (int64_t i3 = 0; i3 < outt.shape(3); i3++) {
-          double v = -std::numeric_limits<double>::infinity();
-          for (int64_t ii = i0 * s_; ii < std::min(i0 * s_ + w_, xt.shape(0));
-               ii++) {
-            for (int64_t jj = i1 * s_; jj < std::min(i1 * s_ + h_, xt.shape(1));
-                 jj++) {
-              v = std::max(v, xt.at(ii, jj, i2, i3));
+  assert(h_ * w_ <= 256);
+  x_shape_ = x.shape();
+  out->ensure_shape(output_shape(x_shape_));
+  Ndarray<T> xc = x.contiguous();
+  int64_t H = x.shape(-2);
+  int64_t W = x.shape(-1);
+  int64_t H2 = out->shape(-2);
+  int64_t W2 = out->shape(-1);
+  int64_t planes = x.size() / (H * W);
+  argmax_.resize(out->size());
+  ParallelFor(0, planes, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      const T* xq = xc.ptr() + q * H * W;
+      T* o = out->ptr() + q * H2 * W2;
+      uint8_t* a = argmax_.data() + q * H2 * W2;
+      for (int64_t i = 0; i < H2; i++) {
+        for (int64_t j = 0; j < W2; j++) {
+          T v = xq[i * s_ * W + j * s_];
+          int64_t best = 0;
+          for (int64_t di = 0; di < std::min(h_, H - i * s_); di++) {
+            for (int64_t dj = 0; dj < std::min(w_, W - j * s_); dj++) {
+              T u = xq[(i * s_ + di) * W + j * s_ + dj];
+              if (u > v) {
+                v = u;
+                best = di * w_ + dj;
+              }
             }
           }
-          assert(!std::isinf(v));
-          outt.at(i0, i1, i2, i3) = v;
+          o[i * W2 + j] = v;
+          a[i * W2 + j] = best;
         }
       }
     }
-  }
-  outt_ = outt;
-  xt_ = xt;
-  return out;
+  });
 }
 
-Ndarray MaxPool::backward(const Ndarray& dout) {
-  Ndarray doutt = dout.T();
-  Ndarray dx = xt_.T().as_zeros();
-  Ndarray dxt = dx.T();
-  for (int64_t i0 = 0; i0 < doutt.shape(0); i0++) {
-    for (int64_t i1 = 0; i1 < doutt.shape(1); i1++) {
-      for (int64_t i2 = 0; i2 < doutt.shape(2); i2++) {
-        for (int64_t i3 = 0; i3 < doutt.shape(3); i3++) {
-          for (int64_t ii = i0 * s_; ii < std::min(i0 * s_ + w_, dxt.shape(0));
-               ii++) {
-            for (int64_t jj = i1 * s_;
-                 jj < std::min(i1 * s_ + h_, dxt.shape(1)); jj++) {
-              if (outt_.at(i0, i1, i2, i3) == xt_.at(ii, jj, i2, i3)) {
-                dxt.at(ii, jj, i2, i3) += doutt.at(i0, i1, i2, i3);
-              }
-            }
-          }
+template <typename T>
+void MaxPool<T>::backward_into(const Ndarray<T>& dout, Ndarray<T>* dx) {
+  assert(dout.size() == argmax_.size());
+  Ndarray<T> doutc = dout.contiguous();
+  dx->ensure_shape(x_shape_);
+  dx->fill(0);
+  int64_t H = dx->shape(-2);
+  int64_t W = dx->shape(-1);
+  int64_t H2 = (H + s_ - 1) / s_;
+  int64_t W2 = (W + s_ - 1) / s_;
+  int64_t planes = dx->size() / (H * W);
+  ParallelFor(0, planes, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      const T* d = doutc.ptr() + q * H2 * W2;
+      const uint8_t* a = argmax_.data() + q * H2 * W2;
+      T* dxq = dx->ptr() + q * H * W;
+      for (int64_t i = 0; i < H2; i++) {
+        for (int64_t j = 0; j < W2; j++) {
+          int64_t k = i * W2 + j;
+          dxq[(i * s_ + a[k] / w_) * W + j * s_ + a[k] % w_] += d[k];
         }
       }
     }
-  }
-  return dx;
+  });
+}
+
+template <typename T>
+void MaxPool<T>::forward_blocked(const Ndarray<T>& x, Ndarray<T>* out) {
+  assert(x.ndim() == 5);
+  assert(x.shape(4) == ChannelBlock<T>());
+  Ndarray<T> xc = x.contiguous();
+  out->ensure_shape({x.shape(0), x.shape(1), (x.shape(2) + s_ - 1) / s_,
+                     (x.shape(3) + s_ - 1) / s_, x.shape(4)});
+  BlockedMaxPool(xc.ptr(), x.shape(0), x.shape(1), x.shape(2), x.shape(3),
+                 h_, w_, s_, out->ptr());
 }
 
-Conv::Conv(int64_t fh, int64_t fw, int64_t fc, int64_t fn, int64_t s, int64_t p,
-           double scale)
-    : w_(fn, fc, fh, fw),
+template <typename T>
+Conv<T>::Conv(int64_t fh, int64_t fw, int64_t fc, int64_t fn, int64_t s,
+              int64_t p, double scale, Algo algo, int64_t groups)
+    : w_(fn, fc / groups, fh, fw),
       b_(fn),
       fh_(fh),
       fw_(fw),
       fc_(fc),
       fn_(fn),
       s_(s),
-      p_(p) {
+      p_(p),
+      algo_(algo),
+      groups_(groups) {
+  assert(groups > 0 && fc % groups == 0 && fn % groups == 0);
   w_.gaussian(scale);
+  if ((algo == Algo::kWinograd2 || algo == Algo::kWinograd4) && s == 1 &&
+      fh == fw && p < fh) {
+    int64_t m = algo == Algo::kWinograd2 ? 2 : 4;
+    if (m + fh - 1 <= 8) {
+      winograd_ = std::make_shared<Winograd<T>>(m, fh);
+    }
+  }
 }
 
-Ndarray Conv::forward(const Ndarray& x) {
-  assert(x.ndim() == 4);
-  assert(x.shape(1) == fc_);
-  int64_t N = x.shape(0);
+template <typename T>
+Ndarray<T> Conv<T>::forward(const Ndarray<T>& x) {
+  Ndarray<T> out;
+  forward_into(x, &out);
+  return out;
+}
+
+template <typename T>
+Ndarray<T> Conv<T>::backward(const Ndarray<T>& dout) {
+  // fresh gradients, so copies of the layer keep the ones they have
+  dw_ = Ndarray<T>();
+  db_ = Ndarray<T>();
+  Ndarray<T> dx;
+  backward_into(dout, &dx);
+  return dx;
+}
+
+template <typename T>
+void Conv<T>::forward_into(const Ndarray<T>& x, Ndarray<T>* out) {
+  if (groups_ > 1 && algo_ != Algo::kDirect) {
+    return groups_ == fc_ ? forward_depthwise(x, out) : forward_im2col(x, out);
+  }
+  switch (algo_) {
+    case Algo::kDirect:
+      return forward_direct(x, out);
+    case Algo::kIm2col:
+      return forward_im2col(x, out);
+    case Algo::kWinograd2:
+    case Algo::kWinograd4:
+      return winograd_ ? forward_winograd(x, out) : forward_im2col(x, out);
+    case Algo::kFft:
+      return fft_capable() ? forward_fft(x, out) : forward_im2col(x, out);
+  }
+  assert(false);
+}
+
+template <typename T>
+void Conv<T>::backward_into(const Ndarray<T>& dout, Ndarray<T>* dx, T beta) {
+  assert(dout.ndim() == 4);
+  dout.sum_into({0, 2, 3}, &db_, beta);
+  if (groups_ > 1 && algo_ != Algo::kDirect) {
+    return groups_ == fc_ ? backward_depthwise(dout, dx, beta)
+                          : backward_im2col(dout, dx, beta);
+  }
+  switch (algo_) {
+    case Algo::kDirect:
+      return backward_direct(dout, dx, beta);
+    case Algo::kIm2col:
+      return backward_im2col(dout, dx, beta);
+    case Algo::kWinograd2:
+    case Algo::kWinograd4:
+      return winograd_ ? backward_winograd(dout, dx, beta)
+                       : backward_im2col(dout, dx, beta);
+    case Algo::kFft:
+      return fft_capable() ? backward_fft(dout, dx, beta)
+                           : backward_im2col(dout, dx, beta);
+  }
+  assert(false);
+}
+
+template <typename T>
+void Conv<T>::update_blocked_filters(int64_t ci) {
+  int64_t c = ChannelBlock<T>();
+  if (blocked_u_.ndim() == 0 || blocked_u_.shape(4) != ci ||
+      !std::equal(w_.ptr(), w_.ptr() + w_.size(), blocked_w_.ptr())) {
+    blocked_w_ = w_.fork();
+    blocked_u_ = Ndarray<T>(
+        {(fn_ + c - 1) / c, (fc_ + ci - 1) / ci, fh_, fw_, ci, c}, nullptr);
+    // The blocked kernels are dense, so grouped filters are widened to all
+    // fc channels with zeros outside their group.
+    const T* w = w_.ptr();
+    PooledVector<T> dense;
+    if (groups_ > 1) {
+      int64_t taps = fh_ * fw_;
+      int64_t cg = fc_ / groups_;
+      dense.assign(fn_ * fc_ * taps, T(0));
+      for (int64_t f = 0; f < fn_; f++) {
+        std::copy(w + f * cg * taps, w + (f + 1) * cg * taps,
+                  dense.begin() + (f * fc_ + f / (fn_ / groups_) * cg) * taps);
+      }
+      w = dense.data();
+    }
+    PackBlockedFilters(w, fn_, fc_, fh_, fw_, ci, blocked_u_.ptr());
+  }
+}
+
+template <typename T>
+void Conv<T>::forward_blocked(const Ndarray<T>& x, Ndarray<T>* out) {
+  assert(x.ndim() == 5);
+  int64_t c = ChannelBlock<T>();
+  int64_t ci = x.shape(4);
+  assert(ci == 1 || ci == c);
+  assert(x.shape(1) == (fc_ + ci - 1) / ci);
+  int64_t H = x.shape(2);
+  int64_t W = x.shape(3);
+  update_blocked_filters(ci);
+  Ndarray<T> xc = x.contiguous();
+  out->ensure_shape({x.shape(0), (fn_ + c - 1) / c,
+                     1 + (H + 2 * p_ - fh_) / s_, 1 + (W + 2 * p_ - fw_) / s_,
+                     c});
+  BlockedConv(blocked_u_.ptr(), b_.ptr(), xc.ptr(), x.shape(0), x.shape(1), H,
+              W, ci, fn_, fh_, fw_, s_, p_, out->ptr());
+}
+
+template <typename T>
+void Conv<T>::forward_relu_pool_blocked(const Ndarray<T>& x,
+                                        const MaxPool<T>& pool,
+                                        Ndarray<T>* out) {
+  assert(x.ndim() == 5);
+  int64_t c = ChannelBlock<T>();
+  int64_t ci = x.shape(4);
+  assert(ci == 1 || ci == c);
+  assert(x.shape(1) == (fc_ + ci - 1) / ci);
   int64_t H = x.shape(2);
   int64_t W = x.shape(3);
-  int64_t H2 = 1 + (H + 2 * p_ - fh_) / s_;
-  int64_t W2 = 1 + (W + 2 * p_ - fw_) / s_;
-  Ndarray out(N, fn_, H2, W2);
+  update_blocked_filters(ci);
+  Ndarray<T> xc = x.contiguous();
+  int64_t ps = pool.stride();
+  out->ensure_shape({x.shape(0), (fn_ + c - 1) / c,
+                     ((H + 2 * p_ - fh_) / s_ + ps) / ps,
+                     ((W + 2 * p_ - fw_) / s_ + ps) / ps, c});
+  BlockedConvReluPool(blocked_u_.ptr(), b_.ptr(), xc.ptr(), x.shape(0),
+                      x.shape(1), H, W, ci, fn_, fh_, fw_, s_, p_,
+                      pool.height(), pool.width(), ps, out->ptr());
+}
+
+template <typename T>
+std::vector<int64_t> Conv<T>::output_shape(
+    const std::vector<int64_t>& x) const {
+  assert(x.size() == 4);
+  assert(x[1] == fc_);
+  return {x[0], fn_, 1 + (x[2] + 2 * p_ - fh_) / s_,
+          1 + (x[3] + 2 * p_ - fw_) / s_};
+}
+
+template <typename T>
+void Conv<T>::forward_direct(const Ndarray<T>& x, Ndarray<T>* outp) {
+  int64_t H = x.shape(2);
+  int64_t W = x.shape(3);
+  outp->ensure_shape(output_shape(x.shape()));
+  outp->fill(0);
+  Ndarray<T> out = *outp;
   // out  i
   // w_   j
   // x    k
@@ -154,10 +521,10 @@ Ndarray Conv::forward(const Ndarray& x) {
           for (int64_t i0 = 0; i0 < out.shape(0); i0++) {
             int64_t k0 = i0;
             for (int64_t i1 = 0; i1 < out.shape(1); i1++) {
-              double v = 0.0;
+              T v = 0;
               int64_t j0 = i1;
               for (int64_t j1 = 0; j1 < w_.shape(1); j1++) {
-                int64_t k1 = j1;
+                int64_t k1 = i1 / (fn_ / groups_) * w_.shape(1) + j1;
                 v += w_.at(j0, j1, j2, j3) * x.at(k0, k1, k2, k3);
               }
               out.at(i0, i1, i2, i3) += v;
@@ -168,16 +535,20 @@ Ndarray Conv::forward(const Ndarray& x) {
     }
   }
   x_ = x;
-  return out;
 }
 
-Ndarray Conv::backward(const Ndarray& dout) {
-  assert(dout.ndim() == 4);
+template <typename T>
+void Conv<T>::backward_direct(const Ndarray<T>& dout, Ndarray<T>* dxp,
+                              T beta) {
   int64_t H = x_.shape(2);
   int64_t W = x_.shape(3);
-  db_ = dout.sum(3).sum(2).sum(0);
-  dw_ = w_.as_zeros();
-  Ndarray dx = x_.as_zeros();
+  StartGradient(w_, beta, &dw_);
+  Ndarray<T> dx;
+  if (dxp) {
+    dxp->ensure_shape(x_.shape());
+    dxp->fill(0);
+    dx = *dxp;
+  }
   // out  i
   // w_   j
   // x    k
@@ -196,12 +567,14 @@ Ndarray Conv::backward(const Ndarray& dout) {
           for (int64_t i0 = 0; i0 < dout.shape(0); i0++) {
             int64_t k0 = i0;
             for (int64_t i1 = 0; i1 < dout.shape(1); i1++) {
-              double dv = dout.at(i0, i1, i2, i3);
+              T dv = dout.at(i0, i1, i2, i3);
               int64_t j0 = i1;
               for (int64_t j1 = 0; j1 < w_.shape(1); j1++) {
-                int64_t k1 = j1;
+                int64_t k1 = i1 / (fn_ / groups_) * w_.shape(1) + j1;
                 dw_.at(j0, j1, j2, j3) += dv * x_.at(k0, k1, k2, k3);
-                dx.at(k0, k1, k2, k3) += dv * w_.at(j0, j1, j2, j3);
+                if (dxp) {
+                  dx.at(k0, k1, k2, k3) += dv * w_.at(j0, j1, j2, j3);
+                }
               }
             }
           }
@@ -209,7 +582,560 @@ Ndarray Conv::backward(const Ndarray& dout) {
       }
     }
   }
+}
+
+// out[n] (fn,H'*W') = w_ (fn,fc*fh*fw) . col[n] (fc*fh*fw,H'*W') + b_, one
+// such product per group of fc/groups channels and fn/groups filters
+template <typename T>
+void Conv<T>::forward_im2col(const Ndarray<T>& x, Ndarray<T>* out) {
+  out->ensure_shape(output_shape(x.shape()));
+  Ndarray<T> xc = x.contiguous();
+  int64_t N = x.shape(0);
+  int64_t H = x.shape(2);
+  int64_t W = x.shape(3);
+  int64_t cg = fc_ / groups_;
+  int64_t fg = fn_ / groups_;
+  int64_t K = cg * fh_ * fw_;
+  int64_t P = out->shape(2) * out->shape(3);
+  PooledVector<T> col(K * P);
+  for (int64_t n = 0; n < N; n++) {
+    T* outn = out->ptr() + n * fn_ * P;
+    for (int64_t f = 0; f < fn_; f++) {
+      std::fill(outn + f * P, outn + (f + 1) * P, b_.at(f));
+    }
+    for (int64_t g = 0; g < groups_; g++) {
+      Im2Col(xc.ptr() + (n * fc_ + g * cg) * H * W, cg, H, W, fh_, fw_, s_,
+             p_, col.data());
+      Gemm(fg, P, K, T(1), w_.ptr() + g * fg * K, K, 1, col.data(), P, 1,
+           T(1), outn + g * fg * P, P, 1);
+    }
+  }
+  x_ = xc;
+}
+
+// dw_ (fn,K) = sum_n dout[n] (fn,P) . col[n]^T (P,K)
+// dcol[n] (K,P) = w_^T (K,fn) . dout[n] (fn,P), folded back by Col2Im
+// per group, in two parallel phases:
+// - dw_: tasks take a chunk of the batch and one group, and im2col each of
+//   their images once. Chunk 0 accumulates into dw_ and the others into
+//   partials of their own, which are then added up pairwise in a tree. The
+//   chunks depend on N alone, so dw_ rounds the same for any pool size.
+// - dx: tasks take one image and a tile of the channels of one group, whose
+//   rows of dcol and pixels of dx no other task touches. Tiles are only cut
+//   as fine as it takes to give every thread work.
+template <typename T>
+void Conv<T>::backward_im2col(const Ndarray<T>& dout, Ndarray<T>* dx,
+                              T beta) {
+  Ndarray<T> doutc = dout.contiguous();
+  int64_t N = x_.shape(0);
+  int64_t H = x_.shape(2);
+  int64_t W = x_.shape(3);
+  int64_t cg = fc_ / groups_;
+  int64_t fg = fn_ / groups_;
+  int64_t taps = fh_ * fw_;
+  int64_t K = cg * taps;
+  int64_t P = dout.shape(2) * dout.shape(3);
+  int64_t threads = NumThreads();
+  StartGradient(w_, beta, &dw_);
+
+  // bounds the memory of the partials
+  const int64_t kMaxChunks = 16;
+  int64_t chunks = std::min(N, kMaxChunks);
+  std::vector<PooledVector<T>> partials(chunks - 1);
+  for (auto& partial : partials) {
+    partial.resize(fn_ * K);
+  }
+  ParallelFor(0, chunks * groups_, [&](int64_t begin, int64_t end) {
+    PooledVector<T> col(K * P);
+    for (int64_t q = begin; q < end; q++) {
+      int64_t c = q / groups_;
+      int64_t g = q % groups_;
+      T* dw = c == 0 ? dw_.ptr() : partials[c - 1].data();
+      for (int64_t n = c * N / chunks; n < (c + 1) * N / chunks; n++) {
+        Im2Col(x_.ptr() + (n * fc_ + g * cg) * H * W, cg, H, W, fh_, fw_, s_,
+               p_, col.data());
+        // partials start from zero with the first image of their chunk
+        T acc = c == 0 || n > c * N / chunks ? 1 : 0;
+        Gemm(fg, K, P, T(1), doutc.ptr() + (n * fn_ + g * fg) * P, P, 1,
+             col.data(), 1, P, acc, dw + g * fg * K, K, 1);
+      }
+    }
+  });
+  // level by level, chunk i takes in chunk i + step for i a multiple of
+  // 2 step, split into blocks of kBlock elements
+  const int64_t kBlock = 1 << 14;
+  int64_t blocks = (fn_ * K + kBlock - 1) / kBlock;
+  for (int64_t step = 1; step < chunks; step *= 2) {
+    int64_t pairs = (chunks - step + 2 * step - 1) / (2 * step);
+    ParallelFor(0, pairs * blocks, [&](int64_t begin, int64_t end) {
+      for (int64_t q = begin; q < end; q++) {
+        int64_t i = q / blocks * 2 * step;
+        int64_t b = q % blocks * kBlock;
+        T* into = i == 0 ? dw_.ptr() : partials[i - 1].data();
+        const T* from = partials[i + step - 1].data();
+        int64_t n = std::min(kBlock, fn_ * K - b);
+        Binary(BinaryOp::kAdd, n, into + b, from + b, into + b);
+      }
+    });
+  }
+
+  if (!dx) {
+    return;
+  }
+  dx->ensure_shape(x_.shape());
+  dx->fill(0);
+  int64_t tiles = std::min(cg, (threads + N * groups_ - 1) / (N * groups_));
+  ParallelFor(0, N * groups_ * tiles, [&](int64_t begin, int64_t end) {
+    PooledVector<T> dcol((cg + tiles - 1) / tiles * taps * P);
+    for (int64_t q = begin; q < end; q++) {
+      int64_t n = q / (groups_ * tiles);
+      int64_t g = q / tiles % groups_;
+      int64_t c0 = q % tiles * cg / tiles;
+      int64_t c1 = (q % tiles + 1) * cg / tiles;
+      Gemm((c1 - c0) * taps, P, fg, T(1), w_.ptr() + g * fg * K + c0 * taps,
+           1, K, doutc.ptr() + (n * fn_ + g * fg) * P, P, 1, T(0),
+           dcol.data(), P, 1);
+      Col2Im(dcol.data(), c1 - c0, H, W, fh_, fw_, s_, p_,
+             dx->ptr() + (n * fc_ + g * cg + c0) * H * W);
+    }
+  });
+}
+
+// Filter f reads channel f / (fn/fc) only, so every (n,f) plane is a small
+// 2-D correlation; it runs as one row of taps at a time over the columns
+// that tap can reach, which leaves no bounds checks in the inner loop.
+template <typename T>
+void Conv<T>::forward_depthwise(const Ndarray<T>& x, Ndarray<T>* out) {
+  out->ensure_shape(output_shape(x.shape()));
+  Ndarray<T> xc = x.contiguous();
+  int64_t N = x.shape(0);
+  int64_t H = x.shape(2);
+  int64_t W = x.shape(3);
+  int64_t H2 = out->shape(2);
+  int64_t W2 = out->shape(3);
+  int64_t mult = fn_ / fc_;
+  const T* xp = xc.ptr();
+  const T* wp = w_.ptr();
+  T* o = out->ptr();
+  ParallelFor(0, N * fn_, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      int64_t f = q % fn_;
+      const T* xq = xp + (q / fn_ * fc_ + f / mult) * H * W;
+      const T* wf = wp + f * fh_ * fw_;
+      T* oq = o + q * H2 * W2;
+      std::fill(oq, oq + H2 * W2, b_.at(f));
+      for (int64_t oh = 0; oh < H2; oh++) {
+        T* orow = oq + oh * W2;
+        for (int64_t i = 0; i < fh_; i++) {
+          int64_t ih = oh * s_ - p_ + i;
+          if (ih < 0 || ih >= H) {
+            continue;
+          }
+          const T* xr = xq + ih * W;
+          for (int64_t j = 0; j < fw_; j++) {
+            int64_t b, e;
+            TapRange(j, W, W2, s_, p_, &b, &e);
+            if (b < e) {
+              AxpyStrided(e - b, wf[i * fw_ + j], xr + b * s_ - p_ + j, s_,
+                          orow + b);
+            }
+          }
+        }
+      }
+    }
+  });
+  x_ = xc;
+}
+
+// Tasks own an input channel: the gradients of its fn/fc filters and of its
+// planes of x are written by that task alone.
+template <typename T>
+void Conv<T>::backward_depthwise(const Ndarray<T>& dout, Ndarray<T>* dx,
+                                 T beta) {
+  Ndarray<T> doutc = dout.contiguous();
+  int64_t N = x_.shape(0);
+  int64_t H = x_.shape(2);
+  int64_t W = x_.shape(3);
+  int64_t H2 = dout.shape(2);
+  int64_t W2 = dout.shape(3);
+  int64_t mult = fn_ / fc_;
+  StartGradient(w_, beta, &dw_);
+  if (dx) {
+    dx->ensure_shape(x_.shape());
+    dx->fill(0);
+  }
+  const T* xp = x_.ptr();
+  const T* d = doutc.ptr();
+  const T* wp = w_.ptr();
+  T* dwp = dw_.ptr();
+  T* dxp = dx ? dx->ptr() : nullptr;
+  ParallelFor(0, fc_, [&](int64_t begin, int64_t end) {
+    for (int64_t c = begin; c < end; c++) {
+      for (int64_t n = 0; n < N; n++) {
+        const T* xq = xp + (n * fc_ + c) * H * W;
+        T* dxq = dxp ? dxp + (n * fc_ + c) * H * W : nullptr;
+        for (int64_t f = c * mult; f < (c + 1) * mult; f++) {
+          const T* dq = d + (n * fn_ + f) * H2 * W2;
+          const T* wf = wp + f * fh_ * fw_;
+          T* dwf = dwp + f * fh_ * fw_;
+          for (int64_t oh = 0; oh < H2; oh++) {
+            const T* drow = dq + oh * W2;
+            for (int64_t i = 0; i < fh_; i++) {
+              int64_t ih = oh * s_ - p_ + i;
+              if (ih < 0 || ih >= H) {
+                continue;
+              }
+              for (int64_t j = 0; j < fw_; j++) {
+                int64_t b, e;
+                TapRange(j, W, W2, s_, p_, &b, &e);
+                if (b >= e) {
+                  continue;
+                }
+                int64_t off = ih * W + b * s_ - p_ + j;
+                dwf[i * fw_ + j] += DotStrided(e - b, xq + off, s_, drow + b);
+                if (dxq) {
+                  // scattered onto every s-th pixel
+                  T wv = wf[i * fw_ + j];
+                  for (int64_t ow = 0; ow < e - b; ow++) {
+                    dxq[off + ow * s_] += wv * drow[b + ow];
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  });
+}
+
+template <typename T>
+void Conv<T>::update_winograd_filters() {
+  int64_t size = w_.size();
+  if (winograd_w_.ndim() != 0 &&
+      std::equal(w_.ptr(), w_.ptr() + size, winograd_w_.ptr())) {
+    return;
+  }
+  int64_t aa = winograd_->alpha() * winograd_->alpha();
+  winograd_w_ = w_.fork();
+  winograd_u_ = Ndarray<T>(aa, fn_, fc_);
+  winograd_uflip_ = Ndarray<T>(aa, fc_, fn_);
+  winograd_->TransformFilters(w_.ptr(), fn_, fc_, false, winograd_u_.ptr());
+  winograd_->TransformFilters(w_.ptr(), fn_, fc_, true,
+                              winograd_uflip_.ptr());
+}
+
+template <typename T>
+void Conv<T>::forward_winograd(const Ndarray<T>& x, Ndarray<T>* out) {
+  out->ensure_shape(output_shape(x.shape()));
+  Ndarray<T> xc = x.contiguous();
+  int64_t N = x.shape(0);
+  int64_t H = x.shape(2);
+  int64_t W = x.shape(3);
+  int64_t H2 = out->shape(2);
+  int64_t W2 = out->shape(3);
+  update_winograd_filters();
+  winograd_->Forward(winograd_u_.ptr(), xc.ptr(), N, fc_, H, W, fn_, p_,
+                     out->ptr());
+  for (int64_t n = 0; n < N; n++) {
+    for (int64_t f = 0; f < fn_; f++) {
+      T* o = out->ptr() + (n * fn_ + f) * H2 * W2;
+      T b = b_.at(f);
+      for (int64_t i = 0; i < H2 * W2; i++) {
+        o[i] += b;
+      }
+    }
+  }
+  x_ = xc;
+}
+
+// dx is the full correlation of dout with the flipped filters, i.e. a
+// forward pass over dout padded by fh-1-p.
+template <typename T>
+void Conv<T>::backward_winograd(const Ndarray<T>& dout, Ndarray<T>* dx,
+                                T beta) {
+  Ndarray<T> doutc = dout.contiguous();
+  int64_t N = x_.shape(0);
+  int64_t H = x_.shape(2);
+  int64_t W = x_.shape(3);
+  int64_t H2 = dout.shape(2);
+  int64_t W2 = dout.shape(3);
+  update_winograd_filters();
+  if (dx) {
+    dx->ensure_shape(x_.shape());
+    winograd_->Forward(winograd_uflip_.ptr(), doutc.ptr(), N, fn_, H2, W2,
+                       fc_, fh_ - 1 - p_, dx->ptr());
+  }
+  Ndarray<T> dw = GradientTarget(w_, beta, &dw_);
+  winograd_->BackwardFilter(x_.ptr(), doutc.ptr(), N, fc_, H, W, fn_, p_,
+                            dw.ptr());
+  AddGradient(dw, beta, &dw_);
+}
+
+template <typename T>
+void Conv<T>::update_fft(int64_t h, int64_t w) {
+  if (!fft_ || fft_->h() != h || fft_->w() != w) {
+    fft_ = std::make_shared<FftConv>(h, w, fh_, fw_, p_);
+    fft_w_ = Ndarray<T>();
+  }
+  int64_t size = w_.size();
+  if (fft_w_.ndim() != 0 &&
+      std::equal(w_.ptr(), w_.ptr() + size, fft_w_.ptr())) {
+    return;
+  }
+  fft_w_ = w_.fork();
+  fft_ws_.resize(fn_ * fc_ * fft_->bins());
+  fft_->Transform(w_.ptr(), fn_ * fc_, fh_, fw_, fft_ws_.data());
+}
+
+template <typename T>
+void Conv<T>::forward_fft(const Ndarray<T>& x, Ndarray<T>* out) {
+  out->ensure_shape(output_shape(x.shape()));
+  Ndarray<T> xc = x.contiguous();
+  int64_t N = x.shape(0);
+  int64_t H = x.shape(2);
+  int64_t W = x.shape(3);
+  int64_t H2 = out->shape(2);
+  int64_t W2 = out->shape(3);
+  update_fft(H, W);
+  PooledVector<std::complex<double>> xs(N * fc_ * fft_->bins());
+  fft_->Transform(xc.ptr(), N * fc_, H, W, xs.data());
+  fft_->Forward(fft_ws_.data(), xs.data(), N, fc_, fn_, out->ptr());
+  for (int64_t n = 0; n < N; n++) {
+    for (int64_t f = 0; f < fn_; f++) {
+      T* o = out->ptr() + (n * fn_ + f) * H2 * W2;
+      T b = b_.at(f);
+      for (int64_t i = 0; i < H2 * W2; i++) {
+        o[i] += b;
+      }
+    }
+  }
+  x_ = xc;
+}
+
+// The input spectra are recomputed rather than kept from forward, so the
+// layer holds no more state between the passes than the other algorithms.
+template <typename T>
+void Conv<T>::backward_fft(const Ndarray<T>& dout, Ndarray<T>* dx, T beta) {
+  Ndarray<T> doutc = dout.contiguous();
+  int64_t N = x_.shape(0);
+  int64_t H = x_.shape(2);
+  int64_t W = x_.shape(3);
+  update_fft(H, W);
+  int64_t bins = fft_->bins();
+  PooledVector<std::complex<double>> xs(N * fc_ * bins);
+  PooledVector<std::complex<double>> ds(N * fn_ * bins);
+  fft_->Transform(x_.ptr(), N * fc_, H, W, xs.data());
+  fft_->Transform(doutc.ptr(), N * fn_, dout.shape(2), dout.shape(3),
+                  ds.data());
+  if (dx) {
+    dx->ensure_shape(x_.shape());
+    fft_->BackwardData(fft_ws_.data(), ds.data(), N, fc_, fn_, dx->ptr());
+  }
+  Ndarray<T> dw = GradientTarget(w_, beta, &dw_);
+  fft_->BackwardFilter(xs.data(), ds.data(), N, fc_, fn_, dw.ptr());
+  AddGradient(dw, beta, &dw_);
+}
+
+template <typename T>
+BatchNorm<T>::BatchNorm(int64_t c, double momentum, double eps)
+    : gamma_(c),
+      beta_(c),
+      running_mean_(c),
+      running_var_(c),
+      c_(c),
+      momentum_(momentum),
+      eps_(eps) {
+  gamma_.fill(1);
+  running_var_.fill(1);
+}
+
+template <typename T>
+Ndarray<T> BatchNorm<T>::forward(const Ndarray<T>& x) {
+  Ndarray<T> out;
+  forward_into(x, &out);
+  return out;
+}
+
+template <typename T>
+Ndarray<T> BatchNorm<T>::backward(const Ndarray<T>& dout) {
+  dgamma_ = Ndarray<T>();
+  dbeta_ = Ndarray<T>();
+  Ndarray<T> dx;
+  backward_into(dout, &dx);
   return dx;
 }
 
+template <typename T>
+void BatchNorm<T>::inference_transform(Ndarray<T>* scale,
+                                       Ndarray<T>* shift) const {
+  scale->ensure_shape({c_});
+  shift->ensure_shape({c_});
+  for (int64_t ch = 0; ch < c_; ch++) {
+    double k = gamma_.at(ch) / std::sqrt(running_var_.at(ch) + eps_);
+    scale->at(ch) = k;
+    shift->at(ch) = beta_.at(ch) - running_mean_.at(ch) * k;
+  }
+}
+
+// Channels are processed in parallel, each as N runs of inner elements.
+template <typename T>
+void BatchNorm<T>::forward_into(const Ndarray<T>& x, Ndarray<T>* out) {
+  assert(x.ndim() >= 2);
+  assert(x.shape(1) == c_);
+  Ndarray<T> xc = x.contiguous();
+  int64_t N = x.shape(0);
+  int64_t inner = x.size() / (N * c_);
+  out->ensure_shape(x.shape());
+  const T* xp = xc.ptr();
+  T* o = out->ptr();
+  if (!training_) {
+    Ndarray<T> scale, shift;
+    inference_transform(&scale, &shift);
+    ParallelFor(0, N * c_, [&](int64_t begin, int64_t end) {
+      for (int64_t q = begin; q < end; q++) {
+        T k = scale.at(q % c_);
+        T b = shift.at(q % c_);
+        for (int64_t i = q * inner; i < (q + 1) * inner; i++) {
+          o[i] = xp[i] * k + b;
+        }
+      }
+    });
+    return;
+  }
+  x_shape_ = x.shape();
+  xhat_.resize(x.size());
+  inv_std_.resize(c_);
+  T* xh = xhat_.data();
+  T* rm = running_mean_.ptr();
+  T* rv = running_var_.ptr();
+  double m = N * inner;
+  ParallelFor(0, c_, [&](int64_t begin, int64_t end) {
+    for (int64_t ch = begin; ch < end; ch++) {
+      // sum and sum of squares in one pass, in double against cancellation
+      double sum = 0;
+      double sq = 0;
+      for (int64_t n = 0; n < N; n++) {
+        const T* p = xp + (n * c_ + ch) * inner;
+        for (int64_t i = 0; i < inner; i++) {
+          sum += p[i];
+          sq += double(p[i]) * p[i];
+        }
+      }
+      double mean = sum / m;
+      double var = std::max(sq / m - mean * mean, 0.0);
+      T inv = 1 / std::sqrt(var + eps_);
+      T mu = mean;
+      inv_std_[ch] = inv;
+      T g = gamma_.at(ch);
+      T b = beta_.at(ch);
+      for (int64_t n = 0; n < N; n++) {
+        int64_t off = (n * c_ + ch) * inner;
+        for (int64_t i = off; i < off + inner; i++) {
+          xh[i] = (xp[i] - mu) * inv;
+          o[i] = xh[i] * g + b;
+        }
+      }
+      rm[ch] = momentum_ * rm[ch] + (1 - momentum_) * mean;
+      rv[ch] = momentum_ * rv[ch] +
+               (1 - momentum_) * var * m / std::max(m - 1, 1.0);
+    }
+  });
+}
+
+// dx = gamma / (m std) * (m dout - sum(dout) - xhat sum(dout xhat)) per
+// channel, m being the elements of a channel; both sums are also the
+// parameter gradients.
+template <typename T>
+void BatchNorm<T>::backward_into(const Ndarray<T>& dout, Ndarray<T>* dx,
+                                 T beta) {
+  assert(dout.shape() == x_shape_);
+  Ndarray<T> doutc = dout.contiguous();
+  int64_t N = dout.shape(0);
+  int64_t inner = dout.size() / (N * c_);
+  StartGradient(gamma_, beta, &dgamma_);
+  StartGradient(beta_, beta, &dbeta_);
+  if (dx) {
+    dx->ensure_shape(dout.shape());
+  }
+  const T* d = doutc.ptr();
+  const T* xh = xhat_.data();
+  T* o = dx ? dx->ptr() : nullptr;
+  T m = N * inner;
+  ParallelFor(0, c_, [&](int64_t begin, int64_t end) {
+    for (int64_t ch = begin; ch < end; ch++) {
+      // in double, like the statistics in forward
+      double sum_d = 0;
+      double dot_d = 0;
+      for (int64_t n = 0; n < N; n++) {
+        int64_t off = (n * c_ + ch) * inner;
+        for (int64_t i = off; i < off + inner; i++) {
+          sum_d += d[i];
+          dot_d += double(d[i]) * xh[i];
+        }
+      }
+      T sum = sum_d;
+      T dot = dot_d;
+      dbeta_.at(ch) += sum;
+      dgamma_.at(ch) += dot;
+      if (!o) {
+        continue;
+      }
+      T k = gamma_.at(ch) * inv_std_[ch] / m;
+      for (int64_t n = 0; n < N; n++) {
+        int64_t off = (n * c_ + ch) * inner;
+        for (int64_t i = off; i < off + inner; i++) {
+          o[i] = k * (m * d[i] - sum - xh[i] * dot);
+        }
+      }
+    }
+  });
+}
+
+template <typename T>
+void FoldBatchNorm(const BatchNorm<T>& bn, Conv<T>* conv) {
+  Ndarray<T> scale, shift;
+  bn.inference_transform(&scale, &shift);
+  int64_t fn = conv->w_.shape(0);
+  assert(scale.size() == fn);
+  assert(conv->w_.is_contiguous());
+  int64_t k = conv->w_.size() / fn;
+  T* w = conv->w_.ptr();
+  for (int64_t f = 0; f < fn; f++) {
+    for (int64_t i = 0; i < k; i++) {
+      w[f * k + i] *= scale.at(f);
+    }
+    conv->b_.at(f) = conv->b_.at(f) * scale.at(f) + shift.at(f);
+  }
+}
+
+template <typename T>
+void FoldBatchNorm(const BatchNorm<T>& bn, Affine<T>* affine) {
+  Ndarray<T> scale, shift;
+  bn.inference_transform(&scale, &shift);
+  assert(affine->w_.ndim() == 2);
+  assert(scale.size() == affine->w_.shape(1));
+  affine->w_ *= scale;  // (in,out) rows times the per-output factors
+  Assign(Lazy(affine->b_) * Lazy(scale) + Lazy(shift), &affine->b_);
+}
+
+template class Affine<float>;
+template class Affine<double>;
+template class Relu<float>;
+template class Relu<double>;
+template class MaxPool<float>;
+template class MaxPool<double>;
+template class Conv<float>;
+template class Conv<double>;
+template class BatchNorm<float>;
+template class BatchNorm<double>;
+template void FoldBatchNorm<float>(const BatchNorm<float>& bn,
+                                   Conv<float>* conv);
+template void FoldBatchNorm<double>(const BatchNorm<double>& bn,
+                                    Conv<double>* conv);
+template void FoldBatchNorm<float>(const BatchNorm<float>& bn,
+                                   Affine<float>* affine);
+template void FoldBatchNorm<double>(const BatchNorm<double>& bn,
+                                    Affine<double>* affine);
+
 }  // namespace litecnn
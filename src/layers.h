@@ -1,86 +1,249 @@
 #pragma once
 
+#include <complex>
+#include <cstdint>
 #include <memory>
+#include <vector>
 
+#include "fft.h"
 #include "ndarray.h"
+#include "pool.h"
+#include "winograd.h"
 
 namespace litecnn {
 
+// Layers store their parameters and activations as Ndarray<T>, float by
+// default. Instantiated for float and double.
+//
+// forward and backward allocate their results and fresh parameter
+// gradients. forward_into and backward_into write into arrays the caller
+// keeps instead, reusing their buffers when the shape already fits (see
+// Ndarray::ensure_shape), so a training loop can cycle one fixed set. Conv
+// and Affine hold views of their input until backward, so those buffers
+// must not be overwritten in between. Layers with parameters set each
+// gradient to grad + beta * (its previous value); a null dx skips the input
+// gradient.
+
+template <typename T = float>
 class Affine {
  public:
   Affine(int64_t m, int64_t n, double scale);
 
-  Ndarray forward(const Ndarray& x);
-  Ndarray backward(const Ndarray& dout);
+  Ndarray<T> forward(const Ndarray<T>& x);
+  Ndarray<T> backward(const Ndarray<T>& dout);
 
-  Ndarray w_;
-  Ndarray dw_;
-  Ndarray nw_;
+  void forward_into(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_into(const Ndarray<T>& dout, Ndarray<T>* dx, T beta = 0);
 
-  Ndarray b_;
-  Ndarray db_;
-  Ndarray nb_;
+  // (N,n) for an (N,m) input
+  std::vector<int64_t> output_shape(const std::vector<int64_t>& x) const;
+
+  Ndarray<T> w_;
+  Ndarray<T> dw_;
+
+  Ndarray<T> b_;
+  Ndarray<T> db_;
 
  private:
-  Ndarray x_;
+  Ndarray<T> x_;
 };
 
+// Remembers one bit per element, whether the input was positive, and nothing
+// else of the forward pass. forward_into(x, &x) and backward_into(dout,
+// &dout) run in place.
+template <typename T = float>
 class Relu {
  public:
-  Ndarray forward(const Ndarray& x);
-  Ndarray backward(const Ndarray& dout);
+  Ndarray<T> forward(const Ndarray<T>& x);
+  Ndarray<T> backward(const Ndarray<T>& dout);
+
+  void forward_into(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_into(const Ndarray<T>& dout, Ndarray<T>* dx);
 
  private:
-  Ndarray x_;
+  std::vector<int64_t> x_shape_;
+  PooledVector<uint64_t> mask_;  // bit i % 64 of word i / 64: x[i] > 0
 };
 
+// Max over h x w windows every s pixels of the last two dimensions, windows
+// cut off at the border. forward records where each maximum came from as a
+// byte offset into its window (the first one on ties), so backward is a
+// single scatter and the input is not kept.
+template <typename T = float>
 class MaxPool {
  public:
   MaxPool(int64_t h, int64_t w, int64_t s);
-  Ndarray forward(const Ndarray& x);
-  Ndarray backward(const Ndarray& dout);
+  Ndarray<T> forward(const Ndarray<T>& x);
+  Ndarray<T> backward(const Ndarray<T>& dout);
+
+  void forward_into(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_into(const Ndarray<T>& dout, Ndarray<T>* dx);
+
+  // Inference pass over the channel-blocked layout of blocked.h, x and out
+  // being (N,C/c,H,W,c). Keeps no state for backward.
+  void forward_blocked(const Ndarray<T>& x, Ndarray<T>* out);
+
+  // shape of forward's result for an input of shape x
+  std::vector<int64_t> output_shape(const std::vector<int64_t>& x) const;
+
+  int64_t height() const { return h_; }
+  int64_t width() const { return w_; }
+  int64_t stride() const { return s_; }
 
  private:
-  Ndarray outt_;
-  Ndarray xt_;
+  std::vector<int64_t> x_shape_;
+  PooledVector<uint8_t> argmax_;  // (in-window offset) per output element
   const int64_t h_;
   const int64_t w_;
   const int64_t s_;  // stride
 };
 
+template <typename T = float>
 class Conv {
  public:
+  enum class Algo {
+    kDirect,  // scalar loop nest, kept as the reference
+    kIm2col,  // im2col lowering, every pass is a Gemm
+    // Winograd F(2x2,r x r) and F(4x4,r x r) for square stride-1 filters,
+    // falling back to kIm2col for other shapes
+    kWinograd2,
+    kWinograd4,
+    // products of spectra for stride-1 filters with p < fh,fw, meant for
+    // large filters; falls back to kIm2col otherwise
+    kFft,
+  };
+
+  // With groups > 1 the channels and filters are split into that many
+  // groups and each filter sees the fc/groups channels of its own group;
+  // groups == fc is a depthwise convolution with fn/fc filters per channel.
+  // Grouped layers run the im2col lowering per group and depthwise ones
+  // a dedicated kernel, whatever algo is, except for kDirect.
   Conv(int64_t fh, int64_t fw, int64_t fc, int64_t fn, int64_t s, int64_t p,
-       double scale);
-  Ndarray forward(const Ndarray& x);      // N,fc,H,W
-  Ndarray backward(const Ndarray& dout);  // N,fn,H',W'
+       double scale, Algo algo = Algo::kIm2col, int64_t groups = 1);
+  Ndarray<T> forward(const Ndarray<T>& x);      // N,fc,H,W
+  Ndarray<T> backward(const Ndarray<T>& dout);  // N,fn,H',W'
+
+  void forward_into(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_into(const Ndarray<T>& dout, Ndarray<T>* dx, T beta = 0);
+
+  // Inference pass over the channel-blocked layout of blocked.h, whatever
+  // algo is: x is (N,fc/ci,H,W,ci) with ci = ChannelBlock<T>(), or 1 for
+  // plain NCHW, and out becomes (N,fn/c,H',W',c) with c = ChannelBlock<T>().
+  // Keeps no state for backward.
+  void forward_blocked(const Ndarray<T>& x, Ndarray<T>* out);
+
+  // forward_blocked followed by a relu and pool.forward_blocked, fused so
+  // that the conv output is never materialized: out is the pooled
+  // (N,fn/c,H'',W'',c). Keeps no state for backward.
+  void forward_relu_pool_blocked(const Ndarray<T>& x, const MaxPool<T>& pool,
+                                 Ndarray<T>* out);
 
-  // (fn,fc,fh,fw)
-  Ndarray w_;
-  Ndarray dw_;
-  Ndarray nw_;
+  // (N,fn,H',W') for an (N,fc,H,W) input
+  std::vector<int64_t> output_shape(const std::vector<int64_t>& x) const;
+
+  // (fn,fc/groups,fh,fw)
+  Ndarray<T> w_;
+  Ndarray<T> dw_;
 
   // (fc,)
-  Ndarray b_;
-  Ndarray db_;
-  Ndarray nb_;
+  Ndarray<T> b_;
+  Ndarray<T> db_;
 
  private:
+  void forward_direct(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_direct(const Ndarray<T>& dout, Ndarray<T>* dx, T beta);
+  void forward_im2col(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_im2col(const Ndarray<T>& dout, Ndarray<T>* dx, T beta);
+  void forward_depthwise(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_depthwise(const Ndarray<T>& dout, Ndarray<T>* dx, T beta);
+  void forward_winograd(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_winograd(const Ndarray<T>& dout, Ndarray<T>* dx, T beta);
+  // re-transforms the filters if w_ changed since the last call
+  void update_winograd_filters();
+  bool fft_capable() const { return s_ == 1 && p_ < fh_ && p_ < fw_; }
+  void forward_fft(const Ndarray<T>& x, Ndarray<T>* out);
+  void backward_fft(const Ndarray<T>& dout, Ndarray<T>* dx, T beta);
+  // rebuilds fft_ for (h,w) images and the filter spectra if needed
+  void update_fft(int64_t h, int64_t w);
+  // repacks the filters for inputs blocked by ci if w_ changed since
+  void update_blocked_filters(int64_t ci);
+
   const int64_t fh_;  // filter height
   const int64_t fw_;  // filter width
   const int64_t fc_;  // filter depth
   const int64_t fn_;  // number of filters
   const int64_t s_;   // stride
   const int64_t p_;   // stride
-  Ndarray x_;
+  const Algo algo_;
+  const int64_t groups_;
+  Ndarray<T> x_;
+
+  // null unless algo_ is a Winograd one and the filter shape supports it
+  std::shared_ptr<const Winograd<T>> winograd_;
+  Ndarray<T> winograd_w_;      // copy of w_ behind the transforms below
+  Ndarray<T> winograd_u_;      // forward filters (alpha*alpha,fn,fc)
+  Ndarray<T> winograd_uflip_;  // input gradient filters (alpha*alpha,fc,fn)
+
+  Ndarray<T> blocked_w_;  // copy of w_ behind blocked_u_
+  Ndarray<T> blocked_u_;  // filters packed by PackBlockedFilters
+
+  // built on the first pass of an FFT-capable layer, for the last image size
+  std::shared_ptr<const FftConv> fft_;
+  Ndarray<T> fft_w_;                          // copy of w_ behind fft_ws_
+  std::vector<std::complex<double>> fft_ws_;  // filter spectra (fn,fc,bins)
 };
 
+// Per-channel normalization over axis 1 of (N,C,...) inputs, followed by a
+// learned scale gamma_ and shift beta_. In training mode (the default)
+// forward normalizes by the mean and variance of the batch, both taken in
+// one pass over each channel, and moves running_mean_ and running_var_
+// towards them; otherwise it applies the running statistics, which
+// FoldBatchNorm can merge into the layer before it.
+template <typename T = float>
 class BatchNorm {
  public:
-  Ndarray forward(const Ndarray& x);
-  Ndarray backward(const Ndarray& dout);
+  explicit BatchNorm(int64_t c, double momentum = 0.9, double eps = 1e-5);
+  Ndarray<T> forward(const Ndarray<T>& x);
+  Ndarray<T> backward(const Ndarray<T>& dout);
+
+  void forward_into(const Ndarray<T>& x, Ndarray<T>* out);
+  // only after a forward pass in training mode
+  void backward_into(const Ndarray<T>& dout, Ndarray<T>* dx, T beta = 0);
+
+  void set_training(bool training) { training_ = training; }
+  bool training() const { return training_; }
+
+  // y = x * scale + shift per channel, the transform of inference mode
+  void inference_transform(Ndarray<T>* scale, Ndarray<T>* shift) const;
+
+  // (C,)
+  Ndarray<T> gamma_;
+  Ndarray<T> dgamma_;
+
+  Ndarray<T> beta_;
+  Ndarray<T> dbeta_;
+
+  // (C,), updated in place; the variance is the unbiased estimate
+  Ndarray<T> running_mean_;
+  Ndarray<T> running_var_;
 
  private:
+  const int64_t c_;
+  const double momentum_;  // weight of the old running statistics
+  const double eps_;
+  bool training_ = true;
+  std::vector<int64_t> x_shape_;
+  PooledVector<T> xhat_;     // normalized input of the last training pass
+  PooledVector<T> inv_std_;  // 1 / sqrt(var + eps) per channel
 };
 
+// Folds bn in inference mode into the layer feeding it, whose output
+// channels are bn's: afterwards the layer alone computes bn(layer(x)) and bn
+// can be dropped. w_ and b_ are updated in place, so fork them first if
+// other copies of the layer share them.
+template <typename T>
+void FoldBatchNorm(const BatchNorm<T>& bn, Conv<T>* conv);
+template <typename T>
+void FoldBatchNorm(const BatchNorm<T>& bn, Affine<T>* affine);
+
 }  // namespace litecnn
@@ -1,42 +1,76 @@
 #include "loss.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <vector>
 
 #include "ndarray.h"
+#include "parallel.h"
+#include "pool.h"
 
 namespace litecnn {
 
-double SoftmaxLoss(const Ndarray& x, const int64_t* y, Ndarray* dx) {
+namespace {
+
+// scores of row i to probabilities minus the one-hot label, times scale,
+// in dx; returns the row's cross-entropy
+template <typename T>
+double SoftmaxRow(const Ndarray<T>& x, int64_t i, int64_t label, T scale,
+                  Ndarray<T>* dx) {
+  int64_t c = x.shape(1);
+  T max = x.at(i, 0);
+  for (int64_t j = 1; j < c; j++) {
+    T v = x.at(i, j);
+    if (max < v) {
+      max = v;
+    }
+  }
+  T sum = 0;
+  for (int64_t j = 0; j < c; j++) {
+    sum += dx->at(i, j) = std::exp(x.at(i, j) - max);
+  }
+  double loss = 0;
+  for (int64_t j = 0; j < c; j++) {
+    T p = dx->at(i, j) / sum;
+    if (j == label) {
+      loss = -std::log(p);
+      p -= 1;
+    }
+    dx->at(i, j) = p * scale;
+  }
+  return loss;
+}
+
+}  // namespace
+
+// Rows run in parallel in chunks of a few thousand scores, so small batches
+// stay on the calling thread. The row losses are summed in order.
+template <typename T>
+double SoftmaxLoss(const Ndarray<T>& x, const int64_t* y, Ndarray<T>* dx) {
   assert(dx != nullptr);
   assert(x.ndim() == 2);
   int64_t n = x.shape(0);
   int64_t c = x.shape(1);
+  PooledVector<double> losses(n);
+  ParallelFor(
+      0, n,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+          losses[i] = SoftmaxRow(x, i, y[i], T(1.0 / n), dx);
+        }
+      },
+      std::max<int64_t>(1, 4096 / c));
   double loss = 0;
   for (int64_t i = 0; i < n; i++) {
-    double max = x.at(i, 0);
-    for (int64_t j = 1; j < c; j++) {
-      double v = x.at(i, j);
-      if (max < v) {
-        max = v;
-      }
-    }
-    double sum = 0;
-    for (int64_t j = 0; j < c; j++) {
-      sum += dx->at(i, j) = std::exp(x.at(i, j) - max);
-    }
-    for (int64_t j = 0; j < c; j++) {
-      dx->at(i, j) /= sum;
-      if (j == y[i]) {
-        loss -= std::log(dx->at(i, j));
-        dx->at(i, j) -= 1;
-      }
-    }
+    loss += losses[i];
   }
-  *dx = *dx * (1.0 / n);
-  loss /= n;
-  return loss;
+  return loss / n;
 }
 
+template double SoftmaxLoss<float>(const Ndarray<float>& x, const int64_t* y,
+                                   Ndarray<float>* dx);
+template double SoftmaxLoss<double>(const Ndarray<double>& x, const int64_t* y,
+                                    Ndarray<double>* dx);
+
 }  // namespace litecnn
@@ -6,6 +6,9 @@
 
 namespace litecnn {
 
-double SoftmaxLoss(const Ndarray& x, const int64_t* y, Ndarray* dx);
+// Mean softmax cross-entropy of the scores x (n,c) against labels y, dx gets
+// its gradient. Instantiated for float and double.
+template <typename T>
+double SoftmaxLoss(const Ndarray<T>& x, const int64_t* y, Ndarray<T>* dx);
 
 }
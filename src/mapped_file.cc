@@ -0,0 +1,59 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace litecnn {
+
+namespace {
+
+// closes fd, if open, and throws with what failed and errno's message
+[[noreturn]] void Fail(const std::string& what, const std::string& path,
+                       int fd) {
+  int err = errno;
+  if (fd >= 0) {
+    close(fd);
+  }
+  throw std::runtime_error(what + " " + path + ": " + std::strerror(err));
+}
+
+}  // namespace
+
+MappedFile::MappedFile(const std::string& path, MapMode mode) : mode_(mode) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    Fail("cannot open", path, fd);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    Fail("cannot stat", path, fd);
+  }
+  if (st.st_size == 0) {
+    errno = EINVAL;
+    Fail("cannot map empty", path, fd);
+  }
+  size_ = st.st_size;
+  // MAP_PRIVATE on a read-only descriptor still allows writable pages, the
+  // copies just never reach the file.
+  int prot = mode == MapMode::kReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+  int flags = mode == MapMode::kReadOnly ? MAP_SHARED : MAP_PRIVATE;
+  void* p = mmap(nullptr, size_, prot, flags, fd, 0);
+  if (p == MAP_FAILED) {
+    Fail("cannot map", path, fd);
+  }
+  // the mapping holds its own reference to the file
+  close(fd);
+  data_ = static_cast<char*>(p);
+}
+
+MappedFile::~MappedFile() { munmap(data_, size_); }
+
+}  // namespace litecnn
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace litecnn {
+
+enum class MapMode {
+  // pages are shared with the page cache and with every other process that
+  // maps the file; writing to them faults
+  kReadOnly,
+  // pages are shared until first written, then copied for this mapping
+  // alone; the file itself never changes
+  kCopyOnWrite,
+};
+
+// A whole file mapped into memory, unmapped when the object goes away.
+class MappedFile {
+ public:
+  // Throws std::runtime_error naming path and the reason if the file
+  // cannot be opened or mapped, or is empty.
+  MappedFile(const std::string& path, MapMode mode);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // page aligned
+  char* data() const { return data_; }
+  size_t size() const { return size_; }
+  MapMode mode() const { return mode_; }
+
+ private:
+  char* data_ = nullptr;
+  size_t size_ = 0;
+  MapMode mode_;
+};
+
+}  // namespace litecnn
@@ -1,74 +1,82 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <fstream>
 #include <iostream>
+#include <numeric>
 #include <random>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "cnn.h"
+#include "parallel.h"
 #include "mnist/mnist_reader.hpp"
 
 const int kDefaultThreads = 4;
 
-void ReadData(const std::string& path, litecnn::Ndarray* x,
-              std::vector<int64_t>* y, litecnn::Ndarray* x_test,
-              std::vector<int64_t>* y_test) {
+// Parses the idx files under path, shuffles them and writes the images and
+// labels as tensor files with the given prefix.
+void ConvertData(const std::string& path, const std::string& prefix) {
   auto dataset =
-      mnist::read_dataset<std::vector, std::vector, uint8_t, uint8_t>("mnist");
+      mnist::read_dataset<std::vector, std::vector, uint8_t, uint8_t>(path);
   assert(dataset.training_images.size() == dataset.training_labels.size());
   assert(dataset.test_images.size() == dataset.test_labels.size());
-#define LOAD(src_x, src_y, target_x, target_y)                              \
+#define LOAD(src_x, src_y, name)                                            \
   do {                                                                      \
     std::vector<int64_t> shuf(src_x.size());                                \
     std::iota(shuf.begin(), shuf.end(), 0);                                 \
     std::shuffle(shuf.begin(), shuf.end(), std::default_random_engine(42)); \
-    *target_x = litecnn::Ndarray(src_x.size(), 1, 28, 28);                  \
-    target_y->resize(src_x.size());                                         \
+    litecnn::Ndarray<> target_x(src_x.size(), 1, 28, 28);                   \
+    litecnn::Ndarray<> target_y(src_x.size());                              \
     for (int i = 0; i < src_x.size(); i++) {                                \
       assert(src_x[i].size() == 28 * 28);                                   \
       for (int j = 0; j < src_x[i].size(); j++) {                           \
-        target_x->at(shuf[i], 0, j / 28, j % 28) = src_x[i][j];             \
+        target_x.at(shuf[i], 0, j / 28, j % 28) = src_x[i][j];              \
       }                                                                     \
-      (*target_y)[shuf[i]] = src_y[i];                                      \
+      target_y.at(shuf[i]) = src_y[i];                                      \
     }                                                                       \
-    std::cout << "loaded " << src_x.size() << " from " #src_x << std::endl; \
+    target_x.save(prefix + name "-x");                                      \
+    target_y.save(prefix + name "-y");                                      \
+    std::cout << "converted " << src_x.size() << " from " #src_x            \
+              << std::endl;                                                 \
   } while (0)
-  LOAD(dataset.training_images, dataset.training_labels, x, y);
-  LOAD(dataset.test_images, dataset.test_labels, x_test, y_test);
+  LOAD(dataset.training_images, dataset.training_labels, "train");
+  LOAD(dataset.test_images, dataset.test_labels, "test");
 #undef LOAD
 }
 
-int main(int argc, char* argv[]) {
-  int n_threads = kDefaultThreads;
-  if (argc == 2) {
-    n_threads = std::atoi(argv[1]);
+// Maps the images straight from the tensor files, converting the idx files
+// on the first run only.
+void ReadData(const std::string& path, litecnn::Ndarray<>* x,
+              std::vector<int64_t>* y, litecnn::Ndarray<>* x_test,
+              std::vector<int64_t>* y_test) {
+  std::string prefix = path + "/litecnn-";
+  if (!std::ifstream(prefix + "test-y")) {
+    ConvertData(path, prefix);
   }
-  std::cout << "training using " << n_threads << " threads" << std::endl;
-
-  litecnn::Ndarray x;
-  litecnn::Ndarray x_test;
-  std::vector<int64_t> y;
-  std::vector<int64_t> y_test;
-  ReadData("mnist", &x, &y, &x_test, &y_test);
-
-  litecnn::SimpleConvNet::Config config;
-  config.input_height = 28;
-  config.input_width = 28;
-  config.input_depth = 1;
-  config.n_filters = 10;
-  config.filter_size = 5;
-  config.hidden_dim = 50;
-  config.weight_scale = 1e-2;
-  config.n_classes = 10;
-  config.reg = 0.5;
-  litecnn::SimpleConvNet cnn(config);
-  auto start = std::chrono::steady_clock::now();
+  auto mode = litecnn::MapMode::kReadOnly;
+  *x = litecnn::Ndarray<>(prefix + "train-x", mode);
+  *x_test = litecnn::Ndarray<>(prefix + "test-x", mode);
+  litecnn::Ndarray<> labels(prefix + "train-y", mode);
+  y->assign(labels.ptr(), labels.ptr() + labels.size());
+  litecnn::Ndarray<> test_labels(prefix + "test-y", mode);
+  y_test->assign(test_labels.ptr(), test_labels.ptr() + test_labels.size());
+  std::cout << "mapped " << x->shape(0) << " training and " << x_test->shape(0)
+            << " test images" << std::endl;
+}
 
+// Each thread trains on its own shard through a parameter server, pushing
+// its gradients whenever one of its batches is done.
+void TrainAsync(const litecnn::Ndarray<>& x, const std::vector<int64_t>& y,
+                const litecnn::Ndarray<>& x_test,
+                const std::vector<int64_t>& y_test, int n_threads,
+                litecnn::SimpleConvNet<>* model) {
+  litecnn::SimpleConvNet<>& cnn = *model;
   std::cout << "warming up..." << std::endl;
   auto warm_up = [&cnn, &x, &y, n_threads](int i) {
     int train_i = x.shape(0) / n_threads * i;
-    int train_n = std::min(100LL, x.shape(0) - train_i);
+    int train_n = std::min<int64_t>(100, x.shape(0) - train_i);
     cnn.train(x.slice(train_i, train_n), &y[train_i],  // train data
               x, &y[0],  // eval data, doesn't matter here
               1,         // epochs
@@ -84,7 +92,9 @@ int main(int argc, char* argv[]) {
     warm_up(i);
   }
 
-  auto thread_func = [&cnn, &x, &y, &x_test, &y_test, n_threads](int i) {
+  litecnn::ParamServer<> server(cnn.params(), cnn.optimizer().config());
+  auto thread_func = [&cnn, &server, &x, &y, &x_test, &y_test,
+                      n_threads](int i) {
     int train_i = x.shape(0) / n_threads * i;
     int train_n = std::min(x.shape(0) / n_threads, x.shape(0) - train_i);
     // int test_i = x_test.shape(0) / n_threads * i;
@@ -94,13 +104,13 @@ int main(int argc, char* argv[]) {
     std::cout << "thread " << i << "(" << std::this_thread::get_id()
               << ") starting... from " << train_i << " count " << train_n
               << std::endl;
-    cnn.train(x.slice(train_i, train_n), &y[train_i],         // train data
-              x_test.slice(test_i, test_n), &y_test[test_i],  // eval data
-              2,                                              // epochs
-              100,                                            // batch
-              0.005,                                          // lr
-              10,                                             // log_every
-              100);                                           // eval_every
+    cnn.train_async(&server, x.slice(train_i, train_n), &y[train_i],
+                    x_test.slice(test_i, test_n), &y_test[test_i],
+                    2,      // epochs
+                    100,    // batch
+                    0.005,  // lr
+                    10,     // log_every
+                    100);   // eval_every
   };
   std::vector<std::thread> threads;
   for (int i = 0; i < n_threads; ++i) {
@@ -109,6 +119,57 @@ int main(int argc, char* argv[]) {
   for (auto& t : threads) {
     t.join();
   }
+  auto stats = server.stats();
+  std::cout << "pushes:" << stats.pushes << " stale shard updates:"
+            << stats.stale_updates << "/" << stats.updates
+            << " mean staleness:" << double(stats.staleness) / stats.updates
+            << " max:" << stats.max_staleness
+            << " contended locks:" << stats.contended << std::endl;
+}
+
+// mnist_main [threads] [async]: synchronous data-parallel training over the
+// worker pool unless async is given.
+int main(int argc, char* argv[]) {
+  int n_threads = kDefaultThreads;
+  if (argc >= 2) {
+    n_threads = std::atoi(argv[1]);
+  }
+  bool async = argc >= 3 && std::string(argv[2]) == "async";
+  std::cout << "training using " << n_threads << " threads"
+            << (async ? ", async" : "") << std::endl;
+
+  litecnn::Ndarray<> x;
+  litecnn::Ndarray<> x_test;
+  std::vector<int64_t> y;
+  std::vector<int64_t> y_test;
+  ReadData("mnist", &x, &y, &x_test, &y_test);
+
+  litecnn::SimpleConvNet<>::Config config;
+  config.input_height = 28;
+  config.input_width = 28;
+  config.input_depth = 1;
+  config.n_filters = 10;
+  config.filter_size = 5;
+  config.hidden_dim = 50;
+  config.weight_scale = 1e-2;
+  config.n_classes = 10;
+  config.reg = 0.5;
+  litecnn::SimpleConvNet<> cnn(config);
+  auto start = std::chrono::steady_clock::now();
+
+  if (async) {
+    TrainAsync(x, y, x_test, y_test, n_threads, &cnn);
+  } else {
+    // 100 images per replica and step, like each thread of the async mode
+    litecnn::SetNumThreads(n_threads);
+    cnn.train_parallel(x, &y[0],                           // train data
+                       x_test.slice(0, 1000), &y_test[0],  // eval data
+                       2,                                  // epochs
+                       100 * n_threads,                    // batch
+                       0.005,                              // lr
+                       10,                                 // log_every
+                       100);                               // eval_every
+  }
   auto end = std::chrono::steady_clock::now();
   std::cout
       << "training took "
@@ -1,262 +1,493 @@
 #include "ndarray.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
-#include <functional>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <numeric>
 #include <random>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "gemm.h"
+#include "parallel.h"
+#include "pool.h"
+#include "simd.h"
+
 namespace litecnn {
 
-Ndarray::Ndarray(int64_t s0, int64_t s1, int64_t s2, int64_t s3)
-    : Ndarray(std::vector<int64_t>{s0, s1, s2, s3}, nullptr) {}
+template <typename Scalar>
+Ndarray<Scalar>::Ndarray(int64_t s0, int64_t s1, int64_t s2, int64_t s3)
+    : Ndarray(std::array<int64_t, 4>{{s0, s1, s2, s3}}.data(), 4, nullptr) {}
 
-Ndarray::Ndarray(const std::vector<int64_t>& shape,
-                 const std::vector<double>& data)
-    : Ndarray(shape, std::make_shared<std::vector<double>>(data)) {}
+template <typename Scalar>
+Ndarray<Scalar>::Ndarray(const std::vector<int64_t>& shape,
+                         const std::vector<Scalar>& data)
+    : Ndarray(shape, std::allocate_shared<Buffer>(PoolAllocator<Buffer>(),
+                                                  data.begin(), data.end())) {}
 
-Ndarray::Ndarray(const std::vector<int64_t>& shape,
-                 std::shared_ptr<std::vector<double>> data)
-    : shape_(4, 1), stride_(4, 1) {
-  assert(shape.size() <= 4);
-  int64_t size = 1;
-  for (int64_t s : shape) {
-    if (s <= 0) {
-      break;
-    }
-    size *= s;
-    shape_[ndim_] = s;
-    ndim_ += 1;
-  }
+template <typename Scalar>
+Ndarray<Scalar>::Ndarray(const std::vector<int64_t>& shape,
+                         std::shared_ptr<Buffer> data)
+    : Ndarray(shape.data(), shape.size(), data) {}
+
+template <typename Scalar>
+Ndarray<Scalar>::Ndarray(const int64_t* shape, int64_t n,
+                         std::shared_ptr<Buffer> data) {
+  int64_t size = set_shape(shape, n);
   if (data) {
     assert(data->size() >= size);
     data_ = data;
   } else {
-    data_ = std::make_shared<std::vector<double>>(size);
+    data_ = std::allocate_shared<Buffer>(PoolAllocator<Buffer>(), size);
+  }
+  base_ = data_->data();
+  capacity_ = data_->size();
+}
+
+namespace {
+
+const char kFileMagic[4] = {'L', 'C', 'N', 'N'};
+
+// Layout of the start of a tensor file. The elements follow at
+// kFileDataOffset, which keeps them 64-byte aligned in a mapping.
+struct FileHeader {
+  char magic[4];
+  uint32_t elem_size;
+  uint32_t ndim;
+  uint32_t reserved;
+  int64_t shape[kMaxDims];
+};
+
+const int64_t kFileDataOffset = 128;
+static_assert(sizeof(FileHeader) <= kFileDataOffset, "header fits");
+
+}  // namespace
+
+// The header comes from outside, so every field is checked before use, the
+// sizes against the elements the file actually holds.
+template <typename Scalar>
+Ndarray<Scalar>::Ndarray(const std::string& path, MapMode mode)
+    : file_(std::make_shared<MappedFile>(path, mode)) {
+  auto fail = [&path](const std::string& why) {
+    throw std::runtime_error("bad tensor file " + path + ": " + why);
+  };
+  FileHeader header;
+  if (file_->size() < kFileDataOffset) {
+    fail("shorter than the header");
+  }
+  std::memcpy(&header, file_->data(), sizeof(header));
+  if (!std::equal(kFileMagic, kFileMagic + 4, header.magic)) {
+    fail("wrong magic");
+  }
+  if (header.elem_size != sizeof(Scalar)) {
+    fail("elements of " + std::to_string(header.elem_size) + " bytes, not " +
+         std::to_string(sizeof(Scalar)));
+  }
+  if (header.ndim > kMaxDims) {
+    fail("rank " + std::to_string(header.ndim));
+  }
+  int64_t avail = (file_->size() - kFileDataOffset) / sizeof(Scalar);
+  int64_t size = 1;
+  for (uint32_t i = 0; i < header.ndim; i++) {
+    if (header.shape[i] <= 0 || size > avail / header.shape[i]) {
+      fail("shape larger than the file");
+    }
+    size *= header.shape[i];
+  }
+  if (size > avail) {
+    fail("shape larger than the file");
+  }
+  set_shape(header.shape, header.ndim);
+  base_ = reinterpret_cast<Scalar*>(file_->data() + kFileDataOffset);
+  capacity_ = size;
+}
+
+template <typename Scalar>
+void Ndarray<Scalar>::save(const std::string& path) const {
+  FileHeader header = {};
+  std::copy(kFileMagic, kFileMagic + 4, header.magic);
+  header.elem_size = sizeof(Scalar);
+  header.ndim = ndim_;
+  std::copy(shape_, shape_ + ndim_, header.shape);
+  char pad[kFileDataOffset] = {};
+  std::memcpy(pad, &header, sizeof(header));
+  Ndarray x = contiguous();
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(pad, kFileDataOffset);
+  out.write(reinterpret_cast<const char*>(x.ptr()), x.size() * sizeof(Scalar));
+  out.close();
+  if (!out) {
+    throw std::runtime_error("cannot write " + path);
+  }
+}
+
+template <typename Scalar>
+int64_t Ndarray<Scalar>::set_shape(const int64_t* shape, int64_t n) {
+  int64_t size = 1;
+  ndim_ = 0;
+  for (int64_t i = 0; i < n && shape[i] > 0; i++) {
+    assert(ndim_ < kMaxDims);
+    size *= shape[i];
+    shape_[ndim_] = shape[i];
+    ndim_ += 1;
   }
+  std::fill(shape_ + ndim_, shape_ + kMaxDims, 1);
+  std::fill(stride_ + ndim_, stride_ + kMaxDims, 1);
   for (int64_t stride = 1, i = ndim_ - 1; i >= 0; i--) {
     stride_[i] = stride;
     stride *= shape_[i];
   }
+  transposed_ = false;
+  return size;
 }
 
-bool Ndarray::operator==(const Ndarray& rhs) const {
-  if (ndim() != rhs.ndim() || shape_ != rhs.shape_) {
-    return false;
+namespace {
+
+// Calls fn(o0, o1, o2) for every index of the first ndim dimensions of shape
+// in row-major order, where ok is the offset of that index under the strides
+// sk. The innermost dimension is a plain loop, the outer ones an odometer.
+template <typename Fn>
+void ForEachOffset(int64_t ndim, const int64_t* shape, const int64_t* s0,
+                   const int64_t* s1, const int64_t* s2, Fn fn) {
+  if (ndim == 0) {
+    fn(0, 0, 0);
+    return;
   }
-  for (int64_t i0 = 0; i0 < shape_[0]; i0++) {
-    for (int64_t i1 = 0; i1 < shape_[1]; i1++) {
-      for (int64_t i2 = 0; i2 < shape_[2]; i2++) {
-        for (int64_t i3 = 0; i3 < shape_[3]; i3++) {
-          if (at(i0, i1, i2, i3) != rhs.at(i0, i1, i2, i3)) {
-            return false;
-          }
-        }
+  int64_t last = ndim - 1;
+  int64_t idx[kMaxDims] = {};
+  int64_t o0 = 0, o1 = 0, o2 = 0;
+  while (true) {
+    for (int64_t i = 0; i < shape[last]; i++) {
+      fn(o0 + i * s0[last], o1 + i * s1[last], o2 + i * s2[last]);
+    }
+    int64_t d = last - 1;
+    for (; d >= 0; d--) {
+      idx[d]++;
+      o0 += s0[d];
+      o1 += s1[d];
+      o2 += s2[d];
+      if (idx[d] < shape[d]) {
+        break;
       }
+      o0 -= idx[d] * s0[d];
+      o1 -= idx[d] * s1[d];
+      o2 -= idx[d] * s2[d];
+      idx[d] = 0;
+    }
+    if (d < 0) {
+      return;
     }
   }
-  return true;
 }
 
-Ndarray Ndarray::binop(const Ndarray& rhs,
-                       std::function<double(double, double)> op,
-                       bool inplace) const {
-  if (ndim() == rhs.ndim() && shape_ == rhs.shape_) {
-    Ndarray ret;
-    if (inplace) {
-      ret = *this;
-    } else {
-      ret = fork();
-    }
-    for (int64_t i0 = 0; i0 < shape_[0]; i0++) {
-      for (int64_t i1 = 0; i1 < shape_[1]; i1++) {
-        for (int64_t i2 = 0; i2 < shape_[2]; i2++) {
-          for (int64_t i3 = 0; i3 < shape_[3]; i3++) {
-            ret.at(i0, i1, i2, i3) =
-                op(ret.at(i0, i1, i2, i3), rhs.at(i0, i1, i2, i3));
-          }
-        }
-      }
+}  // namespace
+
+template <typename Scalar>
+bool Ndarray<Scalar>::same_shape(const Ndarray& rhs) const {
+  return ndim_ == rhs.ndim_ && std::equal(shape_, shape_ + ndim_, rhs.shape_);
+}
+
+template <typename Scalar>
+bool Ndarray<Scalar>::operator==(const Ndarray& rhs) const {
+  if (!same_shape(rhs)) {
+    return false;
+  }
+  const Scalar* a = ptr();
+  const Scalar* b = rhs.ptr();
+  bool equal = true;
+  ForEachOffset(ndim_, shape_, stride_, rhs.stride_, stride_,
+                [&](int64_t i, int64_t j, int64_t) {
+                  equal = equal && a[i] == b[j];
+                });
+  return equal;
+}
+
+namespace {
+
+// Number of trailing elements of shape (d dims) that inner (k dims) covers
+// when it is repeated along the leading dimensions only, 0 if it broadcasts
+// any other way.
+int64_t TrailingBlock(const int64_t* shape, int64_t d, const int64_t* inner,
+                      int64_t k) {
+  if (k > d) {
+    return 0;
+  }
+  int64_t block = 1;
+  int64_t i = 0;
+  while (i < k && inner[i] == 1) {
+    i++;
+  }
+  for (; i < k; i++) {
+    if (inner[i] != shape[d - k + i]) {
+      return 0;
     }
-    return ret;
+    block *= inner[i];
   }
-  // broadcast
-  Ndarray a = T();
-  Ndarray b = rhs.T();
-  std::vector<int64_t> shape;
-  for (int64_t i = std::max(a.ndim(), b.ndim()) - 1; i >= 0; i--) {
-    auto si = i < a.ndim() ? a.shape(i) : 1;
-    auto sj = i < b.ndim() ? b.shape(i) : 1;
-    assert(si == 1 || sj == 1 || si == sj);
-    shape.push_back(std::max(si, sj));
-  }
-  assert(!inplace || shape == this->shape());
-  Ndarray ct(shape, nullptr);
-  auto c = ct.T();
-  for (int64_t i3 = 0; i3 < c.shape_[3]; i3++) {
-    for (int64_t i2 = 0; i2 < c.shape_[2]; i2++) {
-      for (int64_t i1 = 0; i1 < c.shape_[1]; i1++) {
-        for (int64_t i0 = 0; i0 < c.shape_[0]; i0++) {
-          c.at(i0, i1, i2, i3) = op(
-              a.at(std::min(i0, a.shape_[0] - 1), std::min(i1, a.shape_[1] - 1),
-                   std::min(i2, a.shape_[2] - 1),
-                   std::min(i3, a.shape_[3] - 1)),
-              b.at(std::min(i0, b.shape_[0] - 1), std::min(i1, b.shape_[1] - 1),
-                   std::min(i2, b.shape_[2] - 1),
-                   std::min(i3, b.shape_[3] - 1)));
+  return block;
+}
+
+}  // namespace
+
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::binop(const Ndarray& rhs, BinaryOp op,
+                                       bool inplace) const {
+  assert(!inplace || !is_read_only());
+  bool same = same_shape(rhs);
+  if (is_contiguous() && rhs.is_contiguous()) {
+    int64_t n = size();
+    int64_t block =
+        same ? n : TrailingBlock(shape_, ndim_, rhs.shape_, rhs.ndim_);
+    if (block > 0) {
+      Ndarray ret = inplace ? *this : Ndarray(shape_, ndim_, nullptr);
+      const Scalar* a = ptr();
+      const Scalar* b = rhs.ptr();
+      Scalar* c = ret.ptr();
+      if (block == 1) {
+        BinaryScalar(op, n, a, b[0], c);
+      } else {
+        for (int64_t i = 0; i < n; i += block) {
+          Binary(op, block, a + i, b, c + i);
         }
       }
+      return ret;
     }
   }
-  return ct;
+  // broadcast, dimensions are aligned at the end and a size of 1 repeats
+  int64_t nd = std::max(ndim_, rhs.ndim_);
+  int64_t shape[kMaxDims];
+  int64_t sa[kMaxDims];
+  int64_t sb[kMaxDims];
+  for (int64_t i = 0; i < nd; i++) {
+    int64_t ia = i - (nd - ndim_);
+    int64_t ib = i - (nd - rhs.ndim_);
+    int64_t na = ia >= 0 ? shape_[ia] : 1;
+    int64_t nb = ib >= 0 ? rhs.shape_[ib] : 1;
+    assert(na == 1 || nb == 1 || na == nb);
+    shape[i] = std::max(na, nb);
+    sa[i] = na == 1 ? 0 : stride_[ia];
+    sb[i] = nb == 1 ? 0 : rhs.stride_[ib];
+  }
+  Ndarray ret;
+  if (inplace) {
+    assert(nd == ndim_ && std::equal(shape, shape + nd, shape_));
+    ret = *this;
+  } else {
+    ret = Ndarray(shape, nd, nullptr);
+  }
+  const Scalar* a = ptr();
+  const Scalar* b = rhs.ptr();
+  Scalar* c = ret.ptr();
+  ForEachOffset(nd, shape, sa, sb, ret.stride_,
+                [&](int64_t i, int64_t j, int64_t k) {
+                  c[k] = ApplyBinary(op, a[i], b[j]);
+                });
+  return ret;
 }
 
-Ndarray Ndarray::operator+(const Ndarray& rhs) const {
-  return binop(rhs, std::plus<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator+(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kAdd, false);
 }
-Ndarray Ndarray::operator-(const Ndarray& rhs) const {
-  return binop(rhs, std::minus<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator-(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kSub, false);
 }
-Ndarray Ndarray::operator*(const Ndarray& rhs) const {
-  return binop(rhs, std::multiplies<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator*(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kMul, false);
 }
-Ndarray Ndarray::operator/(const Ndarray& rhs) const {
-  return binop(rhs, std::divides<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator/(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kDiv, false);
 }
 
-Ndarray Ndarray::operator+=(const Ndarray& rhs) const {
-  return binop(rhs, std::plus<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator+=(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kAdd, true);
 }
-Ndarray Ndarray::operator-=(const Ndarray& rhs) const {
-  return binop(rhs, std::minus<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator-=(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kSub, true);
 }
-Ndarray Ndarray::operator*=(const Ndarray& rhs) const {
-  return binop(rhs, std::multiplies<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator*=(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kMul, true);
 }
-Ndarray Ndarray::operator/=(const Ndarray& rhs) const {
-  return binop(rhs, std::divides<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator/=(const Ndarray& rhs) const {
+  return binop(rhs, BinaryOp::kDiv, true);
 }
 
-Ndarray Ndarray::binop(double a, std::function<double(double, double)> op,
-                       bool inplace) const {
-  Ndarray ret;
-  if (inplace) {
-    ret = *this;
-  } else {
-    ret = this->fork();
-  }
-  for (auto& v : *ret.data_) {
-    v = op(v, a);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::binop(Scalar a, BinaryOp op,
+                                       bool inplace) const {
+  assert(!inplace || !is_read_only());
+  Ndarray ret = inplace ? *this : Ndarray(shape_, ndim_, nullptr);
+  if (is_contiguous()) {
+    BinaryScalar(op, size(), ptr(), a, ret.ptr());
+    return ret;
   }
+  const Scalar* x = ptr();
+  Scalar* c = ret.ptr();
+  ForEachOffset(ndim_, shape_, stride_, ret.stride_, stride_,
+                [&](int64_t i, int64_t k, int64_t) {
+                  c[k] = ApplyBinary(op, x[i], a);
+                });
   return ret;
 }
 
-Ndarray Ndarray::operator+(double a) const {
-  return binop(a, std::plus<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator+(Scalar a) const {
+  return binop(a, BinaryOp::kAdd, false);
 }
-Ndarray Ndarray::operator-(double a) const {
-  return binop(a, std::minus<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator-(Scalar a) const {
+  return binop(a, BinaryOp::kSub, false);
 }
-Ndarray Ndarray::operator*(double a) const {
-  return binop(a, std::multiplies<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator*(Scalar a) const {
+  return binop(a, BinaryOp::kMul, false);
 }
-Ndarray Ndarray::operator/(double a) const {
-  return binop(a, std::divides<double>(), false);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator/(Scalar a) const {
+  return binop(a, BinaryOp::kDiv, false);
 }
-Ndarray Ndarray::operator+=(double a) const {
-  return binop(a, std::plus<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator+=(Scalar a) const {
+  return binop(a, BinaryOp::kAdd, true);
 }
-Ndarray Ndarray::operator-=(double a) const {
-  return binop(a, std::minus<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator-=(Scalar a) const {
+  return binop(a, BinaryOp::kSub, true);
 }
-Ndarray Ndarray::operator*=(double a) const {
-  return binop(a, std::multiplies<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator*=(Scalar a) const {
+  return binop(a, BinaryOp::kMul, true);
 }
-Ndarray Ndarray::operator/=(double a) const {
-  return binop(a, std::divides<double>(), true);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::operator/=(Scalar a) const {
+  return binop(a, BinaryOp::kDiv, true);
 }
 
-namespace {
-double mypow(double a, double b) { return std::pow(a, b); }
-}  // namespace
-Ndarray Ndarray::pow(double a) const { return binop(a, mypow, false); }
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::pow(Scalar a) const {
+  Ndarray ret;
+  pow_into(a, &ret);
+  return ret;
+}
+
+template <typename Scalar>
+void Ndarray<Scalar>::pow_into(Scalar a, Ndarray* out) const {
+  Ndarray x = contiguous();
+  out->ensure_shape(shape_, ndim_);
+  const Scalar* xp = x.ptr();
+  Scalar* o = out->ptr();
+  for (int64_t i = 0, n = size(); i < n; i++) {
+    o[i] = std::pow(xp[i], a);
+  }
+}
 
-void Ndarray::gaussian(double a) {
+template <typename Scalar>
+void Ndarray<Scalar>::gaussian(double a) {
   std::minstd_rand rng(1);
   std::normal_distribution<> gaussian(0, a);
-  for (int64_t i = 0; i < data_->size(); i++) {
-    (*data_)[i] = gaussian(rng);
+  assert(!is_read_only());
+  for (int64_t i = 0; i < capacity_; i++) {
+    base_[i] = gaussian(rng);
   };
 }
 
-Ndarray Ndarray::dot(const Ndarray& rhs) const {
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::dot(const Ndarray& rhs) const {
   // see
   // https://docs.scipy.org/doc/numpy/reference/generated/numpy.dot.html#numpy.dot
-  if (ndim() == 1 && rhs.ndim() == 1) {
-    assert(shape(0) == rhs.shape(0));
-    Ndarray ret(1);
-    for (int64_t i0 = 0; i0 < shape(0); i0++) {
-      ret.at(0) += at(i0) * rhs.at(i0);
-    }
-    return ret;
-  }
-  if (ndim() == 2 && rhs.ndim() == 2) {
-    assert(shape(1) == rhs.shape(0));
-    Ndarray ret(shape(0), rhs.shape(1));
-    for (int64_t i0 = 0; i0 < shape(0); i0++) {
-      for (int64_t i1 = 0; i1 < shape(1); i1++) {
-        for (int64_t i2 = 0; i2 < rhs.shape(1); i2++) {
-          ret.at(i0, i2) += at(i0, i1) * rhs.at(i1, i2);
-        }
-      }
-    }
-    return ret;
-  }
   if (ndim() == 0 || rhs.ndim() == 0) {
     if (ndim() == 0) {
       return rhs * at();
     }
     return (*this) * rhs.at();
   }
-  assert(false);  // leave empty for now
+  Ndarray ret;
+  dot_into(rhs, &ret);
+  return ret;
+}
+
+template <typename Scalar>
+void Ndarray<Scalar>::dot_into(const Ndarray& rhs, Ndarray* out,
+                               Scalar beta) const {
+  if (ndim() == 1 && rhs.ndim() == 1) {
+    assert(shape(0) == rhs.shape(0));
+    const Scalar* a = ptr();
+    const Scalar* b = rhs.ptr();
+    Scalar v = 0;
+    for (int64_t i0 = 0; i0 < shape(0); i0++) {
+      v += a[i0 * stride_[0]] * b[i0 * rhs.stride_[0]];
+    }
+    const int64_t one = 1;
+    out->ensure_shape(&one, 1);
+    out->ptr()[0] = beta == 0 ? v : v + beta * out->ptr()[0];
+    return;
+  }
+  assert(ndim() == 2 && rhs.ndim() == 2);  // leave the rest empty for now
+  assert(shape(1) == rhs.shape(0));
+  int64_t outshape[2] = {shape_[0], rhs.shape_[1]};
+  out->ensure_shape(outshape, 2);
+  Gemm(shape(0), rhs.shape(1), shape(1), Scalar(1), ptr(), stride_[0],
+       stride_[1], rhs.ptr(), rhs.stride_[0], rhs.stride_[1], beta, out->ptr(),
+       out->stride_[0], out->stride_[1]);
+}
+
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::reshape(int64_t s0, int64_t s1, int64_t s2,
+                                         int64_t s3) {
+  std::array<int64_t, 4> shape{{s0, s1, s2, s3}};
+  return view(shape.data(), shape.size());
 }
 
-Ndarray Ndarray::reshape(int64_t s0, int64_t s1, int64_t s2, int64_t s3) {
-  return reshape({s0, s1, s2, s3});
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::reshape(const std::vector<int64_t>& shape) {
+  return view(shape.data(), shape.size());
 }
 
-Ndarray Ndarray::reshape(const std::vector<int64_t>& shape) {
-  assert(!transposed_);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::view(const int64_t* shape, int64_t n) const {
+  assert(is_contiguous());
+  int64_t newshape[kMaxDims];
   int64_t autoshape = -1;
-  int64_t size = data_->size();
-  for (int64_t i = 0; i < shape.size(); i++) {
-    int64_t s = shape[i];
-    if (s == 0) {
-      break;
-    }
+  int64_t rest = size();
+  int64_t nd = 0;
+  for (; nd < n && shape[nd] != 0; nd++) {
+    assert(nd < kMaxDims);
+    int64_t s = shape[nd];
+    newshape[nd] = s;
     if (s == -1) {
       assert(autoshape == -1);
-      autoshape = i;
+      autoshape = nd;
       continue;
     }
     assert(s > 0);
-    assert(size % s == 0);
-    size /= s;
+    assert(rest % s == 0);
+    rest /= s;
   }
   if (autoshape >= 0) {
-    std::vector<int64_t> newshape = shape;
-    newshape[autoshape] = size;
-    return Ndarray(newshape, data_);
+    newshape[autoshape] = rest;
+  } else {
+    assert(rest == 1);
   }
-  return Ndarray(shape, data_);
+  Ndarray ret = *this;
+  ret.set_shape(newshape, nd);
+  return ret;
 }
 
-Ndarray Ndarray::T() const {
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::T() const {
   Ndarray ret = *this;
   for (int64_t i = 0, j = ndim() - 1; i < j; i++, j--) {
     int64_t tmp = ret.shape_[i];
@@ -270,86 +501,324 @@ Ndarray Ndarray::T() const {
   return ret;
 };
 
-Ndarray Ndarray::fork() const {
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::fork() const {
   Ndarray ret = *this;
-  ret.data_ = std::make_shared<std::vector<double>>(*data_);
+  ret.data_ = std::allocate_shared<Buffer>(PoolAllocator<Buffer>(), base_,
+                                          base_ + capacity_);
+  ret.file_.reset();
+  ret.base_ = ret.data_->data();
+  return ret;
+}
+
+template <typename Scalar>
+bool Ndarray<Scalar>::is_contiguous() const {
+  for (int64_t stride = 1, i = ndim_ - 1; i >= 0; i--) {
+    if (shape_[i] != 1 && stride_[i] != stride) {
+      return false;
+    }
+    stride *= shape_[i];
+  }
+  return true;
+}
+
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::contiguous() const {
+  if (is_contiguous()) {
+    return *this;
+  }
+  Ndarray ret(shape_, ndim_, nullptr);
+  const Scalar* x = ptr();
+  Scalar* c = ret.ptr();
+  ForEachOffset(ndim_, shape_, stride_, ret.stride_, stride_,
+                [&](int64_t i, int64_t k, int64_t) { c[k] = x[i]; });
   return ret;
 }
 
-void Ndarray::debug() const {
+template <typename Scalar>
+void Ndarray<Scalar>::debug() const {
   std::cout << "ndim:" << ndim() << " transposed:" << transposed_
             << " offset:" << offset_ << std::endl;
   for (int64_t i = 0; i < ndim(); i++) {
     std::cout << "d:" << i << " shape:" << shape_[i] << " stride:" << stride_[i]
               << std::endl;
   }
-  for (double v : *data_) {
-    std::cout << v << " ";
+  for (int64_t i = 0; i < capacity_; i++) {
+    std::cout << base_[i] << " ";
   }
   std::cout << std::endl;
 }
 
-double Ndarray::sum() const {
-  return std::accumulate(data_->begin(), data_->end(), 0.0);
+namespace {
+
+// Inputs below this many elements are reduced on the calling thread, larger
+// ones in chunks of this size.
+const int64_t kReduceChunk = 1 << 15;
+
+// out[0:n] *= beta ahead of a pass that adds onto out. A beta of 0 clears out
+// without reading it, so stale NaNs do not survive.
+template <typename Scalar>
+void ScaleOutput(Scalar beta, int64_t n, Scalar* out) {
+  if (beta == 0) {
+    std::fill(out, out + n, Scalar(0));
+  } else if (beta != 1) {
+    BinaryScalar(BinaryOp::kMul, n, out, beta, out);
+  }
+}
+
+}  // namespace
+
+template <typename Scalar>
+Scalar Ndarray<Scalar>::sum() const {
+  Ndarray x = contiguous();
+  int64_t n = x.size();
+  int64_t nchunks = (n + kReduceChunk - 1) / kReduceChunk;
+  std::vector<double> partial(nchunks);
+  ParallelFor(0, nchunks, [&](int64_t begin, int64_t end) {
+    for (int64_t c = begin; c < end; c++) {
+      int64_t i = c * kReduceChunk;
+      partial[c] = ReduceSum(std::min(kReduceChunk, n - i), x.ptr() + i);
+    }
+  });
+  return std::accumulate(partial.begin(), partial.end(), 0.0);
 }
 
-double Ndarray::max() const {
-  assert(!data_->empty());
-  return *std::max_element(data_->begin(), data_->end());
+template <typename Scalar>
+Scalar Ndarray<Scalar>::max() const {
+  Ndarray x = contiguous();
+  int64_t n = x.size();
+  int64_t nchunks = (n + kReduceChunk - 1) / kReduceChunk;
+  std::vector<Scalar> partial(nchunks);
+  ParallelFor(0, nchunks, [&](int64_t begin, int64_t end) {
+    for (int64_t c = begin; c < end; c++) {
+      int64_t i = c * kReduceChunk;
+      partial[c] = ReduceMax(std::min(kReduceChunk, n - i), x.ptr() + i);
+    }
+  });
+  return *std::max_element(partial.begin(), partial.end());
 }
 
-std::vector<int64_t> Ndarray::shape() const {
-  std::vector<int64_t> shape = shape_;
-  shape.resize(ndim());
-  return shape;
+template <typename Scalar>
+std::vector<int64_t> Ndarray<Scalar>::shape() const {
+  return std::vector<int64_t>(shape_, shape_ + ndim_);
 }
 
-Ndarray Ndarray::sum(int64_t dim) const {
-  if (dim < 0) {
-    dim += ndim();
+template <typename Scalar>
+int64_t Ndarray<Scalar>::size() const {
+  int64_t size = 1;
+  for (int64_t i = 0; i < ndim_; i++) {
+    size *= shape_[i];
   }
-  assert(dim >= 0);
-  assert(dim < ndim());
-  auto newshape = shape();
-  newshape[dim] = 1;
-  Ndarray ret(newshape, nullptr);
-  for (int64_t i0 = 0; i0 < shape_[0]; i0++) {
-    int64_t j0 = dim == 0 ? 0 : i0;
-    for (int64_t i1 = 0; i1 < shape_[1]; i1++) {
-      int64_t j1 = dim == 1 ? 0 : i1;
-      for (int64_t i2 = 0; i2 < shape_[2]; i2++) {
-        int64_t j2 = dim == 2 ? 0 : i2;
-        for (int64_t i3 = 0; i3 < shape_[3]; i3++) {
-          int64_t j3 = dim == 3 ? 0 : i3;
-          ret.at(j0, j1, j2, j3) += at(i0, i1, i2, i3);
-        }
-      }
+  return size;
+}
+
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::sum(int64_t dim) const {
+  return sum(std::vector<int64_t>{dim});
+}
+
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::sum(const std::vector<int64_t>& dims) const {
+  Ndarray ret;
+  sum_into(dims, &ret);
+  return ret;
+}
+
+template <typename Scalar>
+void Ndarray<Scalar>::sum_into(const std::vector<int64_t>& dims, Ndarray* out,
+                               Scalar beta) const {
+  bool reduced[kMaxDims] = {};
+  for (int64_t dim : dims) {
+    if (dim < 0) {
+      dim += ndim_;
+    }
+    assert(dim >= 0);
+    assert(dim < ndim_);
+    reduced[dim] = true;
+  }
+  int64_t outshape[kMaxDims];
+  int64_t outdims = 0;
+  for (int64_t i = 0; i < ndim_; i++) {
+    if (!reduced[i]) {
+      outshape[outdims++] = shape_[i];
+    }
+  }
+  out->ensure_shape(outshape, outdims);
+  ScaleOutput(beta, out->size(), out->ptr());
+  Ndarray& ret = *out;
+
+  // Merge neighbouring dimensions that are both summed or both kept, so the
+  // input becomes alternating groups; size-1 dimensions go either way.
+  Ndarray x = contiguous();
+  int64_t groups = 0;
+  int64_t gshape[kMaxDims];
+  bool gsum[kMaxDims];
+  for (int64_t i = 0; i < ndim_; i++) {
+    if (shape_[i] == 1) {
+      continue;
+    }
+    if (groups > 0 && gsum[groups - 1] == reduced[i]) {
+      gshape[groups - 1] *= shape_[i];
+    } else {
+      gshape[groups] = shape_[i];
+      gsum[groups] = reduced[i];
+      groups++;
+    }
+  }
+  if (groups == 0 || (groups == 1 && gsum[0])) {
+    ret.ptr()[0] += x.sum();
+    return;
+  }
+  if (groups == 1) {
+    Binary(BinaryOp::kAdd, ret.size(), ret.ptr(), x.ptr(), ret.ptr());
+    return;
+  }
+  int64_t xstride[kMaxDims];
+  int64_t ostride[kMaxDims];
+  for (int64_t g = groups - 1, xs = 1, os = 1; g >= 0; g--) {
+    xstride[g] = xs;
+    xs *= gshape[g];
+    ostride[g] = gsum[g] ? 0 : os;
+    os *= gsum[g] ? 1 : gshape[g];
+  }
+
+  // The outermost group is split into parts of 4 * kReduceChunk elements or
+  // more that run on the pool. If it is summed, every part gets its own output
+  // and those are added in order afterwards, so the rounding only depends on
+  // the shape.
+  int64_t inner = gshape[groups - 1];
+  bool inner_sum = gsum[groups - 1];
+  int64_t outsize = ret.size();
+  int64_t parts = std::max<int64_t>(
+      1, std::min(gshape[0], x.size() / (4 * kReduceChunk)));
+  PooledVector<Scalar> partial(gsum[0] && parts > 1 ? parts * outsize : 0);
+  ParallelFor(0, parts, [&](int64_t begin, int64_t end) {
+    for (int64_t p = begin; p < end; p++) {
+      int64_t g0 = gshape[0] * p / parts;
+      int64_t g1 = gshape[0] * (p + 1) / parts;
+      int64_t outer[kMaxDims];
+      std::copy(gshape, gshape + groups - 1, outer);
+      outer[0] = g1 - g0;
+      const Scalar* xp = x.ptr() + g0 * xstride[0];
+      Scalar* op = partial.empty() ? ret.ptr() + g0 * ostride[0]
+                                   : partial.data() + p * outsize;
+      ForEachOffset(groups - 1, outer, xstride, ostride, xstride,
+                    [&](int64_t i, int64_t k, int64_t) {
+                      if (inner_sum) {
+                        op[k] += ReduceSum(inner, xp + i);
+                      } else {
+                        Binary(BinaryOp::kAdd, inner, op + k, xp + i, op + k);
+                      }
+                    });
     }
+  });
+  for (int64_t p = 0; p < parts && !partial.empty(); p++) {
+    Binary(BinaryOp::kAdd, outsize, ret.ptr(), partial.data() + p * outsize,
+           ret.ptr());
   }
-  newshape.erase(newshape.begin() + dim);
-  return ret.reshape(newshape);
 }
 
-Ndarray Ndarray::as_zeros() const {
-  std::vector<int64_t> shape;
-  for (int i = 0; i < ndim(); i++) {
-    shape.push_back(shape_[i]);
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::as_zeros() const {
+  return Ndarray(shape_, ndim_, nullptr);
+}
+
+template <typename Scalar>
+void Ndarray<Scalar>::ensure_shape(const std::vector<int64_t>& shape) {
+  ensure_shape(shape.data(), shape.size());
+}
+
+template <typename Scalar>
+void Ndarray<Scalar>::ensure_shape(const int64_t* shape, int64_t n) {
+  int64_t nd = 0;
+  while (nd < n && shape[nd] > 0) {
+    nd++;
+  }
+  if (nd == ndim_ && std::equal(shape, shape + nd, shape_) &&
+      is_contiguous()) {
+    assert(!is_read_only());
+    return;
   }
-  return Ndarray(shape, nullptr);
+  *this = Ndarray(shape, nd, nullptr);
 }
 
-Ndarray Ndarray::slice(int64_t i, int64_t n) const {
-  assert(!transposed_);
-  auto newshape = shape();
-  auto s0 = newshape[0];
+template <typename Scalar>
+void Ndarray<Scalar>::fill(Scalar v) {
+  assert(!is_read_only());
+  Scalar* x = ptr();
+  if (is_contiguous()) {
+    std::fill(x, x + size(), v);
+    return;
+  }
+  ForEachOffset(ndim_, shape_, stride_, stride_, stride_,
+                [&](int64_t i, int64_t, int64_t) { x[i] = v; });
+}
+
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::slice(int64_t i, int64_t n) const {
+  assert(ndim_ > 0);
   assert(i >= 0);
-  assert(i < s0);
+  assert(i < shape_[0]);
   assert(n > 0);
-  assert(i + n <= s0);
-  newshape[0] = n;
-  Ndarray ret(newshape, data_);
-  ret.offset_ += offset_ + i * stride_[0];
+  assert(i + n <= shape_[0]);
+  Ndarray ret = *this;
+  ret.shape_[0] = n;
+  ret.offset_ += i * stride_[0];
+  return ret;
+}
+
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::to_blocked(int64_t c) const {
+  assert(ndim_ == 4);
+  assert(c > 0);
+  int64_t N = shape_[0];
+  int64_t C = shape_[1];
+  int64_t HW = shape_[2] * shape_[3];
+  if (c == 1) {
+    return contiguous().reshape({N, C, shape_[2], shape_[3], 1});
+  }
+  Ndarray ret({N, (C + c - 1) / c, shape_[2], shape_[3], c}, nullptr);
+  Ndarray x = contiguous();
+  const Scalar* xp = x.ptr();
+  Scalar* o = ret.ptr();
+  ParallelFor(0, N * C, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      int64_t n = q / C;
+      int64_t ch = q % C;
+      Scalar* ob = o + (n * ret.shape_[1] + ch / c) * HW * c + ch % c;
+      for (int64_t i = 0; i < HW; i++) {
+        ob[i * c] = xp[q * HW + i];
+      }
+    }
+  });
   return ret;
 }
 
+template <typename Scalar>
+Ndarray<Scalar> Ndarray<Scalar>::from_blocked(int64_t channels) const {
+  assert(ndim_ == 5);
+  int64_t N = shape_[0];
+  int64_t c = shape_[4];
+  assert(channels <= shape_[1] * c);
+  int64_t HW = shape_[2] * shape_[3];
+  Ndarray ret({N, channels, shape_[2], shape_[3]}, nullptr);
+  Ndarray x = contiguous();
+  const Scalar* xp = x.ptr();
+  Scalar* o = ret.ptr();
+  ParallelFor(0, N * channels, [&](int64_t begin, int64_t end) {
+    for (int64_t q = begin; q < end; q++) {
+      int64_t n = q / channels;
+      int64_t ch = q % channels;
+      const Scalar* xb = xp + (n * shape_[1] + ch / c) * HW * c + ch % c;
+      for (int64_t i = 0; i < HW; i++) {
+        o[q * HW + i] = xb[i * c];
+      }
+    }
+  });
+  return ret;
+}
+
+template class Ndarray<float>;
+template class Ndarray<double>;
+
 }  // namespace litecnn
@@ -2,22 +2,47 @@
 
 #include <cassert>
 #include <cstdint>
-#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "mapped_file.h"
+#include "pool.h"
+#include "simd.h"
+
 namespace litecnn {
 
+// Highest rank an Ndarray can have.
+const int64_t kMaxDims = 8;
+
+// Strided view over a shared buffer of up to kMaxDims dimensions. Shape and
+// strides are stored inline, so copies and views never allocate. Scalar is
+// the element type, float by default; double is kept for the numerical
+// gradient checks. Instantiated for float and double.
+//
+// The elements live either in a pooled heap Buffer or in a tensor file
+// mapped with mmap (see save() for the format). Views, slices and copies of
+// a mapped array share the mapping; fork() and the arithmetic operators
+// produce heap arrays.
+template <typename Scalar = float>
 class Ndarray {
  public:
+  // element storage, 64-byte aligned and recycled through pool.h
+  typedef PooledVector<Scalar> Buffer;
+
   explicit Ndarray(int64_t s0 = 0, int64_t s1 = 0, int64_t s2 = 0,
                    int64_t s3 = 0);
   // for testing
-  Ndarray(const std::vector<int64_t>& shape, const std::vector<double>& data);
   Ndarray(const std::vector<int64_t>& shape,
-          std::shared_ptr<std::vector<double>> data);
+          const std::vector<Scalar>& data);
+  Ndarray(const std::vector<int64_t>& shape,
+          std::shared_ptr<Buffer> data);
+  // Maps a file written by save() without copying it. Throws
+  // std::runtime_error if it cannot be mapped or is no tensor file of
+  // Scalar elements.
+  Ndarray(const std::string& path, MapMode mode);
 
-  inline double at(int64_t i = 0, int64_t j = 0, int64_t k = 0,
+  inline Scalar at(int64_t i = 0, int64_t j = 0, int64_t k = 0,
                    int64_t l = 0) const {
     assert(i >= 0);
     assert(i < shape_[0]);
@@ -27,11 +52,11 @@ class Ndarray {
     assert(k < shape_[2]);
     assert(l >= 0);
     assert(l < shape_[3]);
-    return (*data_)[i * stride_[0] + j * stride_[1] + k * stride_[2] +
+    return base_[i * stride_[0] + j * stride_[1] + k * stride_[2] +
                     l * stride_[3] + offset_];
   };
 
-  inline double& at(int64_t i = 0, int64_t j = 0, int64_t k = 0,
+  inline Scalar& at(int64_t i = 0, int64_t j = 0, int64_t k = 0,
                     int64_t l = 0) {
     assert(i >= 0);
     assert(i < shape_[0]);
@@ -41,41 +66,56 @@ class Ndarray {
     assert(k < shape_[2]);
     assert(l >= 0);
     assert(l < shape_[3]);
-    return (*data_)[i * stride_[0] + j * stride_[1] + k * stride_[2] +
+    return base_[i * stride_[0] + j * stride_[1] + k * stride_[2] +
                     l * stride_[3] + offset_];
   };
 
-  inline double at(const std::vector<int64_t>& idx) const {
-    int64_t n = 0;
+  // any rank, leading indices only if idx is shorter than ndim()
+  inline Scalar at(const std::vector<int64_t>& idx) const {
+    assert(idx.size() <= ndim_);
+    int64_t n = offset_;
     for (int64_t i = 0; i < idx.size(); i++) {
       n += idx[i] * stride_[i];
     }
-    return (*data_)[n];
+    return base_[n];
   };
 
-  inline double& at(const std::vector<int64_t>& idx) {
-    int64_t n = 0;
+  inline Scalar& at(const std::vector<int64_t>& idx) {
+    assert(idx.size() <= ndim_);
+    int64_t n = offset_;
     for (int64_t i = 0; i < idx.size(); i++) {
       n += idx[i] * stride_[i];
     }
-    return (*data_)[n];
+    return base_[n];
   };
 
   inline int64_t ndim() const { return ndim_; }
 
-  inline std::vector<double>* data() const { return data_.get(); }
+  // heap storage, null for an array mapped from a file
+  inline Buffer* data() const { return data_.get(); }
+
+  // first element of the view
+  inline Scalar* ptr() const { return base_ + offset_; }
+
+  // true for arrays mapped with MapMode::kReadOnly
+  inline bool is_read_only() const {
+    return file_ && file_->mode() == MapMode::kReadOnly;
+  }
 
   inline int64_t shape(int64_t dim) const {
     if (dim < 0) {
       dim += ndim();
     }
     assert(dim >= 0);
-    assert(dim < shape_.size());
+    assert(dim < kMaxDims);
     return shape_[dim];
   }
 
   std::vector<int64_t> shape() const;
 
+  // number of elements in the view
+  int64_t size() const;
+
   bool operator==(const Ndarray& rhs) const;
 
   // broadcast
@@ -89,16 +129,25 @@ class Ndarray {
   Ndarray operator*=(const Ndarray& rhs) const;
   Ndarray operator/=(const Ndarray& rhs) const;
 
-  Ndarray operator+(double a) const;
-  Ndarray operator-(double a) const;
-  Ndarray operator*(double a) const;
-  Ndarray operator/(double a) const;
-  Ndarray operator+=(double a) const;
-  Ndarray operator-=(double a) const;
-  Ndarray operator*=(double a) const;
-  Ndarray operator/=(double a) const;
+  Ndarray operator+(Scalar a) const;
+  Ndarray operator-(Scalar a) const;
+  Ndarray operator*(Scalar a) const;
+  Ndarray operator/(Scalar a) const;
+  Ndarray operator+=(Scalar a) const;
+  Ndarray operator-=(Scalar a) const;
+  Ndarray operator*=(Scalar a) const;
+  Ndarray operator/=(Scalar a) const;
+
+  Ndarray pow(Scalar a) const;
+
+  // The *_into variants write their result into *out instead of allocating
+  // one. *out keeps its buffer when it is already a contiguous array of the
+  // result's shape, otherwise it is replaced by a new one (see
+  // ensure_shape). Those taking beta compute *out = result + beta * *out,
+  // so beta = 1 accumulates.
 
-  Ndarray pow(double a) const;
+  // *out may be *this
+  void pow_into(Scalar a, Ndarray* out) const;
 
   // -1 for autoshape (at most 1 "-1")
   Ndarray reshape(int64_t s0 = 0, int64_t s1 = 0, int64_t s2 = 0,
@@ -109,34 +158,95 @@ class Ndarray {
 
   Ndarray T() const;
 
-  double max() const;
+  // Reductions run on the SIMD kernels of simd.h and split large inputs over
+  // the worker pool. Results do not depend on the number of threads.
+  Scalar max() const;
 
-  double sum() const;
+  // accumulated in double
+  Scalar sum() const;
 
   Ndarray sum(int64_t dim) const;
 
+  // sums over every dimension in dims (negative counts from the end) in one
+  // pass, dropping them from the shape
+  Ndarray sum(const std::vector<int64_t>& dims) const;
+
+  void sum_into(const std::vector<int64_t>& dims, Ndarray* out,
+                Scalar beta = 0) const;
+
   void gaussian(double a);
 
   Ndarray fork() const;
 
+  // true if the view is laid out row-major without gaps
+  bool is_contiguous() const;
+
+  // *this if it is contiguous, otherwise a row-major copy
+  Ndarray contiguous() const;
+
   Ndarray dot(const Ndarray& rhs) const;
 
+  // vector . vector or matrix . matrix, *out must not overlap the operands
+  void dot_into(const Ndarray& rhs, Ndarray* out, Scalar beta = 0) const;
+
   Ndarray as_zeros() const;
 
+  // Makes *this a contiguous array of the given shape. The buffer is kept,
+  // contents included, when that is what *this already is; otherwise a
+  // zeroed one is allocated.
+  void ensure_shape(const std::vector<int64_t>& shape);
+
+  void fill(Scalar v);
+
   Ndarray slice(int64_t i, int64_t n) const;
 
+  // (N,C,H,W) to the channel-blocked (N,ceil(C/c),H,W,c) of blocked.h, the
+  // missing channels of the last block being 0. With c = 1 this is a view.
+  Ndarray to_blocked(int64_t c) const;
+
+  // Inverse of to_blocked, keeping the first channels channels.
+  Ndarray from_blocked(int64_t channels) const;
+
+  // Writes the view to path: a 128-byte header (the magic "LCNN", the
+  // element size and rank as uint32, then kMaxDims int64 sizes) followed by
+  // the elements in row-major order, all in native byte order. Throws
+  // std::runtime_error if the file cannot be written.
+  void save(const std::string& path) const;
+
   void debug() const;
 
  private:
-  Ndarray binop(const Ndarray& rhs, std::function<double(double, double)> op,
-                bool inplace) const;
-  Ndarray binop(double a, std::function<double(double, double)> op,
-                bool inplace) const;
+  // shape holds up to n sizes, the first one <= 0 ends it. Without data a
+  // zeroed buffer is allocated.
+  Ndarray(const int64_t* shape, int64_t n, std::shared_ptr<Buffer> data);
+
+  // Sets a row-major shape from up to n sizes, the first one <= 0 ending it,
+  // and returns the number of elements.
+  int64_t set_shape(const int64_t* shape, int64_t n);
+
+  void ensure_shape(const int64_t* shape, int64_t n);
+
+  // view of the same elements with a new shape, requires is_contiguous()
+  Ndarray view(const int64_t* shape, int64_t n) const;
+
+  bool same_shape(const Ndarray& rhs) const;
+
+  // Contiguous operands of the same shape, and a contiguous rhs repeated
+  // along the leading dimensions (bias add), run on the SIMD kernels of
+  // simd.h. Anything else goes through the strided loops.
+  Ndarray binop(const Ndarray& rhs, BinaryOp op, bool inplace) const;
+  Ndarray binop(Scalar a, BinaryOp op, bool inplace) const;
 
   int64_t ndim_ = 0;
-  std::shared_ptr<std::vector<double>> data_;
-  std::vector<int64_t> shape_;
-  std::vector<int64_t> stride_;
+  // exactly one of data_ and file_ owns the elements
+  std::shared_ptr<Buffer> data_;
+  std::shared_ptr<MappedFile> file_;
+  // first element of the storage and its length
+  Scalar* base_ = nullptr;
+  int64_t capacity_ = 0;
+  // dimensions past ndim_ have size and stride 1
+  int64_t shape_[kMaxDims];
+  int64_t stride_[kMaxDims];
   int64_t offset_ = 0;
   bool transposed_ = false;
 };
@@ -0,0 +1,165 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "ndarray.h"
+#include "parallel.h"
+
+namespace litecnn {
+
+namespace {
+
+const int64_t kBlock = 1 << 14;
+
+// One function per rule, so that each loop is vectorized on its own.
+// d = g + wd p is the gradient with the weight decay folded in.
+
+template <typename T>
+void Sgd(int64_t n, const T* __restrict__ g, T lr, T wd, T* __restrict__ p) {
+  for (int64_t i = 0; i < n; i++) {
+    p[i] -= lr * (g[i] + p[i] * wd);
+  }
+}
+
+template <typename T>
+void Momentum(int64_t n, const T* __restrict__ g, T lr, T wd, T mu,
+              T* __restrict__ p, T* __restrict__ m) {
+  for (int64_t i = 0; i < n; i++) {
+    m[i] = mu * m[i] + (g[i] + p[i] * wd);
+    p[i] -= lr * m[i];
+  }
+}
+
+template <typename T>
+void Adagrad(int64_t n, const T* __restrict__ g, T lr, T wd,
+             T* __restrict__ p, T* __restrict__ v) {
+  for (int64_t i = 0; i < n; i++) {
+    T d = g[i] + p[i] * wd;
+    v[i] += d * d;
+    p[i] -= d * lr / std::sqrt(v[i]);
+  }
+}
+
+template <typename T>
+void RmsProp(int64_t n, const T* __restrict__ g, T lr, T wd, T rho, T eps,
+             T* __restrict__ p, T* __restrict__ v) {
+  for (int64_t i = 0; i < n; i++) {
+    T d = g[i] + p[i] * wd;
+    v[i] = rho * v[i] + (1 - rho) * d * d;
+    p[i] -= lr * d / (std::sqrt(v[i]) + eps);
+  }
+}
+
+// lr1 = lr / (1 - beta1^t) and c2 = 1 / (1 - beta2^t) carry the bias
+// correction.
+template <typename T>
+void Adam(int64_t n, const T* __restrict__ g, T lr1, T wd, T b1, T b2, T c2,
+          T eps, T* __restrict__ p, T* __restrict__ m, T* __restrict__ v) {
+  for (int64_t i = 0; i < n; i++) {
+    T d = g[i] + p[i] * wd;
+    m[i] = b1 * m[i] + (1 - b1) * d;
+    v[i] = b2 * v[i] + (1 - b2) * d * d;
+    p[i] -= lr1 * m[i] / (std::sqrt(v[i] * c2) + eps);
+  }
+}
+
+}  // namespace
+
+template <typename T>
+int Optimizer<T>::states() const {
+  switch (config_.algo) {
+    case Algo::kSgd:
+      return config_.momentum != 0 ? 1 : 0;
+    case Algo::kAdagrad:
+    case Algo::kRmsProp:
+      return 1;
+    case Algo::kAdam:
+      return 2;
+  }
+  assert(false);
+  return 0;
+}
+
+template <typename T>
+std::vector<Ndarray<T>> Optimizer<T>::make_state(
+    const Ndarray<T>& value) const {
+  std::vector<Ndarray<T>> state;
+  for (int i = 0; i < states(); i++) {
+    state.push_back(Ndarray<T>(value.shape(), nullptr));
+    if (config_.algo == Algo::kAdagrad) {
+      state.back().fill(config_.initial_accumulator);
+    }
+  }
+  return state;
+}
+
+template <typename T>
+void Optimizer<T>::update(int64_t n, const T* g, T lr, int64_t t, bool decay,
+                          T* p, T* const* s) const {
+  T wd = decay ? config_.weight_decay : 0;
+  switch (config_.algo) {
+    case Algo::kSgd:
+      if (config_.momentum != 0) {
+        return Momentum(n, g, lr, wd, T(config_.momentum), p, s[0]);
+      }
+      return Sgd(n, g, lr, wd, p);
+    case Algo::kAdagrad:
+      return Adagrad(n, g, lr, wd, p, s[0]);
+    case Algo::kRmsProp:
+      return RmsProp(n, g, lr, wd, T(config_.beta2), T(config_.eps), p, s[0]);
+    case Algo::kAdam: {
+      assert(t >= 1);
+      T lr1 = lr / (1 - std::pow(config_.beta1, t));
+      T c2 = 1 / (1 - std::pow(config_.beta2, t));
+      return Adam(n, g, lr1, wd, T(config_.beta1), T(config_.beta2), c2,
+                  T(config_.eps), p, s[0], s[1]);
+    }
+  }
+}
+
+template <typename T>
+void Optimizer<T>::init(const std::vector<Param<T>>& params) {
+  assert(state_.empty());
+  for (int64_t k = 0; k < params.size(); k++) {
+    state_.push_back(make_state(*params[k].value));
+    for (int64_t i = 0; i < params[k].value->size(); i += kBlock) {
+      blocks_.push_back({k, i});
+    }
+  }
+}
+
+template <typename T>
+void Optimizer<T>::step(const std::vector<Param<T>>& params, double lr) {
+  if (state_.empty()) {
+    init(params);
+  }
+  assert(state_.size() == params.size());
+  t_++;
+  ParallelFor(0, blocks_.size(), [&](int64_t begin, int64_t end) {
+    for (int64_t b = begin; b < end; b++) {
+      int64_t k = blocks_[b].first;
+      int64_t i = blocks_[b].second;
+      const Param<T>& param = params[k];
+      assert(param.value->is_contiguous());
+      assert(param.grad->shape() == param.value->shape());
+      assert(param.grad->is_contiguous());
+      T* s[2] = {};
+      for (int j = 0; j < state_[k].size(); j++) {
+        s[j] = state_[k][j].ptr() + i;
+      }
+      update(std::min(kBlock, param.value->size() - i),
+             param.grad->ptr() + i, T(lr), t_, param.decay,
+             param.value->ptr() + i, s);
+    }
+  });
+}
+
+template class Optimizer<float>;
+template class Optimizer<double>;
+
+}  // namespace litecnn
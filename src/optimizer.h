@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "ndarray.h"
+
+namespace litecnn {
+
+// A parameter array with its gradient, as models list them for an
+// Optimizer. Weights have decay set; biases and normalization parameters
+// get no weight decay.
+template <typename T>
+struct Param {
+  Ndarray<T>* value;
+  Ndarray<T>* grad;
+  bool decay;
+};
+
+// First-order update rules over (parameter, gradient, state) buffers.
+// Instantiated for float and double.
+//
+// Each rule is one loop over the elements that reads the gradient and
+// updates the parameter and its state in place, vectorized by the compiler
+// and allocating nothing. Weight decay is folded into that loop as the L2
+// gradient weight_decay * p of the parameters marked decay.
+template <typename T = float>
+class Optimizer {
+ public:
+  enum class Algo {
+    kSgd,      // p -= lr g, or with momentum m = momentum m + g, p -= lr m
+    kAdagrad,  // v += g^2, p -= lr g / sqrt(v)
+    kRmsProp,  // v = beta2 v + (1 - beta2) g^2, p -= lr g / (sqrt(v) + eps)
+    // m and v as exponential averages of g and g^2, bias corrected
+    kAdam,
+  };
+
+  struct Config {
+    Algo algo = Algo::kAdagrad;
+    double momentum = 0;
+    double beta1 = 0.9;
+    double beta2 = 0.999;
+    double eps = 1e-8;
+    double initial_accumulator = 1e-4;  // where kAdagrad's v starts
+    double weight_decay = 0;
+  };
+
+  explicit Optimizer(Config config) : config_(config) {}
+
+  const Config& config() const { return config_; }
+
+  // One update of every parameter, blocks of them running in parallel on
+  // the worker pool. The state lives in the optimizer by position in
+  // params, created on the first step, so later steps must list the same
+  // shapes in the same order.
+  void step(const std::vector<Param<T>>& params, double lr);
+
+  // Creates the state for params up front, which the first step does
+  // otherwise.
+  void init(const std::vector<Param<T>>& params);
+
+  // Number of state arrays a parameter needs: 0, 1 (m or v) or 2 (m, v).
+  int states() const;
+
+  // states() arrays shaped like value, at their starting values
+  std::vector<Ndarray<T>> make_state(const Ndarray<T>& value) const;
+
+  // The kernel behind step, for elements [0, n) of one parameter; s holds
+  // the states() state arrays at the same offset and t counts the updates
+  // of these elements from 1, for kAdam's bias correction.
+  void update(int64_t n, const T* g, T lr, int64_t t, bool decay, T* p,
+              T* const* s) const;
+
+ private:
+  const Config config_;
+  int64_t t_ = 0;
+  std::vector<std::vector<Ndarray<T>>> state_;  // per parameter
+  // (parameter, first element) of the blocks step splits the work into
+  std::vector<std::pair<int64_t, int64_t>> blocks_;
+};
+
+}  // namespace litecnn
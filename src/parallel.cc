@@ -0,0 +1,183 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace litecnn {
+
+namespace {
+
+// One ParallelFor call. Threads claim chunks through next, so any number of
+// them can help, and the caller waits for done to reach nchunks.
+struct Job {
+  const std::function<void(int64_t, int64_t)>* fn;
+  int64_t begin;
+  int64_t end;
+  int64_t nchunks;
+  std::atomic<int64_t> next{0};
+  std::atomic<int64_t> done{0};
+  std::mutex mu;
+  std::condition_variable done_cv;
+};
+
+// A deque of invitations to help with a job. Owners push and pop at the
+// back, thieves take from the front. An invitation may outlive the chunks of
+// its job, and then it finds nothing left to claim.
+struct Queue {
+  std::mutex mu;
+  std::deque<std::shared_ptr<Job>> jobs;
+};
+
+// The queue of the pool worker running on this thread, null elsewhere.
+thread_local Queue* own_queue = nullptr;
+
+class Pool {
+ public:
+  // queues_[i] for worker i, the last one for threads outside the pool
+  explicit Pool(int n) : queues_(n) {
+    for (int i = 0; i < n - 1; i++) {
+      threads_.emplace_back(&Pool::Work, this, i);
+    }
+  }
+
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) {
+      t.join();
+    }
+  }
+
+  int size() const { return threads_.size() + 1; }
+
+  // Invites idle workers to help with job through the caller's queue, runs
+  // chunks itself until none are left and waits for the rest. Only idle
+  // workers take invitations: a waiting caller never runs another job's
+  // chunks, so thread_local scratch in the middle of use stays untouched.
+  void Run(const std::shared_ptr<Job>& job) {
+    Queue* q = own_queue ? own_queue : &queues_.back();
+    int64_t helpers = std::min<int64_t>(job->nchunks, size()) - 1;
+    {
+      std::lock_guard<std::mutex> lock(q->mu);
+      q->jobs.insert(q->jobs.end(), helpers, job);
+    }
+    queued_.fetch_add(helpers);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+    }
+    cv_.notify_all();
+    RunChunks(job.get());
+    std::unique_lock<std::mutex> lock(job->mu);
+    job->done_cv.wait(lock, [&job]() {
+      return job->done.load() == job->nchunks;
+    });
+  }
+
+ private:
+  static void RunChunks(Job* job) {
+    int64_t i;
+    int64_t n = job->end - job->begin;
+    while ((i = job->next.fetch_add(1)) < job->nchunks) {
+      (*job->fn)(job->begin + n * i / job->nchunks,
+                 job->begin + n * (i + 1) / job->nchunks);
+      if (job->done.fetch_add(1) + 1 == job->nchunks) {
+        std::lock_guard<std::mutex> lock(job->mu);
+        job->done_cv.notify_all();
+      }
+    }
+  }
+
+  // the newest invitation of worker self, else the oldest one of the
+  // outside callers or another worker
+  std::shared_ptr<Job> Take(int self) {
+    std::shared_ptr<Job> job;
+    int n = queues_.size();
+    for (int k = 0; k < n && !job; k++) {
+      int i = k == 0 ? self : (k == 1 ? n - 1 : (self + k - 1) % (n - 1));
+      Queue& q = queues_[i];
+      std::lock_guard<std::mutex> lock(q.mu);
+      if (!q.jobs.empty()) {
+        if (k == 0) {
+          job = q.jobs.back();
+          q.jobs.pop_back();
+        } else {
+          job = q.jobs.front();
+          q.jobs.pop_front();
+        }
+      }
+    }
+    if (job) {
+      queued_.fetch_sub(1);
+    }
+    return job;
+  }
+
+  void Work(int self) {
+    own_queue = &queues_[self];
+    while (true) {
+      std::shared_ptr<Job> job = Take(self);
+      if (job) {
+        RunChunks(job.get());
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [this]() { return stop_ || queued_.load() > 0; });
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+  std::deque<Queue> queues_;
+  std::atomic<int64_t> queued_{0};  // invitations in all the queues
+  std::mutex mu_;                   // guards stop_, pairs with cv_
+  std::condition_variable cv_;
+  std::vector<std::thread> threads_;
+  bool stop_ = false;
+};
+
+std::unique_ptr<Pool>& GlobalPool() {
+  static std::unique_ptr<Pool> pool(
+      new Pool(std::max(1u, std::thread::hardware_concurrency())));
+  return pool;
+}
+
+}  // namespace
+
+int NumThreads() { return GlobalPool()->size(); }
+
+void SetNumThreads(int n) { GlobalPool().reset(new Pool(std::max(1, n))); }
+
+void ParallelFor(int64_t begin, int64_t end,
+                 const std::function<void(int64_t, int64_t)>& fn,
+                 int64_t grain) {
+  if (begin >= end) {
+    return;
+  }
+  Pool* pool = GlobalPool().get();
+  int64_t nchunks = grain > 0 ? (end - begin + grain - 1) / grain
+                              : std::min<int64_t>(pool->size(), end - begin);
+  if (nchunks == 1) {
+    fn(begin, end);
+    return;
+  }
+  auto job = std::make_shared<Job>();
+  job->fn = &fn;
+  job->begin = begin;
+  job->end = end;
+  job->nchunks = nchunks;
+  pool->Run(job);
+}
+
+}  // namespace litecnn
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+namespace litecnn {
+
+// Number of threads ParallelFor spreads work over, including the caller.
+int NumThreads();
+
+// Resizes the shared worker pool. Defaults to std::thread::hardware_concurrency.
+void SetNumThreads(int n);
+
+// Splits [begin, end) into contiguous chunks and runs fn(chunk_begin,
+// chunk_end) on the shared worker pool: at most NumThreads() chunks by
+// default, or chunks of about grain indices, which balance uneven work
+// better. The calling thread works on chunks too and returns once all of
+// them are done.
+//
+// The pool is work stealing: every worker keeps a deque of the calls it
+// made, and idle workers take from their own deque first and then from the
+// others'. Calls made from inside a chunk therefore run in parallel as well,
+// on whichever workers are idle, while the thread making them only works
+// on its own chunks and never on unrelated ones.
+void ParallelFor(int64_t begin, int64_t end,
+                 const std::function<void(int64_t, int64_t)>& fn,
+                 int64_t grain = 0);
+
+}  // namespace litecnn
@@ -0,0 +1,163 @@
+#include "param_server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "ndarray.h"
+#include "optimizer.h"
+
+namespace litecnn {
+
+namespace {
+
+void RaiseMax(std::atomic<int64_t>* max, int64_t v) {
+  int64_t old = max->load(std::memory_order_relaxed);
+  while (old < v &&
+         !max->compare_exchange_weak(old, v, std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace
+
+template <typename T>
+ParamServer<T>::ParamServer(const std::vector<Param<T>>& params,
+                            const typename Optimizer<T>::Config& optimizer,
+                            int64_t shard_size)
+    : optimizer_(optimizer) {
+  assert(shard_size > 0);
+  for (int64_t i = 0; i < params.size(); i++) {
+    const Ndarray<T>& value = *params[i].value;
+    assert(value.is_contiguous());
+    values_.push_back(value);
+    decay_.push_back(params[i].decay);
+    states_.push_back(optimizer_.make_state(value));
+    for (int64_t b = 0, n = value.size(); b < n; b += shard_size) {
+      shards_.emplace_back();
+      shards_.back().param = i;
+      shards_.back().begin = b;
+      shards_.back().size = std::min(shard_size, n - b);
+    }
+  }
+}
+
+template <typename T>
+int ParamServer<T>::add_worker() {
+  std::lock_guard<std::mutex> guard(workers_mu_);
+  workers_.emplace_back();
+  workers_.back().seen.assign(shards_.size(), 0);
+  return workers_.size() - 1;
+}
+
+template <typename T>
+typename ParamServer<T>::Worker* ParamServer<T>::worker(int id) {
+  std::lock_guard<std::mutex> guard(workers_mu_);
+  assert(id >= 0);
+  assert(id < workers_.size());
+  return &workers_[id];
+}
+
+template <typename T>
+std::unique_lock<std::mutex> ParamServer<T>::lock(Shard* s, Worker* w) {
+  std::unique_lock<std::mutex> guard(s->mu, std::try_to_lock);
+  if (!guard.owns_lock()) {
+    w->contended.fetch_add(1, std::memory_order_relaxed);
+    guard.lock();
+  }
+  return guard;
+}
+
+template <typename T>
+void ParamServer<T>::pull(int id, const std::vector<Ndarray<T>*>& params) {
+  assert(params.size() == values_.size());
+  Worker* w = worker(id);
+  for (int64_t i = 0; i < shards_.size(); i++) {
+    Shard* s = &shards_[i];
+    Ndarray<T>* out = params[s->param];
+    assert(out->shape() == values_[s->param].shape());
+    assert(out->is_contiguous());
+    auto guard = lock(s, w);
+    const T* v = values_[s->param].ptr() + s->begin;
+    std::copy(v, v + s->size, out->ptr() + s->begin);
+    w->seen[i] = s->version;
+  }
+}
+
+template <typename T>
+void ParamServer<T>::push(int id, const std::vector<Ndarray<T>*>& grads,
+                          double lr) {
+  assert(grads.size() == values_.size());
+  Worker* w = worker(id);
+  int64_t stale = 0;
+  int64_t staleness = 0;
+  int64_t max_staleness = 0;
+  for (int64_t i = 0; i < shards_.size(); i++) {
+    Shard* s = &shards_[i];
+    const Ndarray<T>& g = *grads[s->param];
+    assert(g.shape() == values_[s->param].shape());
+    assert(g.is_contiguous());
+    auto guard = lock(s, w);
+    int64_t behind = s->version - w->seen[i];
+    stale += behind > 0;
+    staleness += behind;
+    max_staleness = std::max(max_staleness, behind);
+    T* state[2] = {};
+    for (int j = 0; j < states_[s->param].size(); j++) {
+      state[j] = states_[s->param][j].ptr() + s->begin;
+    }
+    optimizer_.update(s->size, g.ptr() + s->begin, T(lr), s->version + 1,
+                      decay_[s->param], values_[s->param].ptr() + s->begin,
+                      state);
+    // the worker's own update does not make it stale
+    w->seen[i] = ++s->version;
+  }
+  w->pushes.fetch_add(1, std::memory_order_relaxed);
+  w->updates.fetch_add(shards_.size(), std::memory_order_relaxed);
+  w->stale_updates.fetch_add(stale, std::memory_order_relaxed);
+  w->staleness.fetch_add(staleness, std::memory_order_relaxed);
+  RaiseMax(&w->max_staleness, max_staleness);
+}
+
+template <typename T>
+typename ParamServer<T>::Stats ParamServer<T>::stats(int id) const {
+  std::lock_guard<std::mutex> guard(workers_mu_);
+  assert(id >= 0);
+  assert(id < workers_.size());
+  const Worker* w = &workers_[id];
+  Stats stats;
+  stats.pushes = w->pushes.load(std::memory_order_relaxed);
+  stats.updates = w->updates.load(std::memory_order_relaxed);
+  stats.stale_updates = w->stale_updates.load(std::memory_order_relaxed);
+  stats.staleness = w->staleness.load(std::memory_order_relaxed);
+  stats.max_staleness = w->max_staleness.load(std::memory_order_relaxed);
+  stats.contended = w->contended.load(std::memory_order_relaxed);
+  return stats;
+}
+
+template <typename T>
+typename ParamServer<T>::Stats ParamServer<T>::stats() const {
+  int n;
+  {
+    std::lock_guard<std::mutex> guard(workers_mu_);
+    n = workers_.size();
+  }
+  Stats total;
+  for (int i = 0; i < n; i++) {
+    Stats s = stats(i);
+    total.pushes += s.pushes;
+    total.updates += s.updates;
+    total.stale_updates += s.stale_updates;
+    total.staleness += s.staleness;
+    total.max_staleness = std::max(total.max_staleness, s.max_staleness);
+    total.contended += s.contended;
+  }
+  return total;
+}
+
+template class ParamServer<float>;
+template class ParamServer<double>;
+
+}  // namespace litecnn
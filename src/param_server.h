@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ndarray.h"
+#include "optimizer.h"
+
+namespace litecnn {
+
+// Parameter store for asynchronous (Hogwild) training. Instantiated for
+// float and double.
+//
+// The served arrays are cut into shards of at most shard_size elements,
+// each with its own lock, optimizer state and version, the number of
+// updates applied to it. Workers train on private copies: pull copies the
+// current values shard by shard and remembers their versions, push runs the
+// optimizer's update on each shard under its lock. A push to a shard that was
+// updated since the worker pulled it is stale by the number of those
+// updates, and the counters below aggregate that per worker and overall.
+template <typename T = float>
+class ParamServer {
+ public:
+  // Serves the values of params, updated in place, which must stay alive
+  // and keep their shapes. The gradients there are not used.
+  ParamServer(const std::vector<Param<T>>& params,
+              const typename Optimizer<T>::Config& optimizer,
+              int64_t shard_size = 1 << 14);
+
+  // Registers a worker and returns its id. The calls below are thread
+  // safe, as long as each worker id is used by one thread at a time.
+  int add_worker();
+
+  // Copies the served values into params, arrays of the served shapes.
+  void pull(int worker, const std::vector<Ndarray<T>*>& params);
+
+  // Optimizer::update with grads, each shard counting its own steps.
+  void push(int worker, const std::vector<Ndarray<T>*>& grads, double lr);
+
+  struct Stats {
+    int64_t pushes = 0;         // push calls
+    int64_t updates = 0;        // shard updates
+    int64_t stale_updates = 0;  // updates with staleness > 0
+    int64_t staleness = 0;      // summed over updates
+    int64_t max_staleness = 0;
+    int64_t contended = 0;  // lock acquisitions that had to wait
+  };
+
+  // over all workers, or for one
+  Stats stats() const;
+  Stats stats(int worker) const;
+
+  int64_t shards() const { return shards_.size(); }
+
+ private:
+  struct Shard {
+    int64_t param;  // index into values_
+    int64_t begin;  // first element within it
+    int64_t size;
+    std::mutex mu;
+    int64_t version = 0;  // guarded by mu
+  };
+
+  struct Worker {
+    std::vector<int64_t> seen;  // shard versions as of the last pull
+    std::atomic<int64_t> pushes{0};
+    std::atomic<int64_t> updates{0};
+    std::atomic<int64_t> stale_updates{0};
+    std::atomic<int64_t> staleness{0};
+    std::atomic<int64_t> max_staleness{0};
+    std::atomic<int64_t> contended{0};
+  };
+
+  // locks s.mu, counting a wait on w if another thread holds it
+  std::unique_lock<std::mutex> lock(Shard* s, Worker* w);
+  Worker* worker(int id);
+
+  const Optimizer<T> optimizer_;
+  std::vector<Ndarray<T>> values_;
+  std::vector<bool> decay_;
+  std::vector<std::vector<Ndarray<T>>> states_;  // per value
+  std::deque<Shard> shards_;
+  mutable std::mutex workers_mu_;
+  std::deque<Worker> workers_;  // guarded by workers_mu_
+};
+
+}  // namespace litecnn
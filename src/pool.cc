@@ -0,0 +1,170 @@
+#include "pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace litecnn {
+
+namespace {
+
+const size_t kAlign = 64;
+const int kClasses = 256;
+// blocks per class a thread keeps for itself before spilling
+const size_t kThreadCacheBlocks = 8;
+
+std::atomic<int64_t> hits{0};
+std::atomic<int64_t> misses{0};
+std::atomic<int64_t> cached_bytes{0};
+
+// Size class of a request and the block size it is rounded up to: multiples
+// of 64 up to 256 bytes, then 2^k + j 2^(k-2) for j = 1..4.
+int SizeClass(size_t bytes, size_t* size) {
+  if (bytes <= 4 * kAlign) {
+    *size = std::max(kAlign, (bytes + kAlign - 1) / kAlign * kAlign);
+    return *size / kAlign - 1;
+  }
+  int k = 63 - __builtin_clzll(bytes - 1);  // 2^k < bytes <= 2^(k+1)
+  size_t base = size_t(1) << k;
+  size_t step = base >> 2;
+  size_t j = (bytes - base + step - 1) / step;
+  *size = base + j * step;
+  int c = 4 + (k - 8) * 4 + (j - 1);
+  assert(c < kClasses);
+  return c;
+}
+
+// Inverse of SizeClass.
+size_t ClassSize(int c) {
+  if (c < 4) {
+    return (c + 1) * kAlign;
+  }
+  int k = 8 + (c - 4) / 4;
+  size_t j = (c - 4) % 4 + 1;
+  return (size_t(1) << k) + j * (size_t(1) << (k - 2));
+}
+
+struct SharedLists {
+  std::mutex mu;
+  std::vector<void*> free[kClasses];
+};
+
+// Never destroyed, threads may flush into it during process exit.
+SharedLists& Shared() {
+  static SharedLists* lists = new SharedLists;
+  return *lists;
+}
+
+thread_local bool cache_gone = false;
+
+struct ThreadCache {
+  std::vector<void*> free[kClasses];
+
+  ~ThreadCache() {
+    SharedLists& shared = Shared();
+    std::lock_guard<std::mutex> lock(shared.mu);
+    for (int c = 0; c < kClasses; c++) {
+      shared.free[c].insert(shared.free[c].end(), free[c].begin(),
+                            free[c].end());
+    }
+    cache_gone = true;
+  }
+};
+
+// The calling thread's cache, null once it has been torn down at thread exit
+// so that late frees go straight to the shared lists.
+ThreadCache* LocalCache() {
+  thread_local ThreadCache cache;
+  return cache_gone ? nullptr : &cache;
+}
+
+}  // namespace
+
+void* PoolAlloc(size_t bytes) {
+  size_t size;
+  int c = SizeClass(bytes, &size);
+  void* p = nullptr;
+  ThreadCache* local = LocalCache();
+  if (local && !local->free[c].empty()) {
+    p = local->free[c].back();
+    local->free[c].pop_back();
+  } else {
+    SharedLists& shared = Shared();
+    std::lock_guard<std::mutex> lock(shared.mu);
+    if (!shared.free[c].empty()) {
+      p = shared.free[c].back();
+      shared.free[c].pop_back();
+    }
+  }
+  if (p) {
+    hits.fetch_add(1, std::memory_order_relaxed);
+    cached_bytes.fetch_sub(size, std::memory_order_relaxed);
+    return p;
+  }
+  misses.fetch_add(1, std::memory_order_relaxed);
+  int err = posix_memalign(&p, kAlign, size);
+  assert(err == 0);
+  (void)err;
+  return p;
+}
+
+void PoolFree(void* p, size_t bytes) {
+  if (!p) {
+    return;
+  }
+  size_t size;
+  int c = SizeClass(bytes, &size);
+  cached_bytes.fetch_add(size, std::memory_order_relaxed);
+  ThreadCache* local = LocalCache();
+  if (local && local->free[c].size() < kThreadCacheBlocks) {
+    local->free[c].push_back(p);
+    return;
+  }
+  SharedLists& shared = Shared();
+  std::lock_guard<std::mutex> lock(shared.mu);
+  shared.free[c].push_back(p);
+}
+
+PoolStats GetPoolStats() {
+  PoolStats stats;
+  stats.hits = hits.load(std::memory_order_relaxed);
+  stats.misses = misses.load(std::memory_order_relaxed);
+  stats.cached_bytes = cached_bytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void ResetPoolStats() {
+  hits.store(0, std::memory_order_relaxed);
+  misses.store(0, std::memory_order_relaxed);
+}
+
+void TrimPool() {
+  std::vector<void*> blocks[kClasses];
+  ThreadCache* local = LocalCache();
+  {
+    SharedLists& shared = Shared();
+    std::lock_guard<std::mutex> lock(shared.mu);
+    for (int c = 0; c < kClasses; c++) {
+      blocks[c].swap(shared.free[c]);
+      if (local) {
+        blocks[c].insert(blocks[c].end(), local->free[c].begin(),
+                         local->free[c].end());
+        local->free[c].clear();
+      }
+    }
+  }
+  for (int c = 0; c < kClasses; c++) {
+    for (void* p : blocks[c]) {
+      free(p);
+    }
+    cached_bytes.fetch_sub(ClassSize(c) * blocks[c].size(),
+                           std::memory_order_relaxed);
+  }
+}
+
+}  // namespace litecnn
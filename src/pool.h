@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace litecnn {
+
+// Size-bucketed pool of 64-byte aligned blocks, the storage behind Ndarray
+// and the scratch buffers of the layers.
+//
+// Requests are rounded up to one of four size classes per power of two. A
+// freed block goes to a small per-thread cache for its class and spills to a
+// shared list once that is full; allocations look in the same two places
+// before falling back to the system allocator. A training loop that keeps
+// asking for the same shapes therefore stops calling malloc after its first
+// step, which the counters below make visible.
+void* PoolAlloc(size_t bytes);
+
+// Returns a block from PoolAlloc, bytes being the size it was requested with.
+void PoolFree(void* p, size_t bytes);
+
+struct PoolStats {
+  int64_t hits = 0;          // allocations served from a cached block
+  int64_t misses = 0;        // allocations that went to the system
+  int64_t cached_bytes = 0;  // bytes sitting in the free lists
+};
+
+// Counters since the start of the process or the last ResetPoolStats.
+// cached_bytes is never reset.
+PoolStats GetPoolStats();
+
+void ResetPoolStats();
+
+// Hands the blocks cached by the shared lists and the calling thread back to
+// the system.
+void TrimPool();
+
+// Standard allocator on top of PoolAlloc.
+template <typename T>
+class PoolAllocator {
+ public:
+  typedef T value_type;
+
+  PoolAllocator() = default;
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(PoolAlloc(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) { PoolFree(p, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return false;
+}
+
+template <typename T>
+using PooledVector = std::vector<T, PoolAllocator<T>>;
+
+}  // namespace litecnn
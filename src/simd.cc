@@ -0,0 +1,231 @@
+#include "simd.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace litecnn {
+
+namespace {
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LITECNN_X86 1
+#endif
+
+// c = a op b over kBytes-wide vectors with a scalar tail; with kScalar, b
+// points at a single value. Always inlined so that the vector code is
+// generated for the target of the kernel it ends up in.
+template <int kBytes, BinaryOp kOp, bool kScalar, typename T>
+inline __attribute__((always_inline)) void Loop(int64_t n, const T* a,
+                                                const T* b, T* c) {
+  typedef T Vec __attribute__((vector_size(kBytes)));
+  const int64_t kVec = kBytes / sizeof(T);
+  Vec vb = kScalar ? b[0] - Vec{} : Vec{};
+  int64_t i = 0;
+  for (; i + kVec <= n; i += kVec) {
+    Vec va;
+    std::memcpy(&va, a + i, sizeof(Vec));
+    if (!kScalar) {
+      std::memcpy(&vb, b + i, sizeof(Vec));
+    }
+    Vec vc = kOp == BinaryOp::kAdd   ? va + vb
+             : kOp == BinaryOp::kSub ? va - vb
+             : kOp == BinaryOp::kMul ? va * vb
+                                     : va / vb;
+    std::memcpy(c + i, &vc, sizeof(Vec));
+  }
+  for (; i < n; i++) {
+    c[i] = ApplyBinary(kOp, a[i], kScalar ? b[0] : b[i]);
+  }
+}
+
+template <int kBytes, bool kScalar, typename T>
+inline __attribute__((always_inline)) void Switch(BinaryOp op, int64_t n,
+                                                  const T* a, const T* b,
+                                                  T* c) {
+  switch (op) {
+    case BinaryOp::kAdd:
+      return Loop<kBytes, BinaryOp::kAdd, kScalar>(n, a, b, c);
+    case BinaryOp::kSub:
+      return Loop<kBytes, BinaryOp::kSub, kScalar>(n, a, b, c);
+    case BinaryOp::kMul:
+      return Loop<kBytes, BinaryOp::kMul, kScalar>(n, a, b, c);
+    case BinaryOp::kDiv:
+      return Loop<kBytes, BinaryOp::kDiv, kScalar>(n, a, b, c);
+  }
+}
+
+template <bool kScalar, typename T>
+void Generic(BinaryOp op, int64_t n, const T* a, const T* b, T* c) {
+  Switch<16, kScalar>(op, n, a, b, c);
+}
+
+#ifdef LITECNN_X86
+template <bool kScalar, typename T>
+__attribute__((target("avx2"))) void Avx2(BinaryOp op, int64_t n, const T* a,
+                                          const T* b, T* c) {
+  Switch<32, kScalar>(op, n, a, b, c);
+}
+
+template <bool kScalar, typename T>
+__attribute__((target("avx512f"))) void Avx512(BinaryOp op, int64_t n,
+                                               const T* a, const T* b, T* c) {
+  Switch<64, kScalar>(op, n, a, b, c);
+}
+#endif
+
+// Sum or max of a[0:n] over four vectors of accumulators, inlined like Loop.
+template <int kBytes, bool kMax, typename T>
+inline __attribute__((always_inline)) T ReduceLoop(int64_t n, const T* a) {
+  typedef T Vec __attribute__((vector_size(kBytes)));
+  const int64_t kVec = kBytes / sizeof(T);
+  const T init = kMax ? -std::numeric_limits<T>::infinity() : T(0);
+  Vec acc[4];
+  for (int j = 0; j < 4; j++) {
+    acc[j] = init - Vec{};
+  }
+  int64_t i = 0;
+  for (; i + 4 * kVec <= n; i += 4 * kVec) {
+    for (int j = 0; j < 4; j++) {
+      Vec v;
+      std::memcpy(&v, a + i + j * kVec, sizeof(Vec));
+      acc[j] = kMax ? (v > acc[j] ? v : acc[j]) : acc[j] + v;
+    }
+  }
+  for (int j = 1; j < 4; j++) {
+    acc[0] = kMax ? (acc[j] > acc[0] ? acc[j] : acc[0]) : acc[0] + acc[j];
+  }
+  T r = init;
+  for (int64_t l = 0; l < kVec; l++) {
+    r = kMax ? std::max(r, acc[0][l]) : r + acc[0][l];
+  }
+  for (; i < n; i++) {
+    r = kMax ? std::max(r, a[i]) : r + a[i];
+  }
+  return r;
+}
+
+template <bool kMax, typename T>
+T ReduceGeneric(int64_t n, const T* a) {
+  return ReduceLoop<16, kMax>(n, a);
+}
+
+#ifdef LITECNN_X86
+template <bool kMax, typename T>
+__attribute__((target("avx2"))) T ReduceAvx2(int64_t n, const T* a) {
+  return ReduceLoop<32, kMax>(n, a);
+}
+
+template <bool kMax, typename T>
+__attribute__((target("avx512f"))) T ReduceAvx512(int64_t n, const T* a) {
+  return ReduceLoop<64, kMax>(n, a);
+}
+#endif
+
+enum class Isa { kGeneric, kAvx2, kAvx512 };
+
+Isa DetectIsa() {
+#ifdef LITECNN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return Isa::kAvx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return Isa::kAvx2;
+  }
+#endif
+  return Isa::kGeneric;
+}
+
+Isa CurrentIsa() {
+  static const Isa isa = DetectIsa();
+  return isa;
+}
+
+template <bool kScalar, typename T>
+void Dispatch(BinaryOp op, int64_t n, const T* a, const T* b, T* c) {
+  switch (CurrentIsa()) {
+#ifdef LITECNN_X86
+    case Isa::kAvx512:
+      return Avx512<kScalar>(op, n, a, b, c);
+    case Isa::kAvx2:
+      return Avx2<kScalar>(op, n, a, b, c);
+#endif
+    default:
+      return Generic<kScalar>(op, n, a, b, c);
+  }
+}
+
+template <bool kMax, typename T>
+T DispatchReduce(int64_t n, const T* a) {
+  switch (CurrentIsa()) {
+#ifdef LITECNN_X86
+    case Isa::kAvx512:
+      return ReduceAvx512<kMax>(n, a);
+    case Isa::kAvx2:
+      return ReduceAvx2<kMax>(n, a);
+#endif
+    default:
+      return ReduceGeneric<kMax>(n, a);
+  }
+}
+
+}  // namespace
+
+template <typename T>
+void Binary(BinaryOp op, int64_t n, const T* a, const T* b, T* c) {
+  Dispatch<false>(op, n, a, b, c);
+}
+
+template <typename T>
+void BinaryScalar(BinaryOp op, int64_t n, const T* a, T b, T* c) {
+  Dispatch<true>(op, n, a, &b, c);
+}
+
+template <typename T>
+T ReduceSum(int64_t n, const T* a) {
+  return DispatchReduce<false>(n, a);
+}
+
+template <typename T>
+T ReduceMax(int64_t n, const T* a) {
+  return DispatchReduce<true>(n, a);
+}
+
+const char* SimdIsa() {
+  switch (CurrentIsa()) {
+    case Isa::kAvx512:
+      return "avx512";
+    case Isa::kAvx2:
+      return "avx2";
+    default:
+      return "generic";
+  }
+}
+
+int SimdBytes() {
+  switch (CurrentIsa()) {
+    case Isa::kAvx512:
+      return 64;
+    case Isa::kAvx2:
+      return 32;
+    default:
+      return 16;
+  }
+}
+
+template void Binary<float>(BinaryOp op, int64_t n, const float* a,
+                            const float* b, float* c);
+template void Binary<double>(BinaryOp op, int64_t n, const double* a,
+                             const double* b, double* c);
+template void BinaryScalar<float>(BinaryOp op, int64_t n, const float* a,
+                                  float b, float* c);
+template void BinaryScalar<double>(BinaryOp op, int64_t n, const double* a,
+                                   double b, double* c);
+template float ReduceSum<float>(int64_t n, const float* a);
+template double ReduceSum<double>(int64_t n, const double* a);
+template float ReduceMax<float>(int64_t n, const float* a);
+template double ReduceMax<double>(int64_t n, const double* a);
+
+}  // namespace litecnn
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+namespace litecnn {
+
+enum class BinaryOp { kAdd, kSub, kMul, kDiv };
+
+// a op b for a single element, used by the strided fallbacks.
+template <typename T>
+inline T ApplyBinary(BinaryOp op, T a, T b) {
+  switch (op) {
+    case BinaryOp::kAdd:
+      return a + b;
+    case BinaryOp::kSub:
+      return a - b;
+    case BinaryOp::kMul:
+      return a * b;
+    case BinaryOp::kDiv:
+      return a / b;
+  }
+  return 0;
+}
+
+// The kernels below are compiled for AVX-512, AVX2 and a 16-byte baseline;
+// the widest set the CPU supports is picked on first use. All of them are
+// instantiated for float and double.
+
+// c[i] = a[i] op b[i] for i < n. c may be a or b, but no other overlap.
+template <typename T>
+void Binary(BinaryOp op, int64_t n, const T* a, const T* b, T* c);
+
+// c[i] = a[i] op b for i < n. c may be a.
+template <typename T>
+void BinaryScalar(BinaryOp op, int64_t n, const T* a, T b, T* c);
+
+// Sum of a[0:n], accumulated over several vectors of lanes.
+template <typename T>
+T ReduceSum(int64_t n, const T* a);
+
+// Largest element of a[0:n], -inf when n is 0.
+template <typename T>
+T ReduceMax(int64_t n, const T* a);
+
+// Name of the kernel set in use: "avx512", "avx2" or "generic".
+const char* SimdIsa();
+
+// Vector width of that kernel set in bytes: 64, 32 or 16.
+int SimdBytes();
+
+}  // namespace litecnn
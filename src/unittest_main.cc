@@ -1,16 +1,35 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <functional>
 #include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
+#include "blocked.h"
 #include "cnn.h"
+#include "expr.h"
+#include "gemm.h"
+#include "graph.h"
 #include "layers.h"
 #include "loss.h"
 #include "ndarray.h"
+#include "optimizer.h"
+#include "parallel.h"
+#include "param_server.h"
+#include "pool.h"
+#include "simd.h"
 
 namespace litecnn {
 
-Ndarray NumericGrad(std::function<double()> func, Ndarray x, double h) {
+Ndarray<double> NumericGrad(std::function<double()> func, Ndarray<double> x,
+                            double h) {
   auto dx = x.as_zeros();
   for (int64_t i0 = 0; i0 < x.shape(0); i0++) {
     for (int64_t i1 = 0; i1 < x.shape(1); i1++) {
@@ -30,7 +49,7 @@ Ndarray NumericGrad(std::function<double()> func, Ndarray x, double h) {
 }
 
 void TestNdarray() {
-  Ndarray m(3, 6);
+  Ndarray<double> m(3, 6);
   auto& data = *m.data();
   assert(m.ndim() == 2);
   assert(m.shape(0) == 3);
@@ -42,7 +61,7 @@ void TestNdarray() {
       m.at(i, j) = i + j;
     }
   }
-  std::vector<double> expected{
+  Ndarray<double>::Buffer expected{
       0, 1, 2, 3, 4, 5,  //
       1, 2, 3, 4, 5, 6,  //
       2, 3, 4, 5, 6, 7,  //
@@ -52,7 +71,7 @@ void TestNdarray() {
   assert(std::vector<int64_t>{6} == m.sum(0).shape());
   assert(std::vector<int64_t>{3} == m.sum(1).shape());
 
-  Ndarray msqr = m * m;
+  Ndarray<double> msqr = m * m;
   assert(msqr == m.pow(2));
   assert(m == msqr.pow(.5));
 
@@ -94,22 +113,22 @@ void TestNdarray() {
   }
 
   // clang-format off
-  Ndarray a({2, 3},
-            {
-                1, 2, 3,
-                4, 5, 6,
-            });
-  Ndarray b({3, 2},
-            {
-                7, 8,
-                9, 10,
-                11, 12,
-            });
-  Ndarray c({2, 2},
-            {
-                58, 64,
-                139, 154,
-            });
+  Ndarray<double> a({2, 3},
+                    {
+                        1, 2, 3,
+                        4, 5, 6,
+                    });
+  Ndarray<double> b({3, 2},
+                    {
+                        7, 8,
+                        9, 10,
+                        11, 12,
+                    });
+  Ndarray<double> c({2, 2},
+                    {
+                        58, 64,
+                        139, 154,
+                    });
   // clang-format on
   assert(a.dot(b) == c);
 
@@ -132,20 +151,619 @@ void TestNdarray() {
 
   a = a.reshape(2, 1, 3);
   b = b.reshape(1, 2, 3);
-  c = Ndarray({2, 2, 3}, {8, 10, 12, 11, 13, 15, 11, 13, 15, 14, 16, 18});
+  c = Ndarray<double>({2, 2, 3},
+                      {8, 10, 12, 11, 13, 15, 11, 13, 15, 14, 16, 18});
   assert(a + b == c);
   b = b.reshape(2, 3);
   assert(a + b == c);
-  auto d = Ndarray({2, 2, 3}, {-6, -6, -6, -9, -9, -9, -3, -3, -3, -6, -6, -6});
+  auto d = Ndarray<double>(
+      {2, 2, 3}, {-6, -6, -6, -9, -9, -9, -3, -3, -3, -6, -6, -6});
   assert(a - b == d);
 
   auto z = a.as_zeros();
-  assert(z == Ndarray({2, 1, 3}, {0, 0, 0, 0, 0, 0}));
+  assert(z == Ndarray<double>({2, 1, 3}, {0, 0, 0, 0, 0, 0}));
 
   auto s = a.reshape(3, 2).slice(1, 2);
-  assert(s == Ndarray({2, 2}, {3, 4, 5, 6}));
+  assert(s == Ndarray<double>({2, 2}, {3, 4, 5, 6}));
   auto ss = s.slice(1, 1);
-  assert(ss == Ndarray({1, 2}, {5, 6}));
+  assert(ss == Ndarray<double>({1, 2}, {5, 6}));
+  assert(s.reshape(-1) == Ndarray<double>({4}, {3, 4, 5, 6}));
+  assert(s.T().slice(1, 1) == Ndarray<double>({1, 2}, {4, 6}));
+
+  // ranks above 4
+  Ndarray<double> v({2, 3, 1, 2, 5}, nullptr);
+  assert(v.ndim() == 5);
+  assert(v.size() == 60);
+  for (int64_t i = 0; i < v.size(); i++) {
+    (*v.data())[i] = i;
+  }
+  assert(v.at({1, 2, 0, 1, 4}) == 59);
+  assert(v.slice(1, 1).at({0, 0, 0, 0, 1}) == 31);
+  auto vt = v.T();
+  assert((vt.shape() == std::vector<int64_t>{5, 2, 1, 3, 2}));
+  assert(vt.at({4, 1, 0, 2, 1}) == 59);
+  auto vc = vt.contiguous();
+  assert(vc.is_contiguous() && vc == vt);
+  assert(vc.T() == v);
+  auto v0 = v.sum(0);
+  assert((v0.shape() == std::vector<int64_t>{3, 1, 2, 5}));
+  assert(v0.at(2, 0, 1, 4) == 29 + 59);
+  auto v4 = v.sum(-1);
+  assert(v4.at({1, 2, 0, 1}) == 55 + 56 + 57 + 58 + 59);
+  Ndarray<double> row({5}, {0, 1, 2, 3, 4});
+  Ndarray<double> lead({2, 1, 1, 1, 1}, {100, 200});
+  auto vb = v * 2 - row + lead;
+  assert(vb.at({1, 2, 0, 1, 4}) == 59 * 2 - 4 + 200);
+  // the same broadcast through the strided loop
+  assert((vc.T() * 2 - row + lead) == vb);
+  assert(v.reshape({6, 10}).at(5, 9) == 59);
+  Ndarray<double> w8({2, 1, 2, 1, 2, 1, 2, 3}, nullptr);
+  assert(w8.ndim() == 8);
+  assert((w8 + 1).sum() == 48);
+}
+
+void TestGemm() {
+  // odd sizes exercise the partial micro tiles and multiple cache blocks
+  int64_t m = 77, n = 301, k = 263;
+  Ndarray<double> a(m, k);
+  Ndarray<double> b(k, n);
+  a.gaussian(1);
+  b.gaussian(1);
+  Ndarray<double> expected(m, n);
+  for (int64_t i = 0; i < m; i++) {
+    for (int64_t j = 0; j < n; j++) {
+      for (int64_t p = 0; p < k; p++) {
+        expected.at(i, j) += a.at(i, p) * b.at(p, j);
+      }
+    }
+  }
+  int default_threads = NumThreads();
+  for (int threads : {1, 3}) {
+    SetNumThreads(threads);
+    auto c = a.dot(b);
+    assert((c - expected).max() < 1e-9);
+    assert((expected - c).max() < 1e-9);
+    // transposed views are consumed through their strides
+    auto ct = b.T().dot(a.T());
+    assert((ct.T() - expected).max() < 1e-9);
+    assert((expected - ct.T()).max() < 1e-9);
+  }
+  SetNumThreads(default_threads);
+
+  // beta accumulates into C, beta == 0 ignores whatever C holds
+  Ndarray<double> c({2, 2}, {1, 1, 1, 1});
+  Ndarray<double> x({2, 2}, {1, 2, 3, 4});
+  Gemm(2, 2, 2, 2.0, x.data()->data(), 2, 1, x.data()->data(), 2, 1, 1.0,
+       c.data()->data(), 2, 1);
+  assert(c == Ndarray<double>({2, 2}, {15, 21, 31, 45}));
+  c.at(0, 0) = std::nan("");
+  Gemm(2, 2, 2, 1.0, x.data()->data(), 1, 2, x.data()->data(), 2, 1, 0.0,
+       c.data()->data(), 2, 1);
+  assert(c == Ndarray<double>({2, 2}, {10, 14, 14, 20}));
+}
+
+template <typename T>
+void TestBinopType() {
+  // 37 columns leave a scalar tail after every vector width
+  Ndarray<T> a(2, 5, 37);
+  Ndarray<T> b(2, 5, 37);
+  a.gaussian(1);
+  b.gaussian(2);
+  b += T(3);  // keep the divisor away from 0
+  Ndarray<T> bias2(5, 37);
+  Ndarray<T> bias(37);
+  bias2.gaussian(1);
+  bias.gaussian(1);
+  bias2 += T(3);
+  bias += T(3);
+  for (auto op :
+       {BinaryOp::kAdd, BinaryOp::kSub, BinaryOp::kMul, BinaryOp::kDiv}) {
+    auto binop = [op](const Ndarray<T>& x, const Ndarray<T>& y) {
+      switch (op) {
+        case BinaryOp::kAdd:
+          return x + y;
+        case BinaryOp::kSub:
+          return x - y;
+        case BinaryOp::kMul:
+          return x * y;
+        default:
+          return x / y;
+      }
+    };
+    auto check = [&](const Ndarray<T>& c, const Ndarray<T>& y) {
+      assert(c.shape() == a.shape());
+      for (int64_t i = 0; i < 2; i++) {
+        for (int64_t j = 0; j < 5; j++) {
+          for (int64_t k = 0; k < 37; k++) {
+            T yv = y.ndim() == 1   ? y.at(k)
+                   : y.ndim() == 2 ? y.at(j, k)
+                                   : y.at(i % y.shape(0), j, k);
+            assert(c.at(i, j, k) == ApplyBinary(op, a.at(i, j, k), yv));
+          }
+        }
+      }
+    };
+    check(binop(a, b), b);
+    // bias add style broadcasts along the leading dimensions
+    auto row = b.slice(1, 1);
+    check(binop(a, row), row);
+    check(binop(a, bias2), bias2);
+    check(binop(a, bias), bias);
+    // strided views take the generic loop and must agree
+    check(binop(a.T(), b.T()).T(), b);
+    // in place keeps writing into the same buffer
+    auto a2 = a.fork();
+    switch (op) {
+      case BinaryOp::kAdd:
+        a2 += b;
+        break;
+      case BinaryOp::kSub:
+        a2 -= b;
+        break;
+      case BinaryOp::kMul:
+        a2 *= b;
+        break;
+      default:
+        a2 /= b;
+    }
+    check(a2, b);
+  }
+  // a scalar operand only touches the view
+  Ndarray<T> m({3, 2}, {1, 2, 3, 4, 5, 6});
+  auto s = m.slice(1, 1);
+  s *= T(10);
+  assert(m == Ndarray<T>({3, 2}, {1, 2, 30, 40, 5, 6}));
+  assert(m.slice(1, 2) + T(1) == Ndarray<T>({2, 2}, {31, 41, 6, 7}));
+  assert(m + Ndarray<T>() == m);
+}
+
+void TestBinop() {
+  std::cout << "simd kernels: " << SimdIsa() << std::endl;
+  TestBinopType<float>();
+  TestBinopType<double>();
+}
+
+void TestExpr() {
+  // large enough to be split into several blocks
+  int64_t n = 50000;
+  Ndarray<double> a(n);
+  Ndarray<double> b(n);
+  Ndarray<double> c(n);
+  a.gaussian(1);
+  b.gaussian(1);
+  c.gaussian(1);
+  c = c * c + 1;
+  auto expected = (a - b * 3) / c.pow(.5) + a * a;
+  int default_threads = NumThreads();
+  for (int threads : {1, 3}) {
+    SetNumThreads(threads);
+    auto e = Eval((Lazy(a) - Lazy(b) * 3.0) / Sqrt(Lazy(c)) + Square(Lazy(a)));
+    assert((e - expected).max() < 1e-12);
+    assert((expected - e).max() < 1e-12);
+  }
+  SetNumThreads(default_threads);
+  assert(Eval(2.0 - Lazy(a)) == (a * -1) + 2);
+  assert(Eval(1.0 / Lazy(c)) == (c * 0 + 1) / c);
+  assert(std::abs(Sum(Square(Lazy(a))) - (a * a).sum()) < 1e-9);
+
+  // the output may be a leaf, every element only depends on its own index.
+  // Fused loops may contract a * b + c into one rounding, hence no ==.
+  auto x = a.fork();
+  Assign(Lazy(x) + Square(Lazy(b)), &x);
+  assert((x - (a + b * b)).max() < 1e-12);
+  assert(((a + b * b) - x).max() < 1e-12);
+  auto m = Ndarray<double>({2, 3}, {1, 2, 3, 4, 5, 6});
+  Assign(Lazy(m) * Lazy(m) - 1.0, &m);
+  assert(m == Ndarray<double>({2, 3}, {0, 3, 8, 15, 24, 35}));
+}
+
+void TestPool() {
+  for (int64_t n : {1, 7, 64, 1000, 123457}) {
+    Ndarray<float> a(n);
+    assert(reinterpret_cast<uintptr_t>(a.ptr()) % 64 == 0);
+  }
+  // a freed block is handed out again for any request of its size class
+  void* p = PoolAlloc(1000);
+  PoolFree(p, 1000);
+  ResetPoolStats();
+  void* q = PoolAlloc(1010);
+  assert(q == p);
+  assert(GetPoolStats().hits == 1);
+  assert(GetPoolStats().misses == 0);
+  PoolFree(q, 1010);
+
+  // after one step, training only recycles buffers
+  SimpleConvNet<float>::Config config;
+  config.input_height = 12;
+  config.input_width = 12;
+  config.input_depth = 2;
+  config.n_filters = 4;
+  config.filter_size = 3;
+  config.hidden_dim = 10;
+  config.weight_scale = 1e-2;
+  config.n_classes = 10;
+  config.reg = 0.1;
+  SimpleConvNet<float> cnn(config);
+  Ndarray<float> x(8, 2, 12, 12);
+  x.gaussian(1);
+  int64_t y[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+  cnn.train(x, y, x, y, 1, 4, 1e-2, 0, 0);
+  ResetPoolStats();
+  cnn.train(x, y, x, y, 1, 4, 1e-2, 0, 0);
+  PoolStats stats = GetPoolStats();
+  std::cout << "pool hits:" << stats.hits << " misses:" << stats.misses
+            << std::endl;
+  assert(stats.hits > 0);
+  assert(stats.misses == 0);
+
+  // trimming empties the shared lists and this thread's cache
+  TrimPool();
+  ResetPoolStats();
+  PoolFree(PoolAlloc(1000), 1000);
+  assert(GetPoolStats().misses == 1);
+}
+
+void TestReduce() {
+  // odd sizes leave tails after the vector loops
+  Ndarray<double> x(3, 5, 7, 11);
+  x.gaussian(1);
+  for (auto dims : std::vector<std::vector<int64_t>>{
+           {0}, {3}, {1, 2}, {0, 2, 3}, {-1, 0}, {0, 1, 2, 3}, {}}) {
+    auto r = x.sum(dims);
+    bool summed[4] = {};
+    for (int64_t d : dims) {
+      summed[d < 0 ? d + 4 : d] = true;
+    }
+    Ndarray<double> expected(summed[0] ? 1 : 3, summed[1] ? 1 : 5,
+                             summed[2] ? 1 : 7, summed[3] ? 1 : 11);
+    for (int64_t i0 = 0; i0 < 3; i0++) {
+      for (int64_t i1 = 0; i1 < 5; i1++) {
+        for (int64_t i2 = 0; i2 < 7; i2++) {
+          for (int64_t i3 = 0; i3 < 11; i3++) {
+            expected.at(summed[0] ? 0 : i0, summed[1] ? 0 : i1,
+                        summed[2] ? 0 : i2, summed[3] ? 0 : i3) +=
+                x.at(i0, i1, i2, i3);
+          }
+        }
+      }
+    }
+    assert(r.size() == expected.size());
+    assert(r.ndim() == 4 - std::count(summed, summed + 4, true));
+    for (int64_t i = 0; i < r.size(); i++) {
+      assert(std::abs((*r.data())[i] - (*expected.data())[i]) < 1e-12);
+    }
+  }
+
+  // large inputs are split over the pool, the split does not change results
+  Ndarray<float> big(64, 33, 40);
+  big.gaussian(1);
+  int default_threads = NumThreads();
+  SetNumThreads(1);
+  auto b0 = big.sum({0, 2});
+  auto b1 = big.sum({1});
+  float s = big.sum();
+  float m = big.max();
+  SetNumThreads(3);
+  assert(big.sum({0, 2}) == b0);
+  assert(big.sum({1}) == b1);
+  assert(big.sum() == s);
+  assert(big.max() == m);
+  SetNumThreads(default_threads);
+  double total = 0;
+  float largest = -INFINITY;
+  for (float v : *big.data()) {
+    total += v;
+    largest = std::max(largest, v);
+  }
+  assert(std::abs(s - total) < 1e-2);
+  assert(m == largest);
+
+  // views only reduce their own elements
+  Ndarray<double> v({3, 2}, {-5, -4, -3, -2, -1, -6});
+  assert(v.slice(1, 1).sum() == -5);
+  assert(v.slice(0, 2).max() == -2);
+  assert(v.T().sum(1) == Ndarray<double>({2}, {-9, -12}));
+}
+
+void TestParallel() {
+  int default_threads = NumThreads();
+  SetNumThreads(4);
+  // every index once, in at most NumThreads() chunks or in grain-sized ones
+  for (int64_t grain : {0, 1, 7, 1000}) {
+    std::vector<std::atomic<int>> seen(100);
+    std::atomic<int> chunks{0};
+    ParallelFor(
+        0, 100,
+        [&](int64_t begin, int64_t end) {
+          chunks++;
+          for (int64_t i = begin; i < end; i++) {
+            seen[i]++;
+          }
+        },
+        grain);
+    for (auto& v : seen) {
+      assert(v == 1);
+    }
+    assert(chunks == (grain == 0 ? 4 : (100 + grain - 1) / grain));
+  }
+
+  // calls from inside chunks are split as well
+  std::vector<std::atomic<int>> seen(4 * 1000);
+  std::atomic<int> chunks{0};
+  ParallelFor(0, 4, [&](int64_t begin, int64_t end) {
+    for (int64_t o = begin; o < end; o++) {
+      ParallelFor(0, 1000, [&](int64_t b, int64_t e) {
+        chunks++;
+        for (int64_t i = b; i < e; i++) {
+          seen[o * 1000 + i]++;
+        }
+      });
+    }
+  });
+  for (auto& v : seen) {
+    assert(v == 1);
+  }
+  assert(chunks == 4 * 4);
+
+  // the softmax loss splits large batches over rows, to the same result
+  Ndarray<double> x({5000, 3}, nullptr);
+  x.gaussian(1);
+  std::vector<int64_t> y(5000);
+  for (int64_t i = 0; i < 5000; i++) {
+    y[i] = i % 3;
+  }
+  Ndarray<double> dx4({5000, 3}, nullptr);
+  double loss4 = SoftmaxLoss(x, y.data(), &dx4);
+  SetNumThreads(1);
+  Ndarray<double> dx1({5000, 3}, nullptr);
+  assert(SoftmaxLoss(x, y.data(), &dx1) == loss4);
+  assert(dx1 == dx4);
+  SetNumThreads(default_threads);
+}
+
+void TestMappedFile() {
+  const char* path = "unittest_mapped.lcnn";
+  Ndarray<double> x(4, 3, 5);
+  x.gaussian(1);
+  x.save(path);
+
+  Ndarray<double> m(path, MapMode::kReadOnly);
+  assert(m.data() == nullptr);
+  assert(m.is_read_only());
+  assert(m.shape() == x.shape());
+  assert(m == x);
+  assert(reinterpret_cast<uintptr_t>(m.ptr()) % 64 == 0);
+  // slices and reshapes view the mapping
+  auto s = m.slice(1, 2);
+  assert(s.ptr() == m.ptr() + 15);
+  assert(s == x.slice(1, 2));
+  assert(s.reshape(-1).ptr() == s.ptr());
+  assert(s.sum() == x.slice(1, 2).sum());
+  // results land on the heap
+  auto y = m * 2.0;
+  assert(y.data() != nullptr);
+  assert(y == x * 2.0);
+  auto f = m.fork();
+  f += 1.0;
+  assert(f == x + 1.0);
+
+  // a view saves only its elements
+  x.T().save(path);
+  Ndarray<double> t(path, MapMode::kCopyOnWrite);
+  assert(t == x.T());
+  assert(!t.is_read_only());
+  // writes stay private to the mapping
+  t *= 0.0;
+  assert(t.sum() == 0);
+  assert(Ndarray<double>(path, MapMode::kReadOnly) == x.T());
+
+  // the element type has to match
+  Ndarray<float> xf(2, 8);
+  xf.gaussian(1);
+  xf.save(path);
+  assert(Ndarray<float>(path, MapMode::kReadOnly) == xf);
+
+  // and bad files throw instead of being read past their end
+  auto throws = [path]() {
+    try {
+      Ndarray<float>(path, MapMode::kReadOnly);
+    } catch (const std::runtime_error& e) {
+      std::cout << e.what() << std::endl;
+      return true;
+    }
+    return false;
+  };
+  x.save(path);
+  assert(throws());  // doubles
+  xf.save(path);
+  int err = truncate(path, 128 + 15 * sizeof(float));  // 16 elements
+  assert(err == 0 && throws());
+  err = truncate(path, 0);
+  assert(err == 0 && throws());
+  std::remove(path);
+  assert(throws());
+}
+
+void TestInto() {
+  Ndarray<double> a({2, 3}, {1, 2, 3, 4, 5, 6});
+  Ndarray<double> b({3, 2}, {1, -1, 2, 0, 0, 3});
+  Ndarray<double> out;
+  a.dot_into(b, &out);
+  assert(out == a.dot(b));
+  // the buffer is kept once the shape fits, beta accumulates
+  const double* p = out.ptr();
+  a.dot_into(b, &out, 1);
+  assert(out.ptr() == p);
+  assert(out == a.dot(b) * 2.0);
+  a.dot_into(b, &out, 0.5);
+  assert(out == a.dot(b) * 2.0);
+  // a view or another shape gets a new buffer, the old one is left alone
+  Ndarray<double> t = out.T();
+  a.dot_into(b, &t);
+  assert(t.ptr() != p);
+  assert(out == a.dot(b) * 2.0);
+  Ndarray<double> v({3}, {1, 2, 3});
+  Ndarray<double> vout(1);
+  vout.fill(NAN);
+  v.dot_into(v, &vout);
+  assert(vout.at(0) == 14);
+
+  Ndarray<double> sum;
+  a.sum_into({0}, &sum);
+  assert(sum == Ndarray<double>({3}, {5, 7, 9}));
+  a.sum_into({0}, &sum, 1);
+  assert(sum == Ndarray<double>({3}, {10, 14, 18}));
+  a.sum_into({0, 1}, &sum, 1);
+  assert(sum.ndim() == 0 && sum.at() == 21);
+  sum.fill(NAN);
+  a.sum_into({}, &sum);
+  assert(sum == a);
+
+  Ndarray<double> sq = a.fork();
+  sq.pow_into(2, &sq);
+  assert(sq == a * a);
+
+  // the layers write into the arrays they are given
+  typedef Conv<double>::Algo Algo;
+  for (auto algo : {Algo::kDirect, Algo::kIm2col, Algo::kWinograd2,
+                    Algo::kFft}) {
+    Conv<double> conv(3, 3, 2, 4, 1, 1, 1, algo);
+    Ndarray<double> x(2, 2, 6, 6);
+    x.gaussian(1);
+    Ndarray<double> y(2, 4, 6, 6);
+    const double* yp = y.ptr();
+    conv.forward_into(x, &y);
+    assert(y.ptr() == yp);
+    assert(y == conv.forward(x));
+    Ndarray<double> dout = y.as_zeros();
+    dout.gaussian(1);
+    Ndarray<double> dx = conv.backward(dout);
+    Ndarray<double> dw = conv.dw_.fork();
+    Ndarray<double> db = conv.db_.fork();
+    Ndarray<double> dx2;
+    conv.backward_into(dout, &dx2);
+    assert((dx2 - dx).max() < 1e-12 && (dx - dx2).max() < 1e-12);
+    // gradients accumulate with beta 1 and the input gradient can be skipped
+    conv.backward_into(dout, nullptr, 1);
+    assert(((conv.dw_ - dw * 2.0).pow(2)).max() < 1e-20);
+    assert(((conv.db_ - db * 2.0).pow(2)).max() < 1e-20);
+  }
+  Affine<double> affine(5, 3, 1);
+  Ndarray<double> ax(4, 5);
+  ax.gaussian(1);
+  Ndarray<double> ad(4, 3);
+  ad.gaussian(1);
+  affine.forward(ax);
+  Ndarray<double> adx = affine.backward(ad);
+  Ndarray<double> adw = affine.dw_.fork();
+  Ndarray<double> adx2;
+  affine.backward_into(ad, &adx2, 1);
+  assert(adx2 == adx);
+  assert(affine.dw_ == adw * 2.0);
+
+  // one training step reuses the buffers of the last
+  SimpleConvNet<double>::Config config;
+  config.input_height = 8;
+  config.input_width = 8;
+  config.input_depth = 1;
+  config.n_filters = 2;
+  config.filter_size = 3;
+  config.hidden_dim = 6;
+  config.weight_scale = 1e-1;
+  config.n_classes = 3;
+  config.reg = 0.1;
+  SimpleConvNet<double> cnn(config);
+  Ndarray<double> cx(5, 1, 8, 8);
+  cx.gaussian(1);
+  int64_t cy[5] = {0, 1, 2, 1, 0};
+  double l0 = cnn.loss(cx, cy);
+  Ndarray<double> cdw = cnn.conv_.dw_.fork();
+  const double* cdwp = cnn.conv_.dw_.ptr();
+  assert(cnn.loss(cx, cy) == l0);
+  assert(cnn.conv_.dw_.ptr() == cdwp);
+  assert(cnn.conv_.dw_ == cdw);
+}
+
+void TestBlocked() {
+  int64_t c = ChannelBlock<double>();
+  Ndarray<double> x(2, c + 3, 5, 6);
+  x.gaussian(1);
+  Ndarray<double> xb = x.to_blocked(c);
+  assert(xb.shape() == std::vector<int64_t>({2, 2, 5, 6, c}));
+  assert(xb.at({1, 1, 4, 5, 2}) == x.at(1, c + 2, 4, 5));
+  assert(xb.at({1, 1, 4, 5, 3}) == 0);
+  assert(xb.from_blocked(c + 3) == x);
+  assert(x.to_blocked(1).ptr() == x.ptr());
+  assert(x.to_blocked(1).from_blocked(c + 3) == x);
+
+  struct Case {
+    int64_t fh, fw, fc, fn, s, p, H, W;
+  };
+  for (Case k : std::vector<Case>{{3, 3, 1, 4, 1, 1, 6, 7},
+                                  {5, 5, 3, 10, 1, 2, 28, 28},
+                                  {3, 2, c, c + 1, 2, 0, 7, 6},
+                                  {4, 3, 2 * c, 3, 3, 2, 10, 9},
+                                  {1, 1, c + 1, 2 * c, 1, 0, 3, 17}}) {
+    Conv<double> conv(k.fh, k.fw, k.fc, k.fn, k.s, k.p, 1);
+    conv.b_.gaussian(1);
+    Ndarray<double> in(3, k.fc, k.H, k.W);
+    in.gaussian(1);
+    auto expected = conv.forward(in);
+    for (int64_t ci : {int64_t(1), c}) {
+      Ndarray<double> out;
+      conv.forward_blocked(in.to_blocked(ci), &out);
+      auto diff = out.from_blocked(k.fn) - expected;
+      assert(diff.max() < 1e-9 && (diff * -1.0).max() < 1e-9);
+    }
+  }
+
+  for (int64_t s : {2, 3}) {
+    MaxPool<double> pool(s, s, 2);
+    Ndarray<double> in(2, c + 1, 7, 9);
+    in.gaussian(1);
+    Ndarray<double> out;
+    pool.forward_blocked(in.to_blocked(c), &out);
+    assert(out.from_blocked(c + 1) == pool.forward(in));
+  }
+
+  // the fused kernel matches its three steps, overlapping windows included
+  for (Case k : std::vector<Case>{{3, 3, 1, 4, 1, 1, 9, 7},
+                                  {3, 2, c, c + 1, 2, 0, 11, 12}}) {
+    Conv<double> conv(k.fh, k.fw, k.fc, k.fn, k.s, k.p, 1);
+    conv.b_.gaussian(1);
+    Ndarray<double> in(2, k.fc, k.H, k.W);
+    in.gaussian(1);
+    for (int64_t ph : {2, 3}) {
+      MaxPool<double> pool(ph, ph, 2);
+      Relu<double> relu;
+      auto expected = pool.forward(relu.forward(conv.forward(in)));
+      for (int64_t ci : {int64_t(1), c}) {
+        Ndarray<double> out;
+        conv.forward_relu_pool_blocked(in.to_blocked(ci), pool, &out);
+        auto diff = out.from_blocked(k.fn) - expected;
+        assert(diff.max() < 1e-9 && (diff * -1.0).max() < 1e-9);
+      }
+    }
+  }
+
+  // the blocked inference pass scores like the plain layers
+  SimpleConvNet<double>::Config config;
+  config.input_height = 12;
+  config.input_width = 10;
+  config.input_depth = 3;
+  config.n_filters = 5;
+  config.filter_size = 3;
+  config.hidden_dim = 7;
+  config.weight_scale = 1e-1;
+  config.n_classes = 4;
+  SimpleConvNet<double> cnn(config);
+  Ndarray<double> in(4, 3, 12, 10);
+  in.gaussian(1);
+  auto plain = cnn.pool_.forward(cnn.relu_.forward(cnn.conv_.forward(in)));
+  auto scores = cnn.affine2_.forward(cnn.relu2_.forward(
+      cnn.affine_.forward(plain.reshape(plain.shape(0), -1))));
+  auto diff = cnn.forward(in) - scores;
+  assert(diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12);
 }
 
 void TestLayers() {
@@ -158,8 +776,8 @@ void TestLayers() {
     auto diff = grad - grad2;                                                  \
     std::cout << "max " #layer " diff " #grad ": " << diff.max() << std::endl; \
   } while (0)
-  Affine affine(3, 4, 1e-3);
-  Ndarray x(2, 3);
+  Affine<double> affine(3, 4, 1e-3);
+  Ndarray<double> x(2, 3);
   x.gaussian(1);
   auto out = affine.forward(x);
   assert(out.shape(0) == 2);
@@ -172,41 +790,75 @@ void TestLayers() {
   TEST_LAYER(affine, affine.w_, affine.dw_);
   TEST_LAYER(affine, affine.b_, affine.db_);
 
-  Relu relu;
-  x = Ndarray({2, 2}, {-1, 1, 0, 2});
+  Relu<double> relu;
+  x = Ndarray<double>({2, 2}, {-1, 1, 0, 2});
   out = relu.forward(x);
-  assert(out == Ndarray({2, 2}, {0, 1, 0, 2}));
-  dout = Ndarray({2, 2}, {5, 6, 7, 8});
+  assert(out == Ndarray<double>({2, 2}, {0, 1, 0, 2}));
+  dout = Ndarray<double>({2, 2}, {5, 6, 7, 8});
   dx = relu.backward(dout);
-  assert(dx == Ndarray({2, 2}, {0, 6, 0, 8}));
+  assert(dx == Ndarray<double>({2, 2}, {0, 6, 0, 8}));
   TEST_LAYER(relu, x, dx);
+  // in place, across mask words and a partial last one
+  x = Ndarray<double>(3, 67);
+  x.gaussian(1);
+  Ndarray<double> xr = x.fork();
+  relu.forward_into(xr, &xr);
+  dout = x.as_zeros();
+  dout.gaussian(1);
+  Ndarray<double> dr = dout.fork();
+  relu.backward_into(dr, &dr);
+  for (int64_t i = 0; i < 3; i++) {
+    for (int64_t j = 0; j < 67; j++) {
+      bool keep = x.at(i, j) > 0;
+      assert(xr.at(i, j) == (keep ? x.at(i, j) : 0));
+      assert(dr.at(i, j) == (keep ? dout.at(i, j) : 0));
+    }
+  }
 
-  MaxPool pool1(2, 2, 2);
-  x = Ndarray({3, 3}, {1, 2, 3, 4, 5, 6, 7, 8, 9});
+  MaxPool<double> pool1(2, 2, 2);
+  x = Ndarray<double>({3, 3}, {1, 2, 3, 4, 5, 6, 7, 8, 9});
   out = pool1.forward(x);
-  assert(out == Ndarray({2, 2}, {5, 6, 8, 9}));
+  assert(out == Ndarray<double>({2, 2}, {5, 6, 8, 9}));
   dout = out.as_zeros();
   dout.gaussian(2);
   dx = pool1.backward(dout);
   TEST_LAYER(pool1, x, dx);
 
-  MaxPool poo2(2, 2, 2);
-  x = Ndarray({2, 3, 3},
-              {1, 2, 3, 4, 5, 6, 7, 8, 9, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+  MaxPool<double> poo2(2, 2, 2);
+  x = Ndarray<double>({2, 3, 3},
+                      {1, 2, 3, 4, 5, 6, 7, 8, 9, 1, 2, 3, 4, 5, 6, 7, 8, 9});
   out = poo2.forward(x);
-  assert(out == Ndarray({2, 2, 2}, {5, 6, 8, 9, 5, 6, 8, 9}));
+  assert(out == Ndarray<double>({2, 2, 2}, {5, 6, 8, 9, 5, 6, 8, 9}));
   dx = poo2.backward(out);
-  assert(dx == Ndarray({2, 3, 3},
-                       {0, 0, 0, 0, 5, 6, 0, 8, 9, 0, 0, 0, 0, 5, 6, 0, 8, 9}));
-
-  Conv conv(3,   // fh
-            3,   // fw
-            1,   // fc
-            6,   // fn
-            1,   // stride
-            1,   // pad
-            1);  // scale
-  x = Ndarray(
+  assert(dx ==
+         Ndarray<double>({2, 3, 3}, {0, 0, 0, 0, 5, 6, 0, 8, 9, 0, 0, 0, 0, 5,
+                                     6, 0, 8, 9}));
+
+  // ties send the whole gradient to the first maximum of the window
+  MaxPool<double> pool3(2, 3, 2);
+  x = Ndarray<double>({1, 2, 4, 5}, {3, 1, 3, 0, 2, 1, 3, 2, 4, 4,  //
+                                     3, 3, 0, 0, 1, 0, 7, 7, 7, 7,  //
+                                     0, 1, 0, 1, 0, 1, 0, 1, 0, 1,  //
+                                     9, 9, 9, 9, 9, 9, 9, 9, 9, 9});
+  out = pool3.forward(x);
+  assert(out == Ndarray<double>({1, 2, 2, 3},
+                                {3, 4, 4, 7, 7, 7, 1, 1, 1, 9, 9, 9}));
+  dout = Ndarray<double>({1, 2, 2, 3}, {1, 2, 3, 4, 5, 6, 1, 2, 3, 4, 5, 6});
+  dx = pool3.backward(dout);
+  assert(dx == Ndarray<double>({1, 2, 4, 5},
+                               {1, 0, 0, 0, 0, 0, 0, 0, 2, 3,  //
+                                0, 0, 0, 0, 0, 0, 4, 5, 0, 6,  //
+                                0, 1, 0, 2, 0, 0, 0, 0, 0, 3,  //
+                                4, 0, 5, 0, 6, 0, 0, 0, 0, 0}));
+
+  Conv<double> conv(3,   // fh
+                    3,   // fw
+                    1,   // fc
+                    6,   // fn
+                    1,   // stride
+                    1,   // pad
+                    1);  // scale
+  x = Ndarray<double>(
       {2, 1, 4, 5},
       {
           0.11539938, 0.49015755, 0.24796755, 0.18262233, 0.8828635,  // #1
@@ -230,8 +882,248 @@ void TestLayers() {
 #undef TEST_LAYER
 }
 
+void TestBatchNorm() {
+  BatchNorm<double> bn(3, 0.5);
+  Ndarray<double> x(4, 3, 2, 5);
+  x.gaussian(2);
+  x += 1.5;
+  auto out = bn.forward(x);
+  // every channel comes out with mean 0 and variance 1, and the running
+  // statistics move halfway from (0, 1) towards the batch's
+  for (int64_t ch = 0; ch < 3; ch++) {
+    double mx = 0, vx = 0, mo = 0, vo = 0;
+    for (int64_t n = 0; n < 4; n++) {
+      for (int64_t i = 0; i < 2; i++) {
+        for (int64_t j = 0; j < 5; j++) {
+          mx += x.at(n, ch, i, j) / 40;
+          mo += out.at(n, ch, i, j) / 40;
+        }
+      }
+    }
+    for (int64_t n = 0; n < 4; n++) {
+      for (int64_t i = 0; i < 2; i++) {
+        for (int64_t j = 0; j < 5; j++) {
+          vx += std::pow(x.at(n, ch, i, j) - mx, 2) / 39;
+          vo += std::pow(out.at(n, ch, i, j) - mo, 2) / 40;
+        }
+      }
+    }
+    assert(std::abs(mo) < 1e-12);
+    assert(std::abs(vo - 1) < 1e-4);
+    assert(std::abs(bn.running_mean_.at(ch) - mx / 2) < 1e-12);
+    assert(std::abs(bn.running_var_.at(ch) - (1 + vx) / 2) < 1e-12);
+  }
+
+  bn.gamma_.gaussian(1);
+  bn.beta_.gaussian(1);
+  auto dout = out.as_zeros();
+  dout.gaussian(1);
+  auto dx = bn.backward(dout);
+  for (auto p : {std::make_pair(x, dx), std::make_pair(bn.gamma_, bn.dgamma_),
+                 std::make_pair(bn.beta_, bn.dbeta_)}) {
+    auto grad = NumericGrad(
+        [&bn, &x, &dout]() { return (bn.forward(x) * dout).sum(); }, p.first,
+        1e-5);
+    auto diff = grad - p.second;
+    assert(diff.max() < 1e-6 && (diff * -1.0).max() < 1e-6);
+  }
+
+  // with floats the parameter gradients of a large channel still sum to
+  // float precision
+  {
+    BatchNorm<float> bnf(1);
+    Ndarray<float> xf(8, 1, 256, 256);
+    xf.gaussian(1);
+    Ndarray<float> outf = bnf.forward(xf);
+    Ndarray<float> doutf = xf.as_zeros();
+    doutf.gaussian(1);
+    doutf += 1.0f;
+    bnf.backward(doutf);
+    double sum = 0, dot = 0, abs_dot = 0;
+    for (int64_t i = 0; i < doutf.size(); i++) {
+      sum += doutf.ptr()[i];
+      dot += double(doutf.ptr()[i]) * outf.ptr()[i];
+      abs_dot += std::abs(double(doutf.ptr()[i]) * outf.ptr()[i]);
+    }
+    assert(std::abs(bnf.dbeta_.at(0) - sum) < 1e-6 * sum);
+    assert(std::abs(bnf.dgamma_.at(0) - dot) < 1e-6 * abs_dot);
+  }
+
+  // a folded layer computes what it did followed by the batch norm
+  bn.set_training(false);
+  Conv<double> conv(3, 3, 2, 3, 1, 1, 1);
+  conv.b_.gaussian(1);
+  Ndarray<double> in(2, 2, 5, 4);
+  in.gaussian(1);
+  auto expected = bn.forward(conv.forward(in));
+  FoldBatchNorm(bn, &conv);
+  auto diff = conv.forward(in) - expected;
+  assert(diff.max() < 1e-9 && (diff * -1.0).max() < 1e-9);
+  Affine<double> affine(6, 3, 1);
+  affine.b_.gaussian(1);
+  Ndarray<double> in2(5, 6);
+  in2.gaussian(1);
+  expected = bn.forward(affine.forward(in2));
+  FoldBatchNorm(bn, &affine);
+  diff = affine.forward(in2) - expected;
+  assert(diff.max() < 1e-9 && (diff * -1.0).max() < 1e-9);
+}
+
+// Checks every Conv::Algo against the direct loop nest.
+void TestConvAlgos() {
+  typedef Conv<double>::Algo Algo;
+#define ASSERT_CLOSE(a, b)                                   \
+  do {                                                       \
+    assert((a).shape() == (b).shape());                      \
+    assert(((a) - (b)).max() < 1e-9);                        \
+    assert(((b) - (a)).max() < 1e-9);                        \
+  } while (0)
+  struct Case {
+    int64_t fh, fw, fc, fn, s, p, H, W;
+  };
+  for (Case c : std::vector<Case>{{3, 3, 2, 4, 1, 1, 6, 7},
+                                  {5, 5, 3, 2, 1, 2, 9, 8},
+                                  {3, 2, 2, 3, 2, 0, 7, 6},
+                                  {4, 3, 1, 2, 3, 2, 10, 9},
+                                  {3, 3, 3, 5, 1, 0, 9, 11},
+                                  {5, 5, 2, 3, 1, 4, 7, 6},
+                                  {7, 7, 2, 3, 1, 3, 12, 10},
+                                  {11, 9, 2, 2, 1, 5, 16, 13}}) {
+    for (auto algo : {Algo::kIm2col, Algo::kWinograd2, Algo::kWinograd4,
+                      Algo::kFft}) {
+      Conv<double> direct(c.fh, c.fw, c.fc, c.fn, c.s, c.p, 1, Algo::kDirect);
+      Conv<double> conv(c.fh, c.fw, c.fc, c.fn, c.s, c.p, 1, algo);
+      direct.b_.gaussian(1);
+      conv.b_.gaussian(1);
+      Ndarray<double> x(3, c.fc, c.H, c.W);
+      x.gaussian(1);
+      auto out = conv.forward(x);
+      ASSERT_CLOSE(out, direct.forward(x));
+      Ndarray<double> dout = out.as_zeros();
+      dout.gaussian(1);
+      auto dx = conv.backward(dout);
+      ASSERT_CLOSE(dx, direct.backward(dout));
+      ASSERT_CLOSE(conv.dw_, direct.dw_);
+      ASSERT_CLOSE(conv.db_, direct.db_);
+    }
+  }
+
+  // grouped layers, and depthwise ones with one or two filters per channel
+  struct Grouped {
+    int64_t f, fc, fn, groups, s, p, H, W;
+  };
+  for (Grouped c : std::vector<Grouped>{{3, 4, 6, 2, 1, 1, 6, 7},
+                                        {3, 6, 3, 3, 2, 0, 9, 8},
+                                        {3, 3, 3, 3, 1, 1, 8, 9},
+                                        {5, 2, 4, 2, 2, 2, 9, 8},
+                                        {3, 4, 8, 4, 3, 2, 10, 7},
+                                        {2, 3, 3, 3, 1, 0, 5, 6}}) {
+    for (auto algo : {Algo::kIm2col, Algo::kWinograd2, Algo::kFft}) {
+      Conv<double> direct(c.f, c.f, c.fc, c.fn, c.s, c.p, 1, Algo::kDirect,
+                          c.groups);
+      Conv<double> conv(c.f, c.f, c.fc, c.fn, c.s, c.p, 1, algo, c.groups);
+      assert(conv.w_.shape(1) == c.fc / c.groups);
+      direct.b_.gaussian(1);
+      conv.b_.gaussian(1);
+      Ndarray<double> x(3, c.fc, c.H, c.W);
+      x.gaussian(1);
+      auto out = conv.forward(x);
+      ASSERT_CLOSE(out, direct.forward(x));
+      Ndarray<double> blocked;
+      conv.forward_blocked(x.to_blocked(1), &blocked);
+      ASSERT_CLOSE(blocked.from_blocked(c.fn), out);
+      Ndarray<double> dout = out.as_zeros();
+      dout.gaussian(1);
+      auto dx = conv.backward(dout);
+      ASSERT_CLOSE(dx, direct.backward(dout));
+      ASSERT_CLOSE(conv.dw_, direct.dw_);
+      ASSERT_CLOSE(conv.db_, direct.db_);
+    }
+  }
+  // the im2col backward split over batch chunks and filter or channel tiles,
+  // with odd numbers of chunks and gradients accumulated by beta
+  int default_threads = NumThreads();
+  for (int threads : {3, 4}) {
+    SetNumThreads(threads);
+    for (int64_t N : {1, 2, 5}) {
+      for (int64_t groups : {1, 2}) {
+        Conv<double> direct(3, 3, 4, 6, 1, 1, 1, Algo::kDirect, groups);
+        Conv<double> conv(3, 3, 4, 6, 1, 1, 1, Algo::kIm2col, groups);
+        Ndarray<double> x(N, 4, 6, 5);
+        x.gaussian(1);
+        Ndarray<double> dout = conv.forward(x).as_zeros();
+        dout.gaussian(1);
+        direct.forward(x);
+        auto dx = conv.backward(dout);
+        ASSERT_CLOSE(dx, direct.backward(dout));
+        ASSERT_CLOSE(conv.dw_, direct.dw_);
+        Ndarray<double> dw = conv.dw_.fork();
+        conv.backward_into(dout, nullptr, 0.5);
+        ASSERT_CLOSE(conv.dw_, dw * 1.5);
+      }
+    }
+  }
+  SetNumThreads(default_threads);
+
+  // the direct loop nest itself, against numeric gradients
+  Conv<double> depthwise(3, 3, 2, 4, 1, 1, 1, Algo::kDirect, 2);
+  Ndarray<double> x(2, 2, 4, 5);
+  x.gaussian(1);
+  Ndarray<double> dout = depthwise.forward(x).as_zeros();
+  dout.gaussian(1);
+  auto dx = depthwise.backward(dout);
+  for (auto p : {std::make_pair(x, dx),
+                 std::make_pair(depthwise.w_, depthwise.dw_)}) {
+    auto grad = NumericGrad(
+        [&depthwise, &x, &dout]() {
+          return (depthwise.forward(x) * dout).sum();
+        },
+        p.first, 1e-5);
+    auto diff = grad - p.second;
+    assert(diff.max() < 1e-6 && (diff * -1.0).max() < 1e-6);
+  }
+#undef ASSERT_CLOSE
+}
+
+Ndarray<double> ToDouble(const Ndarray<float>& a) {
+  std::vector<double> data(a.data()->begin(), a.data()->end());
+  return Ndarray<double>(a.shape(), data);
+}
+
+// float runs the same code as double, only the tolerances differ.
+void TestFloat() {
+#define ASSERT_CLOSE(a, b)                    \
+  do {                                        \
+    assert((a).shape() == (b).shape());       \
+    assert((ToDouble(a) - (b)).max() < 1e-4); \
+    assert(((b) - ToDouble(a)).max() < 1e-4); \
+  } while (0)
+  typedef Conv<float>::Algo Algo;
+  for (auto algo : {Algo::kDirect, Algo::kIm2col, Algo::kWinograd4,
+                    Algo::kFft}) {
+    Conv<double> direct(3, 3, 4, 5, 1, 1, 1, Conv<double>::Algo::kDirect);
+    Conv<float> conv(3, 3, 4, 5, 1, 1, 1, algo);
+    Ndarray<float> x(2, 4, 9, 8);
+    x.gaussian(1);
+    auto out = conv.forward(x);
+    ASSERT_CLOSE(out, direct.forward(ToDouble(x)));
+    Ndarray<float> dout = out.as_zeros();
+    dout.gaussian(1);
+    auto dx = conv.backward(dout);
+    ASSERT_CLOSE(dx, direct.backward(ToDouble(dout)));
+    ASSERT_CLOSE(conv.dw_, direct.dw_);
+  }
+  Ndarray<float> a(37, 53);
+  Ndarray<float> b(53, 29);
+  a.gaussian(1);
+  b.gaussian(1);
+  ASSERT_CLOSE(a.dot(b), ToDouble(a).dot(ToDouble(b)));
+  ASSERT_CLOSE(b.T().dot(a.T()), ToDouble(b).T().dot(ToDouble(a).T()));
+#undef ASSERT_CLOSE
+}
+
 void TestLoss() {
-  Ndarray x(
+  Ndarray<double> x(
       {10, 3},
       {0.606567333443,  2.01332481698,   -0.412612214561,  2.00837371654,
        -1.69085691849,  -0.927916647393, -1.09005211705,   -0.653620648868,
@@ -242,10 +1134,10 @@ void TestLoss() {
        0.191062542884,  -0.834485465771, 0.850058643765,   -1.064674118,
        -0.844348867234, 0.842866950183});
   int64_t y[] = {0, 0, 2, 1, 2, 2, 0, 2, 1, 0};
-  Ndarray dx = x.as_zeros();
+  Ndarray<double> dx = x.as_zeros();
   double loss = SoftmaxLoss(x, y, &dx);
   assert(std::abs(loss - 1.23806746255) < 1e-6);
-  Ndarray expected(
+  Ndarray<double> expected(
       {10, 3},
       {-0.0816297586624, 0.0750001055049,  0.00662965315753, -0.0072188176925,
        0.00229564352518, 0.00492317416731, 0.0174625574496,  0.0270176534179,
@@ -260,7 +1152,7 @@ void TestLoss() {
 
 void TestCnn() {
   {
-    SimpleConvNet::Config config;
+    SimpleConvNet<double>::Config config;
     config.input_height = 32;
     config.input_width = 32;
     config.input_depth = 3;
@@ -271,21 +1163,22 @@ void TestCnn() {
     config.n_classes = 10;
     config.reg = 0;
 
-    Ndarray x({5, config.input_depth, config.input_height, config.input_width},
-              nullptr);
+    Ndarray<double> x(
+        {5, config.input_depth, config.input_height, config.input_width},
+        nullptr);
     x.gaussian(1);
     int64_t y[] = {1, 2, 3, 4, 5};
 
-    auto loss = SimpleConvNet(config).loss(x, y);
+    auto loss = SimpleConvNet<double>(config).loss(x, y);
     assert(std::abs(loss - (-std::log(0.1))) < 1e-3);
 
     config.reg = 0.5;
-    auto loss2 = SimpleConvNet(config).loss(x, y);
+    auto loss2 = SimpleConvNet<double>(config).loss(x, y);
     assert(loss2 > loss);
     assert(loss2 < loss + 1);
   }
   {
-    SimpleConvNet::Config config;
+    SimpleConvNet<double>::Config config;
     config.input_height = 16;
     config.input_width = 16;
     config.input_depth = 3;
@@ -295,15 +1188,16 @@ void TestCnn() {
     config.weight_scale = 1e-2;
     config.n_classes = 10;
     config.reg = 0;
-    SimpleConvNet cnn(config);
+    SimpleConvNet<double> cnn(config);
 
-    Ndarray x({2, config.input_depth, config.input_height, config.input_width},
-              nullptr);
+    Ndarray<double> x(
+        {2, config.input_depth, config.input_height, config.input_width},
+        nullptr);
     x.gaussian(1);
     int64_t y[2] = {1, 2};
     auto loss = cnn.loss(x, y);
 
-    Ndarray dscores({x.shape(0), config.n_classes}, nullptr);
+    Ndarray<double> dscores({x.shape(0), config.n_classes}, nullptr);
 #define TEST_CNN(target, grad)                                      \
   do {                                                              \
     auto grad2 = NumericGrad(                                       \
@@ -324,7 +1218,170 @@ void TestCnn() {
 #undef TEST_CNN
   }
   {
-    SimpleConvNet::Config config;
+    // checkpointing the conv block changes the memory, not the gradients
+    SimpleConvNet<double>::Config config;
+    config.input_height = 9;
+    config.input_width = 8;
+    config.input_depth = 2;
+    config.n_filters = 3;
+    config.filter_size = 3;
+    config.hidden_dim = 5;
+    config.weight_scale = 1e-1;
+    config.n_classes = 4;
+    config.reg = 0.1;
+    SimpleConvNet<double> plain(config);
+    config.checkpoint_batch = 2;
+    SimpleConvNet<double> checkpointed(config);
+    Ndarray<double> x({5, 2, 9, 8}, nullptr);
+    x.gaussian(1);
+    int64_t y[5] = {0, 3, 1, 2, 2};
+    for (int step = 0; step < 2; step++) {
+      double loss = plain.loss(x, y);
+      assert(std::abs(checkpointed.loss(x, y) - loss) < 1e-12);
+      for (auto p : {std::make_pair(plain.conv_.dw_, checkpointed.conv_.dw_),
+                     std::make_pair(plain.conv_.db_, checkpointed.conv_.db_),
+                     std::make_pair(plain.affine_.dw_,
+                                    checkpointed.affine_.dw_)}) {
+        auto diff = p.first - p.second;
+        assert(diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12);
+      }
+    }
+    // 5 images in chunks of 2 or 3 end on a shorter one, which runs on the
+    // buffers of the full ones: a pass takes no more blocks from the pool
+    // than one over 6 images, in whole chunks
+    Ndarray<double> x6({6, 2, 9, 8}, nullptr);
+    x6.gaussian(1);
+    int64_t y6[6] = {0, 3, 1, 2, 2, 1};
+    for (int64_t B : {2, 3}) {
+      config.checkpoint_batch = B;
+      SimpleConvNet<double> cnn(config);
+      assert(std::abs(cnn.loss(x, y) - plain.loss(x, y)) < 1e-12);
+      int64_t hits[2];
+      for (int k = 0; k < 2; k++) {
+        const Ndarray<double>& xk = k == 0 ? x : x6;
+        const int64_t* yk = k == 0 ? y : y6;
+        cnn.loss(xk, yk);
+        ResetPoolStats();
+        cnn.loss(xk, yk);
+        assert(GetPoolStats().misses == 0);
+        hits[k] = GetPoolStats().hits;
+      }
+      assert(hits[0] <= hits[1]);
+    }
+  }
+  {
+    // with batch norm, loss() trains through batch statistics and forward
+    // runs the conv folded with the running ones
+    SimpleConvNet<double>::Config config;
+    config.input_height = 8;
+    config.input_width = 6;
+    config.input_depth = 2;
+    config.n_filters = 3;
+    config.filter_size = 3;
+    config.hidden_dim = 5;
+    config.weight_scale = 1e-1;
+    config.n_classes = 4;
+    config.batch_norm = true;
+    SimpleConvNet<double> cnn(config);
+    cnn.bn_.gamma_.gaussian(1);
+    cnn.bn_.beta_.gaussian(1);
+    Ndarray<double> x({3, 2, 8, 6}, nullptr);
+    x.gaussian(1);
+    int64_t y[3] = {0, 3, 1};
+    cnn.loss(x, y);
+    for (auto p : {std::make_pair(cnn.bn_.gamma_, cnn.bn_.dgamma_.fork()),
+                   std::make_pair(cnn.bn_.beta_, cnn.bn_.dbeta_.fork()),
+                   std::make_pair(cnn.conv_.w_, cnn.conv_.dw_.fork())}) {
+      auto grad = NumericGrad([&cnn, &x, y]() { return cnn.loss(x, y); },
+                              p.first, 1e-5);
+      auto diff = grad - p.second;
+      assert(diff.max() < 1e-6 && (diff * -1.0).max() < 1e-6);
+    }
+
+    // the folded conv is cached, and folded again once the statistics or
+    // the weights move
+    for (int step = 0; step < 3; step++) {
+      if (step == 1) {
+        cnn.loss(x, y);
+      } else if (step == 2) {
+        cnn.conv_.w_.at(0, 0, 0, 0) += 0.5;
+      }
+      cnn.bn_.set_training(false);
+      auto plain = cnn.pool_.forward(
+          cnn.relu_.forward(cnn.bn_.forward(cnn.conv_.forward(x))));
+      cnn.bn_.set_training(true);
+      auto scores = cnn.affine2_.forward(cnn.relu2_.forward(
+          cnn.affine_.forward(plain.reshape(plain.shape(0), -1))));
+      for (int call = 0; call < 2; call++) {
+        auto diff = cnn.forward(x) - scores;
+        assert(diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12);
+      }
+    }
+  }
+  {
+    // a synchronous data-parallel step is a step over the whole batch, and
+    // the result depends on the replicas only
+    SimpleConvNet<double>::Config config;
+    config.input_height = 6;
+    config.input_width = 5;
+    config.input_depth = 2;
+    config.n_filters = 3;
+    config.filter_size = 3;
+    config.hidden_dim = 6;
+    config.weight_scale = 1e-1;
+    config.n_classes = 4;
+    config.reg = 0.1;
+    Ndarray<double> x({10, 2, 6, 5}, nullptr);
+    x.gaussian(1);
+    int64_t y[10] = {0, 1, 2, 3, 0, 1, 2, 3, 0, 1};
+    auto close = [](const Ndarray<double>& a, const Ndarray<double>& b) {
+      auto diff = a - b;
+      return diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12;
+    };
+    SimpleConvNet<double> serial(config);
+    SimpleConvNet<double> parallel(config);
+    serial.train(x, y, x, y, 1, 10, 0.1, 0, 0);
+    parallel.train_parallel(x, y, x, y, 1, 10, 0.1, 0, 0, 3);
+    assert(close(serial.conv_.w_, parallel.conv_.w_));
+    assert(close(serial.affine_.w_, parallel.affine_.w_));
+    assert(close(serial.affine2_.b_, parallel.affine2_.b_));
+
+    int default_threads = NumThreads();
+    std::vector<Ndarray<double>> weights;
+    for (int threads : {1, 3, 3}) {
+      SetNumThreads(threads);
+      SimpleConvNet<double> cnn(config);
+      // batches of 4, 4 and 2 images, the last one cut into 2 shards
+      cnn.train_parallel(x, y, x, y, 2, 4, 0.1, 0, 0, 3);
+      weights.push_back(cnn.conv_.w_);
+    }
+    SetNumThreads(default_threads);
+    assert(weights[0] == weights[1] && weights[1] == weights[2]);
+
+    // with batch norm, one replica is serial training, running statistics
+    // included, and several ones still do not depend on the threads
+    config.batch_norm = true;
+    SimpleConvNet<double> serial_bn(config);
+    SimpleConvNet<double> parallel_bn(config);
+    serial_bn.train(x, y, x, y, 1, 10, 0.1, 0, 0);
+    parallel_bn.train_parallel(x, y, x, y, 1, 10, 0.1, 0, 0, 1);
+    assert(close(serial_bn.conv_.w_, parallel_bn.conv_.w_));
+    assert(close(serial_bn.bn_.running_mean_, parallel_bn.bn_.running_mean_));
+    assert(close(serial_bn.bn_.running_var_, parallel_bn.bn_.running_var_));
+    std::vector<Ndarray<double>> stats;
+    for (int threads : {1, 3, 3}) {
+      SetNumThreads(threads);
+      SimpleConvNet<double> cnn(config);
+      cnn.train_parallel(x, y, x, y, 2, 4, 0.1, 0, 0, 3);
+      stats.push_back(cnn.bn_.running_mean_);
+      stats.push_back(cnn.bn_.running_var_);
+    }
+    SetNumThreads(default_threads);
+    assert(stats[0] == stats[2] && stats[2] == stats[4]);
+    assert(stats[1] == stats[3] && stats[3] == stats[5]);
+  }
+  {
+    SimpleConvNet<double>::Config config;
     config.input_height = 32;
     config.input_width = 32;
     config.input_depth = 3;
@@ -334,11 +1391,12 @@ void TestCnn() {
     config.weight_scale = 1e-3;
     config.n_classes = 10;
     config.reg = 0.0;
-    SimpleConvNet cnn(config);
+    SimpleConvNet<double> cnn(config);
 
     int64_t N = 100;
-    Ndarray x({N, config.input_depth, config.input_height, config.input_width},
-              nullptr);
+    Ndarray<double> x(
+        {N, config.input_depth, config.input_height, config.input_width},
+        nullptr);
     x.gaussian(1);
     int64_t y[N];
     for (int64_t i = 0; i < N; i++) {
@@ -356,12 +1414,260 @@ void TestCnn() {
   }
 }
 
+void TestGraph() {
+  {
+    // the layers of a SimpleConvNet as a graph give its loss and gradients
+    SimpleConvNet<double>::Config config;
+    config.input_height = 7;
+    config.input_width = 6;
+    config.input_depth = 2;
+    config.n_filters = 3;
+    config.filter_size = 3;
+    config.hidden_dim = 5;
+    config.weight_scale = 1e-1;
+    config.n_classes = 4;
+    config.reg = 0.1;
+    SimpleConvNet<double> cnn(config);
+    Graph<double> graph;
+    int conv = graph.add(cnn.conv_, Graph<double>::kInput);
+    int pool = graph.add(cnn.pool_, graph.add(cnn.relu_, conv));
+    int affine = graph.add(cnn.affine_, graph.flatten(pool));
+    int affine2 = graph.add(cnn.affine2_, graph.add(cnn.relu2_, affine));
+    Ndarray<double> x({3, 2, 7, 6}, nullptr);
+    x.gaussian(1);
+    int64_t y[3] = {2, 0, 3};
+    Optimizer<double>::Config adagrad;
+    adagrad.weight_decay = config.reg;
+    Optimizer<double> optimizer(adagrad);
+    for (int step = 0; step < 2; step++) {
+      double expected = cnn.loss(x, y);
+      double loss = graph.loss(x, y, config.reg);
+      assert(std::abs(loss - expected) < 1e-12);
+      for (auto p : {std::make_pair(cnn.conv_.dw_, graph.conv(conv).dw_),
+                     std::make_pair(cnn.conv_.db_, graph.conv(conv).db_),
+                     std::make_pair(cnn.affine_.dw_, graph.affine(affine).dw_),
+                     std::make_pair(cnn.affine2_.db_,
+                                    graph.affine(affine2).db_)}) {
+        auto diff = p.first - p.second;
+        assert(diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12);
+      }
+      optimizer.step(graph.params(), 1e-2);
+    }
+    auto diff = graph.forward(x) - cnn.forward(x);
+    assert(diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12);
+    std::cout << "graph buffers:" << graph.buffer_bytes()
+              << " tensors:" << graph.tensor_bytes() << std::endl;
+    assert(graph.buffer_bytes() < graph.tensor_bytes());
+
+    ResetPoolStats();
+    graph.loss(x, y, config.reg);
+    assert(GetPoolStats().misses == 0);
+  }
+  {
+    // a residual block: the first relu feeds both the second conv and the
+    // sum, so its gradient is accumulated from two consumers
+    Graph<double> graph;
+    int conv = graph.add(Conv<double>(3, 3, 2, 3, 1, 1, 0.5),
+                         Graph<double>::kInput);
+    int relu = graph.add(Relu<double>(), conv);
+    int conv2 = graph.add(Conv<double>(3, 3, 3, 3, 1, 1, 0.5), relu);
+    int sum = graph.add(Relu<double>(), graph.sum(conv2, relu));
+    int pool = graph.add(MaxPool<double>(2, 2, 2), sum);
+    int affine = graph.add(Affine<double>(3 * 3 * 3, 4, 0.5),
+                           graph.flatten(pool));
+    Ndarray<double> x({2, 2, 5, 5}, nullptr);
+    x.gaussian(1);
+    int64_t y[2] = {1, 3};
+    graph.loss(x, y);
+    for (auto p : {std::make_pair(graph.conv(conv).w_,
+                                  graph.conv(conv).dw_.fork()),
+                   std::make_pair(graph.conv(conv2).w_,
+                                  graph.conv(conv2).dw_.fork()),
+                   std::make_pair(graph.affine(affine).w_,
+                                  graph.affine(affine).dw_.fork())}) {
+      auto grad = NumericGrad([&graph, &x, y]() { return graph.loss(x, y); },
+                              p.first, 1e-5);
+      auto diff = grad - p.second;
+      assert(diff.max() < 1e-6 && (diff * -1.0).max() < 1e-6);
+    }
+
+    // a new batch size plans again
+    Ndarray<double> x3({3, 2, 5, 5}, nullptr);
+    x3.gaussian(1);
+    int64_t y3[3] = {0, 1, 2};
+    graph.loss(x3, y3);
+    assert(graph.forward(x3).shape() == std::vector<int64_t>({3, 4}));
+  }
+}
+
+void TestParamServer() {
+  {
+    // shards of 4 elements: 3 for w, 1 for b
+    Ndarray<double> w({2, 5}, nullptr);
+    Ndarray<double> b({3}, {1, 2, 3});
+    w.gaussian(1);
+    ParamServer<double> server({{&w, nullptr, true}, {&b, nullptr, false}},
+                               Optimizer<double>::Config(), 4);
+    assert(server.shards() == 4);
+    int w0 = server.add_worker();
+    int w1 = server.add_worker();
+    Ndarray<double> w_copy({2, 5}, nullptr);
+    Ndarray<double> b_copy({3}, nullptr);
+    server.pull(w0, {&w_copy, &b_copy});
+    assert(w_copy == w && b_copy == b);
+
+    Ndarray<double> dw = w.as_zeros() + 0.5;
+    Ndarray<double> db({3}, {1, -1, 2});
+    auto expected = w - dw * 0.1 / (dw * dw + 1e-4).pow(0.5);
+    server.pull(w1, {&w_copy, &b_copy});
+    server.push(w0, {&dw, &db}, 0.1);
+    auto diff = w - expected;
+    assert(diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12);
+    auto stats = server.stats(w0);
+    assert(stats.pushes == 1 && stats.updates == 4);
+    assert(stats.stale_updates == 0 && stats.max_staleness == 0);
+
+    // w1 pulled before w0's push, so each of its shard updates is one behind
+    server.push(w1, {&dw, &db}, 0.1);
+    stats = server.stats(w1);
+    assert(stats.stale_updates == 4 && stats.staleness == 4);
+    assert(stats.max_staleness == 1);
+    // and a fresh pull catches up
+    server.pull(w1, {&w_copy, &b_copy});
+    server.push(w1, {&dw, &db}, 0.1);
+    assert(server.stats(w1).stale_updates == 4);
+    stats = server.stats();
+    assert(stats.pushes == 3 && stats.updates == 12);
+  }
+  {
+    // Hogwild training from several threads through one server
+    SimpleConvNet<double>::Config config;
+    config.input_height = 6;
+    config.input_width = 6;
+    config.input_depth = 1;
+    config.n_filters = 2;
+    config.filter_size = 3;
+    config.hidden_dim = 5;
+    config.weight_scale = 1e-1;
+    config.n_classes = 3;
+    SimpleConvNet<double> cnn(config);
+    ParamServer<double> server(cnn.params(), cnn.optimizer().config(), 16);
+    Ndarray<double> x({24, 1, 6, 6}, nullptr);
+    x.gaussian(1);
+    int64_t y[24];
+    for (int64_t i = 0; i < 24; i++) {
+      y[i] = i % 3;
+    }
+    double before = SimpleConvNet<double>(cnn).loss(x, y);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; t++) {
+      threads.emplace_back([&, t]() {
+        cnn.train_async(&server, x.slice(8 * t, 8), y + 8 * t, x, y, 4, 2,
+                        0.05, 0, 0);
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    auto stats = server.stats();
+    std::cout << "param server stale updates:" << stats.stale_updates << "/"
+              << stats.updates << " max staleness:" << stats.max_staleness
+              << std::endl;
+    assert(stats.pushes == 3 * 4 * 4);
+    assert(stats.updates == stats.pushes * server.shards());
+    assert(SimpleConvNet<double>(cnn).loss(x, y) < before);
+  }
+}
+
+void TestOptimizer() {
+  // each rule against a plain loop over three steps, on a weight of two
+  // blocks with weight decay and a bias without
+  typedef Optimizer<double>::Algo Algo;
+  std::vector<Optimizer<double>::Config> configs(5);
+  configs[0].algo = Algo::kSgd;
+  configs[1].algo = Algo::kSgd;
+  configs[1].momentum = 0.9;
+  configs[2].algo = Algo::kAdagrad;
+  configs[3].algo = Algo::kRmsProp;
+  configs[4].algo = Algo::kAdam;
+  for (Optimizer<double>::Config& config : configs) {
+    config.weight_decay = 0.1;
+    Optimizer<double> optimizer(config);
+    Ndarray<double> w({3, 7000}, nullptr);
+    Ndarray<double> b({5}, {1, -2, 3, -4, 5});
+    w.gaussian(1);
+    Ndarray<double> dw({3, 7000}, nullptr);
+    Ndarray<double> db({5}, {-0.5, 0.1, 0, 2, 0.3});
+    std::vector<Param<double>> params = {{&w, &dw, true}, {&b, &db, false}};
+    std::vector<Ndarray<double>> expected = {w.fork(), b.fork()};
+    double v0 = config.algo == Algo::kAdagrad ? 1e-4 : 0;
+    std::vector<std::vector<double>> m = {std::vector<double>(w.size()),
+                                          std::vector<double>(b.size())};
+    std::vector<std::vector<double>> v = {std::vector<double>(w.size(), v0),
+                                          std::vector<double>(b.size(), v0)};
+    for (int t = 1; t <= 3; t++) {
+      dw.gaussian(1);
+      // after the first step the state is in place
+      ResetPoolStats();
+      optimizer.step(params, 0.1);
+      assert(t == 1 || GetPoolStats().misses + GetPoolStats().hits == 0);
+      for (int k = 0; k < 2; k++) {
+        double* p = expected[k].ptr();
+        const double* g = params[k].grad->ptr();
+        double wd = params[k].decay ? 0.1 : 0;
+        for (int64_t i = 0; i < expected[k].size(); i++) {
+          double d = g[i] + wd * p[i];
+          double& mi = m[k][i];
+          double& vi = v[k][i];
+          switch (config.algo) {
+            case Algo::kSgd:
+              mi = config.momentum * mi + d;
+              p[i] -= 0.1 * mi;
+              break;
+            case Algo::kAdagrad:
+              vi += d * d;
+              p[i] -= 0.1 * d / std::sqrt(vi);
+              break;
+            case Algo::kRmsProp:
+              vi = 0.999 * vi + 0.001 * d * d;
+              p[i] -= 0.1 * d / (std::sqrt(vi) + 1e-8);
+              break;
+            case Algo::kAdam:
+              mi = 0.9 * mi + 0.1 * d;
+              vi = 0.999 * vi + 0.001 * d * d;
+              p[i] -= 0.1 * (mi / (1 - std::pow(0.9, t))) /
+                      (std::sqrt(vi / (1 - std::pow(0.999, t))) + 1e-8);
+              break;
+          }
+        }
+        auto diff = expected[k] - *params[k].value;
+        assert(diff.max() < 1e-12 && (diff * -1.0).max() < 1e-12);
+      }
+    }
+  }
+}
+
 }  // namespace litecnn
 
 int main() {
   litecnn::TestNdarray();
+  litecnn::TestGemm();
+  litecnn::TestBinop();
+  litecnn::TestExpr();
+  litecnn::TestPool();
+  litecnn::TestReduce();
+  litecnn::TestParallel();
+  litecnn::TestMappedFile();
+  litecnn::TestInto();
+  litecnn::TestBlocked();
   litecnn::TestLayers();
+  litecnn::TestBatchNorm();
+  litecnn::TestConvAlgos();
+  litecnn::TestFloat();
   litecnn::TestLoss();
   litecnn::TestCnn();
+  litecnn::TestGraph();
+  litecnn::TestParamServer();
+  litecnn::TestOptimizer();
   std::cout << "all passed" << std::endl;
 }
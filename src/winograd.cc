@@ -0,0 +1,415 @@
+#include "winograd.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "gemm.h"
+#include "parallel.h"
+#include "pool.h"
+
+namespace litecnn {
+
+namespace {
+
+// Finite interpolation points, the point at infinity is always the last one.
+const double kPoints[] = {0, 1, -1, 2, -2, 0.5, -0.5};
+const int64_t kMaxAlpha = 8;
+// Tiles are transformed kLanes at a time, lane-minor, so that the small
+// matrix products vectorize across tiles.
+const int64_t kLanes = 8;
+
+// Rows t < alpha-1 hold the powers a_t^0..a_t^(q-1), the last row evaluates
+// the leading coefficient. Rows are divided by scale[t] if given.
+std::vector<double> Vandermonde(int64_t alpha, int64_t q,
+                                const std::vector<double>* scale) {
+  std::vector<double> ret(alpha * q, 0.0);
+  for (int64_t t = 0; t < alpha - 1; t++) {
+    double v = 1;
+    for (int64_t i = 0; i < q; i++, v *= kPoints[t]) {
+      ret[t * q + i] = scale ? v / (*scale)[t] : v;
+    }
+  }
+  ret[alpha * q - 1] = 1;
+  return ret;
+}
+
+std::vector<double> Transposed(const std::vector<double>& a, int64_t rows,
+                               int64_t cols) {
+  std::vector<double> ret(a.size());
+  for (int64_t i = 0; i < rows; i++) {
+    for (int64_t j = 0; j < cols; j++) {
+      ret[j * rows + i] = a[i * cols + j];
+    }
+  }
+  return ret;
+}
+
+// The matrices are built in double and rounded once to the element type.
+template <typename T>
+std::vector<T> Cast(const std::vector<double>& a) {
+  return std::vector<T>(a.begin(), a.end());
+}
+
+template <typename T>
+using SandwichFn = void (*)(const T* a, const T* x, T* y);
+
+// y (p,p) = a (p,q) . x (q,q) . a^T for kLanes tiles at once: x holds
+// element (i,j) of every lane at x[(i*q+j)*kLanes + lane]. The sizes are
+// fixed at compile time so that the loops unroll and the sums stay in
+// registers, vectorized across lanes.
+template <typename T, int64_t P, int64_t Q>
+void SandwichFixed(const T* a, const T* x, T* y) {
+  T tmp[P * Q * kLanes];
+  for (int64_t i = 0; i < P; i++) {
+    for (int64_t j = 0; j < Q; j++) {
+      for (int64_t lane = 0; lane < kLanes; lane++) {
+        T v = 0;
+        for (int64_t l = 0; l < Q; l++) {
+          v += a[i * Q + l] * x[(l * Q + j) * kLanes + lane];
+        }
+        tmp[(i * Q + j) * kLanes + lane] = v;
+      }
+    }
+  }
+  for (int64_t i = 0; i < P; i++) {
+    for (int64_t j = 0; j < P; j++) {
+      for (int64_t lane = 0; lane < kLanes; lane++) {
+        T v = 0;
+        for (int64_t l = 0; l < Q; l++) {
+          v += tmp[(i * Q + l) * kLanes + lane] * a[j * Q + l];
+        }
+        y[(i * P + j) * kLanes + lane] = v;
+      }
+    }
+  }
+}
+
+template <typename T, int64_t P>
+SandwichFn<T> PickSandwich(int64_t q) {
+  switch (q) {
+    case 1: return SandwichFixed<T, P, 1>;
+    case 2: return SandwichFixed<T, P, 2>;
+    case 3: return SandwichFixed<T, P, 3>;
+    case 4: return SandwichFixed<T, P, 4>;
+    case 5: return SandwichFixed<T, P, 5>;
+    case 6: return SandwichFixed<T, P, 6>;
+    case 7: return SandwichFixed<T, P, 7>;
+    case 8: return SandwichFixed<T, P, 8>;
+  }
+  assert(false);
+  return nullptr;
+}
+
+template <typename T>
+SandwichFn<T> PickSandwich(int64_t p, int64_t q) {
+  switch (p) {
+    case 1: return PickSandwich<T, 1>(q);
+    case 2: return PickSandwich<T, 2>(q);
+    case 3: return PickSandwich<T, 3>(q);
+    case 4: return PickSandwich<T, 4>(q);
+    case 5: return PickSandwich<T, 5>(q);
+    case 6: return PickSandwich<T, 6>(q);
+    case 7: return PickSandwich<T, 7>(q);
+    case 8: return PickSandwich<T, 8>(q);
+  }
+  assert(false);
+  return nullptr;
+}
+
+// Tiles per chunk, sized so that a chunk's transformed input and output
+// tiles over all channels stay around 1MB, but wide enough for the Gemm
+// calls to amortize packing the transformed filters.
+int64_t TileChunk(int64_t alpha, int64_t channels) {
+  int64_t chunk = (1 << 17) / (alpha * alpha * channels);
+  return std::max<int64_t>(64, chunk / kLanes * kLanes);
+}
+
+// Position of tile t in an (n,th,tw) grid of size x size tiles.
+struct TilePos {
+  int64_t n;
+  int64_t y;
+  int64_t x;
+};
+
+inline TilePos Locate(int64_t t, int64_t th, int64_t tw, int64_t size) {
+  return {t / (th * tw), t / tw % th * size, t % tw * size};
+}
+
+// Zeroes lanes [nl, kLanes) of the first size elements of d, so that partial
+// lane groups stay finite.
+template <typename T>
+inline void ClearLanes(int64_t size, int64_t nl, T* d) {
+  if (nl == kLanes) {
+    return;
+  }
+  for (int64_t i = 0; i < size; i++) {
+    std::fill(d + i * kLanes + nl, d + (i + 1) * kLanes, T(0));
+  }
+}
+
+// Reads the size x size window at (y0,x0) of the (h,w) image into lane
+// `lane` of d, zero outside the image.
+template <typename T>
+inline void Gather(const T* img, int64_t h, int64_t w, int64_t y0,
+                   int64_t x0, int64_t size, int64_t lane, T* d) {
+  if (y0 >= 0 && y0 + size <= h && x0 >= 0 && x0 + size <= w) {
+    for (int64_t i = 0; i < size; i++) {
+      const T* row = img + (y0 + i) * w + x0;
+      for (int64_t j = 0; j < size; j++) {
+        d[(i * size + j) * kLanes + lane] = row[j];
+      }
+    }
+    return;
+  }
+  for (int64_t i = 0; i < size; i++) {
+    int64_t yy = y0 + i;
+    for (int64_t j = 0; j < size; j++) {
+      int64_t xx = x0 + j;
+      bool inside = yy >= 0 && yy < h && xx >= 0 && xx < w;
+      d[(i * size + j) * kLanes + lane] = inside ? img[yy * w + xx] : T(0);
+    }
+  }
+}
+
+}  // namespace
+
+template <typename T>
+Winograd<T>::Winograd(int64_t m, int64_t r) : m_(m), r_(r), alpha_(m + r - 1) {
+  assert(m >= 1);
+  assert(r >= 1);
+  assert(alpha_ <= kMaxAlpha);
+  // f[t] = prod_{l != t} (a_t - a_l) normalizes the Lagrange basis, it is
+  // folded into the filter transforms so that bt_ stays integral.
+  std::vector<double> f(alpha_, 1.0);
+  for (int64_t t = 0; t < alpha_ - 1; t++) {
+    for (int64_t l = 0; l < alpha_ - 1; l++) {
+      if (l != t) {
+        f[t] *= kPoints[t] - kPoints[l];
+      }
+    }
+  }
+  // Row t of bt_ holds the coefficients of prod_{l != t} (x - a_l), the last
+  // row those of prod_l (x - a_l).
+  bt_.assign(alpha_ * alpha_, 0.0);
+  for (int64_t t = 0; t < alpha_; t++) {
+    std::vector<double> poly{1};
+    for (int64_t l = 0; l < alpha_ - 1; l++) {
+      if (l == t) {
+        continue;
+      }
+      std::vector<double> next(poly.size() + 1, 0.0);
+      for (int64_t i = 0; i < poly.size(); i++) {
+        next[i + 1] += poly[i];
+        next[i] -= kPoints[l] * poly[i];
+      }
+      poly.swap(next);
+    }
+    std::copy(poly.begin(), poly.end(), bt_.begin() + t * alpha_);
+  }
+  at_ = Cast<T>(Transposed(Vandermonde(alpha_, m_, nullptr), alpha_, m_));
+  g_ = Cast<T>(Vandermonde(alpha_, r_, &f));
+  at2_ = Cast<T>(Transposed(Vandermonde(alpha_, r_, nullptr), alpha_, r_));
+  g2_ = Cast<T>(Vandermonde(alpha_, m_, &f));
+  input_fn_ = PickSandwich<T>(alpha_, alpha_);
+  output_fn_ = PickSandwich<T>(m_, alpha_);
+  filter_fn_ = PickSandwich<T>(alpha_, r_);
+  output2_fn_ = PickSandwich<T>(r_, alpha_);
+  filter2_fn_ = PickSandwich<T>(alpha_, m_);
+}
+
+template <typename T>
+void Winograd<T>::TransformFilters(const T* w, int64_t k, int64_t c,
+                                   bool flip, T* u) const {
+  int64_t aa = alpha_ * alpha_;
+  int64_t rr = r_ * r_;
+  for (int64_t kk = 0; kk < k; kk++) {
+    for (int64_t c0 = 0; c0 < c; c0 += kLanes) {
+      int64_t nl = std::min(kLanes, c - c0);
+      T g[kMaxAlpha * kMaxAlpha * kLanes] = {};
+      for (int64_t lane = 0; lane < nl; lane++) {
+        const T* wkc = w + (kk * c + c0 + lane) * rr;
+        for (int64_t i = 0; i < rr; i++) {
+          g[i * kLanes + lane] = flip ? wkc[rr - 1 - i] : wkc[i];
+        }
+      }
+      T e[kMaxAlpha * kMaxAlpha * kLanes];
+      filter_fn_(g_.data(), g, e);
+      for (int64_t xi = 0; xi < aa; xi++) {
+        for (int64_t lane = 0; lane < nl; lane++) {
+          int64_t ch = c0 + lane;
+          if (flip) {
+            u[(xi * c + ch) * k + kk] = e[xi * kLanes + lane];
+          } else {
+            u[(xi * k + kk) * c + ch] = e[xi * kLanes + lane];
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename T>
+void Winograd<T>::TransformInput(const T* x, int64_t c, int64_t h, int64_t w,
+                                 int64_t p, int64_t t0, int64_t nt, int64_t th,
+                                 int64_t tw, T* v) const {
+  int64_t aa = alpha_ * alpha_;
+  for (int64_t tb = 0; tb < nt; tb += kLanes) {
+    int64_t nl = std::min(kLanes, nt - tb);
+    TilePos pos[kLanes];
+    for (int64_t lane = 0; lane < nl; lane++) {
+      pos[lane] = Locate(t0 + tb + lane, th, tw, m_);
+    }
+    for (int64_t ch = 0; ch < c; ch++) {
+      T d[kMaxAlpha * kMaxAlpha * kLanes];
+      for (int64_t lane = 0; lane < nl; lane++) {
+        Gather(x + (pos[lane].n * c + ch) * h * w, h, w, pos[lane].y - p,
+               pos[lane].x - p, alpha_, lane, d);
+      }
+      ClearLanes(aa, nl, d);
+      T e[kMaxAlpha * kMaxAlpha * kLanes];
+      input_fn_(bt_.data(), d, e);
+      for (int64_t xi = 0; xi < aa; xi++) {
+        std::copy(e + xi * kLanes, e + xi * kLanes + nl,
+                  v + (xi * c + ch) * nt + tb);
+      }
+    }
+  }
+}
+
+template <typename T>
+void Winograd<T>::Forward(const T* u, const T* x, int64_t n, int64_t c,
+                          int64_t h, int64_t w, int64_t k, int64_t p,
+                          T* out) const {
+  int64_t h2 = h + 2 * p - r_ + 1;
+  int64_t w2 = w + 2 * p - r_ + 1;
+  int64_t th = (h2 + m_ - 1) / m_;
+  int64_t tw = (w2 + m_ - 1) / m_;
+  int64_t tiles = n * th * tw;
+  int64_t aa = alpha_ * alpha_;
+  int64_t chunk = TileChunk(alpha_, c + k);
+  ParallelFor(0, (tiles + chunk - 1) / chunk, [&](int64_t begin,
+                                                  int64_t end) {
+    thread_local std::vector<T> v;
+    thread_local std::vector<T> mm;
+    v.resize(aa * c * chunk);
+    mm.resize(aa * k * chunk);
+    for (int64_t ci = begin; ci < end; ci++) {
+      int64_t t0 = ci * chunk;
+      int64_t nt = std::min(chunk, tiles - t0);
+      TransformInput(x, c, h, w, p, t0, nt, th, tw, v.data());
+      for (int64_t xi = 0; xi < aa; xi++) {
+        Gemm(k, nt, c, T(1), u + xi * k * c, c, 1, v.data() + xi * c * nt,
+             nt, 1, T(0), mm.data() + xi * k * nt, nt, 1);
+      }
+      for (int64_t tb = 0; tb < nt; tb += kLanes) {
+        int64_t nl = std::min(kLanes, nt - tb);
+        for (int64_t kk = 0; kk < k; kk++) {
+          T e[kMaxAlpha * kMaxAlpha * kLanes];
+          for (int64_t xi = 0; xi < aa; xi++) {
+            const T* src = mm.data() + (xi * k + kk) * nt + tb;
+            std::copy(src, src + nl, e + xi * kLanes);
+          }
+          ClearLanes(aa, nl, e);
+          T y[kMaxAlpha * kMaxAlpha * kLanes];
+          output_fn_(at_.data(), e, y);
+          for (int64_t lane = 0; lane < nl; lane++) {
+            TilePos pos = Locate(t0 + tb + lane, th, tw, m_);
+            T* o = out + (pos.n * k + kk) * h2 * w2;
+            for (int64_t i = 0; i < m_ && pos.y + i < h2; i++) {
+              for (int64_t j = 0; j < m_ && pos.x + j < w2; j++) {
+                o[(pos.y + i) * w2 + pos.x + j] =
+                    y[(i * m_ + j) * kLanes + lane];
+              }
+            }
+          }
+        }
+      }
+    }
+  });
+}
+
+template <typename T>
+void Winograd<T>::BackwardFilter(const T* x, const T* dout, int64_t n,
+                                 int64_t c, int64_t h, int64_t w, int64_t k,
+                                 int64_t p, T* dw) const {
+  int64_t h2 = h + 2 * p - r_ + 1;
+  int64_t w2 = w + 2 * p - r_ + 1;
+  int64_t th = (h2 + m_ - 1) / m_;
+  int64_t tw = (w2 + m_ - 1) / m_;
+  int64_t tiles = n * th * tw;
+  int64_t aa = alpha_ * alpha_;
+  int64_t chunk = TileChunk(alpha_, c + k);
+  PooledVector<T> acc(aa * k * c, T(0));
+  std::mutex mu;
+  ParallelFor(0, (tiles + chunk - 1) / chunk, [&](int64_t begin,
+                                                  int64_t end) {
+    thread_local std::vector<T> v;
+    thread_local std::vector<T> ev;
+    v.resize(aa * c * chunk);
+    ev.resize(aa * k * chunk);
+    PooledVector<T> partial(aa * k * c, T(0));
+    for (int64_t ci = begin; ci < end; ci++) {
+      int64_t t0 = ci * chunk;
+      int64_t nt = std::min(chunk, tiles - t0);
+      TransformInput(x, c, h, w, p, t0, nt, th, tw, v.data());
+      // the m x m gradient tiles act as the filters of F(r,m)
+      for (int64_t tb = 0; tb < nt; tb += kLanes) {
+        int64_t nl = std::min(kLanes, nt - tb);
+        TilePos pos[kLanes];
+        for (int64_t lane = 0; lane < nl; lane++) {
+          pos[lane] = Locate(t0 + tb + lane, th, tw, m_);
+        }
+        for (int64_t kk = 0; kk < k; kk++) {
+          T g[kMaxAlpha * kMaxAlpha * kLanes];
+          for (int64_t lane = 0; lane < nl; lane++) {
+            Gather(dout + (pos[lane].n * k + kk) * h2 * w2, h2, w2,
+                   pos[lane].y, pos[lane].x, m_, lane, g);
+          }
+          ClearLanes(m_ * m_, nl, g);
+          T e[kMaxAlpha * kMaxAlpha * kLanes];
+          filter2_fn_(g2_.data(), g, e);
+          for (int64_t xi = 0; xi < aa; xi++) {
+            std::copy(e + xi * kLanes, e + xi * kLanes + nl,
+                      ev.data() + (xi * k + kk) * nt + tb);
+          }
+        }
+      }
+      for (int64_t xi = 0; xi < aa; xi++) {
+        Gemm(k, c, nt, T(1), ev.data() + xi * k * nt, nt, 1,
+             v.data() + xi * c * nt, 1, nt, T(1),
+             partial.data() + xi * k * c, c, 1);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mu);
+    for (int64_t i = 0; i < acc.size(); i++) {
+      acc[i] += partial[i];
+    }
+  });
+  int64_t rr = r_ * r_;
+  for (int64_t kk = 0; kk < k; kk++) {
+    for (int64_t c0 = 0; c0 < c; c0 += kLanes) {
+      int64_t nl = std::min(kLanes, c - c0);
+      T e[kMaxAlpha * kMaxAlpha * kLanes] = {};
+      for (int64_t xi = 0; xi < aa; xi++) {
+        const T* src = acc.data() + (xi * k + kk) * c + c0;
+        std::copy(src, src + nl, e + xi * kLanes);
+      }
+      T y[kMaxAlpha * kMaxAlpha * kLanes];
+      output2_fn_(at2_.data(), e, y);
+      for (int64_t lane = 0; lane < nl; lane++) {
+        T* dwkc = dw + (kk * c + c0 + lane) * rr;
+        for (int64_t i = 0; i < rr; i++) {
+          dwkc[i] = y[i * kLanes + lane];
+        }
+      }
+    }
+  }
+}
+
+template class Winograd<float>;
+template class Winograd<double>;
+
+}  // namespace litecnn
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace litecnn {
+
+// Winograd minimal filtering F(m x m, r x r) for stride-1 convolutions.
+//
+// Each m x m output tile is computed from an alpha x alpha input tile
+// (alpha = m + r - 1) with alpha^2 multiplies instead of m^2 r^2. The
+// transform matrices are generated with the Cook-Toom construction over the
+// points 0, 1, -1, 2, -2, 1/2, -1/2 and infinity, so any alpha <= 8 works;
+// F(2x2,3x3), F(4x4,3x3) and F(2x2,5x5) are the useful ones. Summing over
+// channels happens in the transformed domain as alpha^2 Gemm calls.
+// Instantiated for float and double.
+template <typename T>
+class Winograd {
+ public:
+  Winograd(int64_t m, int64_t r);
+
+  int64_t m() const { return m_; }
+  int64_t r() const { return r_; }
+  int64_t alpha() const { return alpha_; }
+
+  // Transforms filters w (k,c,r,r) into u (alpha*alpha,k,c). With flip, u is
+  // (alpha*alpha,c,k) and holds the filters rotated by 180 degrees, whose
+  // correlation with the output gradient yields the input gradient.
+  void TransformFilters(const T* w, int64_t k, int64_t c, bool flip,
+                        T* u) const;
+
+  // out (n,k,h2,w2) = x (n,c,h,w), zero padded by p, correlated with the
+  // filters transformed into u. out is overwritten.
+  void Forward(const T* u, const T* x, int64_t n, int64_t c, int64_t h,
+               int64_t w, int64_t k, int64_t p, T* out) const;
+
+  // dw (k,c,r,r) = sum over the batch of x (n,c,h,w), zero padded by p,
+  // correlated with dout (n,k,h2,w2). Uses F(r x r, m x m) on m x m tiles of
+  // dout, which shares alpha and the input transform with the forward pass.
+  void BackwardFilter(const T* x, const T* dout, int64_t n, int64_t c,
+                      int64_t h, int64_t w, int64_t k, int64_t p,
+                      T* dw) const;
+
+ private:
+  // y (p,p) = a (p,q) . x (q,q) . a^T for one (p,q) combination
+  typedef void (*SandwichFn)(const T* a, const T* x, T* y);
+
+  // transforms the alpha x alpha input tiles of x into v (alpha*alpha,c,nt)
+  void TransformInput(const T* x, int64_t c, int64_t h, int64_t w, int64_t p,
+                      int64_t t0, int64_t nt, int64_t th, int64_t tw,
+                      T* v) const;
+
+  const int64_t m_;
+  const int64_t r_;
+  const int64_t alpha_;
+  std::vector<T> at_;   // (m,alpha) output transform
+  std::vector<T> g_;    // (alpha,r) filter transform
+  std::vector<T> bt_;   // (alpha,alpha) input transform
+  std::vector<T> at2_;  // (r,alpha) output transform of F(r,m)
+  std::vector<T> g2_;   // (alpha,m) filter transform of F(r,m)
+  SandwichFn input_fn_;
+  SandwichFn output_fn_;
+  SandwichFn filter_fn_;
+  SandwichFn output2_fn_;
+  SandwichFn filter2_fn_;
+};
+
+}  // namespace litecnn